@@ -0,0 +1,203 @@
+// Compares FlatAddressMap with the std::unordered_map that LeakDetectorImpl
+// used to track recorded allocs in: the time to record an alloc and its free,
+// and the memory used per tracked alloc. Both allocate from CustomAllocator.
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "base/hash.h"
+#include "flat_address_map.h"
+#include "stl_allocator.h"
+
+namespace {
+
+// Numbers of live allocs to track.
+const size_t kNumLiveAllocs[] = {10000, 100000, 1000000};
+
+// Number of frees, each followed by an alloc, timed at each size.
+const size_t kNumReplacements = 2000000;
+
+// Same layout as LeakDetectorImpl::AllocInfo.
+struct AllocInfo {
+  size_t size;
+  const void* call_stack;
+  uint32_t sequence;
+};
+
+// CustomAllocator, counting what is allocated through it.
+class CountingAllocator {
+ public:
+  static void* Allocate(size_t size) {
+    bytes_ += size;
+    ++blocks_;
+    return CustomAllocator::Allocate(size);
+  }
+
+  static void Free(void* ptr, size_t size) {
+    bytes_ -= size;
+    --blocks_;
+    CustomAllocator::Free(ptr, size);
+  }
+
+  static size_t bytes() { return bytes_; }
+  static size_t blocks() { return blocks_; }
+
+ private:
+  static size_t bytes_;
+  static size_t blocks_;
+};
+
+size_t CountingAllocator::bytes_ = 0;
+size_t CountingAllocator::blocks_ = 0;
+
+// The map that LeakDetectorImpl used before FlatAddressMap.
+struct AddressHash {
+  size_t operator()(uintptr_t addr) const {
+    return base::Hash(reinterpret_cast<const char*>(&addr), sizeof(addr));
+  }
+};
+
+using NodeMap = std::unordered_map<
+    uintptr_t,
+    AllocInfo,
+    AddressHash,
+    std::equal_to<uintptr_t>,
+    STL_Allocator<std::pair<const uintptr_t, AllocInfo>, CountingAllocator>>;
+
+using FlatMap = leak_detector::FlatAddressMap<AllocInfo>;
+
+// Initial sizes, as LeakDetectorImpl used to and now does set them.
+const size_t kNodeMapNumBuckets = 100003;
+const size_t kFlatMapInitialCapacity = 4096;
+
+double NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Operations of one map type, as LeakDetectorImpl performs them.
+void RecordAlloc(NodeMap* map, uintptr_t addr, const AllocInfo& info) {
+  map->insert(std::make_pair(addr, info));
+}
+
+void RecordFree(NodeMap* map, uintptr_t addr) {
+  auto iter = map->find(addr);
+  if (iter != map->end())
+    map->erase(iter);
+}
+
+void RecordAlloc(FlatMap* map, uintptr_t addr, const AllocInfo& info) {
+  bool inserted;
+  AllocInfo* value = map->Insert(addr, &inserted);
+  if (inserted)
+    *value = info;
+}
+
+void RecordFree(FlatMap* map, uintptr_t addr) {
+  AllocInfo* value = map->Find(addr);
+  if (value)
+    map->Erase(value);
+}
+
+struct Result {
+  double fill_ns;
+  double replace_ns;
+  double bytes_per_alloc;
+  size_t num_blocks;
+};
+
+// Records |num_live| allocs, then frees a random live alloc and records a new
+// one |kNumReplacements| times. |memory_size| returns the bytes and number of
+// blocks allocated for |map|.
+template <typename Map>
+Result Run(Map* map,
+           size_t num_live,
+           const std::function<void(size_t*, size_t*)>& memory_size) {
+  // Heap-like addresses: 16-byte aligned, spread over a few hundred MB.
+  std::mt19937_64 random(42);
+  auto random_addr = [&random]() {
+    return 0x7f0000000000 + (random() % (1 << 24)) * 16;
+  };
+  std::vector<uintptr_t> live(num_live);
+  AllocInfo info = {32, nullptr, 0};
+
+  double start_ns = NowNs();
+  for (size_t i = 0; i < num_live; ++i) {
+    live[i] = random_addr();
+    RecordAlloc(map, live[i], info);
+  }
+  double fill_ns = NowNs() - start_ns;
+
+  // Draw the victims up front, so that only the map is timed.
+  std::vector<uint32_t> victims(kNumReplacements);
+  std::vector<uintptr_t> new_addrs(kNumReplacements);
+  for (size_t i = 0; i < kNumReplacements; ++i) {
+    victims[i] = random() % num_live;
+    new_addrs[i] = random_addr();
+  }
+
+  start_ns = NowNs();
+  for (size_t i = 0; i < kNumReplacements; ++i) {
+    uintptr_t* slot = &live[victims[i]];
+    RecordFree(map, *slot);
+    *slot = new_addrs[i];
+    RecordAlloc(map, *slot, info);
+  }
+  double replace_ns = NowNs() - start_ns;
+
+  Result result;
+  result.fill_ns = fill_ns / num_live;
+  result.replace_ns = replace_ns / kNumReplacements;
+  size_t bytes;
+  memory_size(&bytes, &result.num_blocks);
+  result.bytes_per_alloc = static_cast<double>(bytes) / map->size();
+  return result;
+}
+
+void Print(const char* name, size_t num_live, const Result& result) {
+  printf("%-14s %9zu %10.1f %14.1f %11.1f %10zu\n", name, num_live,
+         result.fill_ns, result.replace_ns, result.bytes_per_alloc,
+         result.num_blocks);
+}
+
+}  // namespace
+
+int main(int /* argc */, char* /* argv */[]) {
+  CustomAllocator::Initialize();
+
+  printf("Times per alloc in ns. Memory per tracked alloc as requested from\n"
+         "CustomAllocator, not including the allocator's own header on each "
+         "of the\nblocks it was requested in.\n");
+  printf("%-14s %9s %10s %14s %11s %10s\n", "map", "live", "insert",
+         "free+insert", "bytes", "blocks");
+  for (size_t num_live : kNumLiveAllocs) {
+    {
+      NodeMap map(kNodeMapNumBuckets);
+      Result result = Run(&map, num_live, [](size_t* bytes, size_t* blocks) {
+        *bytes = CountingAllocator::bytes();
+        *blocks = CountingAllocator::blocks();
+      });
+      Print("unordered_map", num_live, result);
+    }
+    {
+      FlatMap map(kFlatMapInitialCapacity);
+      Result result =
+          Run(&map, num_live, [&map](size_t* bytes, size_t* blocks) {
+            *bytes = map.memory_size();
+            *blocks = 1;
+          });
+      Print("FlatAddressMap", num_live, result);
+    }
+  }
+
+  CustomAllocator::Shutdown();
+  return 0;
+}
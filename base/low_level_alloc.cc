@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <gperftools/spin_lock_wrapper.h>
 
 #include <new>                   // for placement-new
 
@@ -146,6 +147,8 @@ struct LowLevelAlloc::Arena {
   explicit Arena(int) : pagesize(0) {}  // set pagesize to zero explicitly
                                         // for non-static init
 
+  SpinLockWrapper mu;     // protects freelist, allocation_count,
+                          // pagesize, roundup, min_size
   AllocList freelist;     // head of free list; sorted by addr (under mu)
   int32_t allocation_count; // count of allocated blocks (under mu)
   int32_t flags;            // flags passed to NewArena (ro after init)
@@ -188,11 +191,11 @@ namespace {
         RAW_CHECK(false, "We do not yet support async-signal-safe arena.");
 #endif
       }
-//      this->arena_->mu.Lock();
+      this->arena_->mu.Lock();
     }
     ~ArenaLock() { RAW_CHECK(this->left_, "haven't left Arena region"); }
     void Leave() /*UNLOCK_FUNCTION()*/ {
-//      this->arena_->mu.Unlock();
+      this->arena_->mu.Unlock();
 #if 0
       if (this->mask_valid_) {
         pthread_sigmask(SIG_SETMASK, &this->mask_, 0);
@@ -412,7 +415,7 @@ static void *DoAllocWithArena(size_t request, LowLevelAlloc::Arena *arena) {
       }
       // we unlock before mmap() both because mmap() may call a callback hook,
       // and because it may be slow.
-      //arena->mu.Unlock();
+      arena->mu.Unlock();
       // mmap generous 64K chunks to decrease
       // the chances/impact of fragmentation:
       size_t new_pages_size = RoundUp(req_rnd, arena->pagesize * 16);
@@ -427,7 +430,7 @@ static void *DoAllocWithArena(size_t request, LowLevelAlloc::Arena *arena) {
             PROT_WRITE|PROT_READ, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
       }
       RAW_CHECK(new_pages != MAP_FAILED, "mmap error");
-//      arena->mu.Lock();
+      arena->mu.Lock();
       s = reinterpret_cast<AllocList *>(new_pages);
       s->header.size = new_pages_size;
       // Pretend the block is allocated; call AddToFreelist() to free it.
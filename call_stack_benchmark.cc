@@ -0,0 +1,263 @@
+// Compares the two ways CallStackManager can store call stacks: each as an
+// array of addrs, and as paths in a trie that share common outer frames. For
+// each, reports the memory that the manager allocates, including the tables
+// that index the call stacks, and the time to look up a call stack.
+//
+// Takes the call stacks of the allocs in a trace if one is given, and
+// otherwise generates stacks of several depths, each with outer frames shared
+// by many others, as those of an event loop and RPC dispatch would be.
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "base/hash.h"
+#include "call_stack_manager.h"
+#include "trace_reader.h"
+
+using leak_detector::CallStack;
+using leak_detector::CallStackManager;
+
+// CustomAllocator, allocating with new and delete like it does in unit tests,
+// and counting the bytes allocated through it.
+namespace {
+
+size_t g_allocated_bytes = 0;
+
+}  // namespace
+
+void CustomAllocator::Initialize() {}
+
+bool CustomAllocator::Shutdown() {
+  return true;
+}
+
+bool CustomAllocator::IsInitialized() {
+  return true;
+}
+
+void CustomAllocator::InitializeForUnitTest() {}
+
+void* CustomAllocator::Allocate(size_t size) {
+  g_allocated_bytes += size;
+  return new char[size];
+}
+
+void CustomAllocator::Free(void* ptr, size_t size) {
+  g_allocated_bytes -= size;
+  delete [] reinterpret_cast<char*>(ptr);
+}
+
+namespace {
+
+// Depths of the generated stacks.
+const int kDepths[] = {4, 8, 16, 32};
+
+// Number of stacks generated at each depth, some of them the same.
+const size_t kNumGeneratedStacks = 100000;
+
+// Generated stacks end in a few frames that vary between stacks. The rest
+// follow one of a few dispatch paths, which all start with the same frames.
+const int kNumInnerFrames = 4;
+const int kNumSharedOuterFrames = 6;
+const int kNumDispatchPaths = 64;
+const int kNumInnerAddrs = 4096;
+
+// Number of lookups timed, each of a call stack that exists already.
+const size_t kNumLookups = 2000000;
+
+// Call stacks, with frames innermost first, all in one array.
+struct StackList {
+  std::vector<const void*> frames;
+  std::vector<size_t> offsets;
+  std::vector<int> depths;
+  std::vector<uint32_t> hashes;
+
+  void Add(int depth, const void* const stack[], uint32_t hash) {
+    offsets.push_back(frames.size());
+    frames.insert(frames.end(), stack, stack + depth);
+    depths.push_back(depth);
+    hashes.push_back(hash);
+  }
+
+  size_t size() const {
+    return depths.size();
+  }
+};
+
+double NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+const void* Addr(uintptr_t addr) {
+  return reinterpret_cast<const void*>(addr);
+}
+
+void GenerateStacks(int depth, StackList* stacks) {
+  std::mt19937 rng(depth);
+  std::vector<const void*> stack(depth);
+  while (stacks->size() < kNumGeneratedStacks) {
+    int path = rng() % kNumDispatchPaths;
+    for (int i = 0; i < depth; ++i) {
+      int outer_index = depth - 1 - i;
+      if (i < kNumInnerFrames && i < depth / 2)
+        stack[i] = Addr(0x400000 + (rng() % kNumInnerAddrs) * 16);
+      else if (outer_index < kNumSharedOuterFrames)
+        stack[i] = Addr(0x800000 + outer_index * 16);
+      else
+        stack[i] = Addr(0x900000 + (path * 64 + outer_index) * 16);
+    }
+    stacks->Add(depth, stack.data(),
+                base::Hash(stack.data(), sizeof(stack[0]) * depth));
+  }
+}
+
+// Adds the call stacks of the allocs in the trace at |path|. Returns false if
+// the trace could not be read.
+bool ReadTraceStacks(const char* path, StackList* stacks) {
+  MappedTraceFile file;
+  if (!file.Open(path)) {
+    printf("Could not open %s\n", path);
+    return false;
+  }
+  TraceReader reader;
+  if (!reader.Init(file)) {
+    printf("Could not read trace: %s\n", reader.error());
+    return false;
+  }
+  const size_t kBatchSize = 256;
+  TraceEvent events[kBatchSize];
+  TraceBlock block;
+  while (reader.NextBlock(&block)) {
+    RecordDecoder decoder(block, reader.stacks());
+    while (size_t num_events = decoder.Decode(events, kBatchSize)) {
+      for (size_t i = 0; i < num_events; ++i) {
+        const TraceEvent& event = events[i];
+        if (event.type != TraceEvent::kAlloc || !event.depth)
+          continue;
+        stacks->Add(event.depth, event.stack,
+                    event.has_stack_hash
+                        ? event.stack_hash
+                        : base::Hash(event.stack,
+                                     sizeof(event.stack[0]) * event.depth));
+      }
+    }
+    if (decoder.error()) {
+      printf("Bad record at offset %lx\n", decoder.offset());
+      return false;
+    }
+  }
+  if (reader.error()) {
+    printf("Bad trace at offset %lx: %s\n", reader.offset(), reader.error());
+    return false;
+  }
+  return true;
+}
+
+struct Result {
+  size_t num_call_stacks;
+  size_t bytes;
+  double insert_ns;
+  double lookup_ns;
+};
+
+Result Run(CallStackManager::StorageType storage_type,
+           const StackList& stacks) {
+  Result result;
+  size_t bytes_before = g_allocated_bytes;
+  CallStackManager* manager = new CallStackManager;
+  manager->SetStorageType(storage_type);
+
+  double start_ns = NowNs();
+  std::vector<const CallStack*> call_stacks(stacks.size());
+  for (size_t i = 0; i < stacks.size(); ++i) {
+    call_stacks[i] = manager->GetCallStack(
+        stacks.depths[i], &stacks.frames[stacks.offsets[i]], stacks.hashes[i]);
+  }
+  result.insert_ns = (NowNs() - start_ns) / stacks.size();
+  result.num_call_stacks = manager->size();
+  // Not counting the manager object itself, which is the same size either way.
+  result.bytes = g_allocated_bytes - bytes_before;
+
+  // Check that the stacks come back intact.
+  std::vector<const void*> stack;
+  for (size_t i = 0; i < stacks.size(); ++i) {
+    stack.resize(stacks.depths[i]);
+    manager->GetStack(call_stacks[i], stack.data());
+    if (!std::equal(stack.begin(), stack.end(),
+                    &stacks.frames[stacks.offsets[i]])) {
+      printf("Stack %zu differs\n", i);
+      break;
+    }
+  }
+
+  std::mt19937 rng(1);
+  uintptr_t sum = 0;
+  start_ns = NowNs();
+  for (size_t n = 0; n < kNumLookups; ++n) {
+    size_t i = rng() % stacks.size();
+    sum += reinterpret_cast<uintptr_t>(manager->GetCallStack(
+        stacks.depths[i], &stacks.frames[stacks.offsets[i]],
+        stacks.hashes[i]));
+  }
+  result.lookup_ns = (NowNs() - start_ns) / kNumLookups;
+  // Keep the lookups live.
+  if (sum == 1)
+    printf(" ");
+
+  delete manager;
+  return result;
+}
+
+void Compare(const char* name, const StackList& stacks) {
+  Result array = Run(CallStackManager::kArrayStorage, stacks);
+  Result trie = Run(CallStackManager::kTrieStorage, stacks);
+  printf("%-8s %8zu %10.1f %10.1f %6.1f%% %8.0f %8.0f %8.0f %8.0f\n", name,
+         array.num_call_stacks,
+         static_cast<double>(array.bytes) / array.num_call_stacks,
+         static_cast<double>(trie.bytes) / trie.num_call_stacks,
+         100.0 * (array.bytes - static_cast<double>(trie.bytes)) / array.bytes,
+         array.insert_ns, trie.insert_ns, array.lookup_ns, trie.lookup_ns);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    printf("Usage: %s [TRACE]\n", argv[0]);
+    return 1;
+  }
+  printf("Memory per unique call stack, and average time per call in a pass "
+         "over all stacks\nthat adds them, and in random lookups of added "
+         "ones.\n");
+  printf("%-8s %8s %10s %10s %7s %8s %8s %8s %8s\n", "depth", "stacks",
+         "array (B)", "trie (B)", "saved", "array", "trie", "array", "trie");
+  printf("%-8s %8s %10s %10s %7s %8s %8s %8s %8s\n", "", "", "", "", "",
+         "add (ns)", "add (ns)", "find", "find");
+  if (argc == 2) {
+    StackList stacks;
+    if (!ReadTraceStacks(argv[1], &stacks))
+      return 1;
+    if (!stacks.size()) {
+      printf("No call stacks in the trace\n");
+      return 1;
+    }
+    Compare("trace", stacks);
+    return 0;
+  }
+  for (int depth : kDepths) {
+    StackList stacks;
+    GenerateStacks(depth, &stacks);
+    char name[16];
+    snprintf(name, sizeof(name), "%d", depth);
+    Compare(name, stacks);
+  }
+  return 0;
+}
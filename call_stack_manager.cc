@@ -7,55 +7,259 @@
 #include <gperftools/custom_allocator.h>
 #include <string.h>   // For memset.
 
-#include <algorithm>  // For std::copy.
+#include <algorithm>  // For std::copy and std::max.
 #include <new>
 
 #include "base/hash.h"
 
 namespace leak_detector {
 
-CallStackManager::CallStackManager() {}
+namespace {
+
+// Size of the arena blocks that call stacks are stored in.
+const size_t kArenaBlockSize = 64 * 1024;
+
+}  // namespace
+
+CallStackManager::CallStackManager()
+    : storage_type_(kArrayStorage),
+      trie_call_stack_ids_(0),
+      num_call_stacks_(0),
+      arena_block_(nullptr),
+      arena_next_(nullptr),
+      arena_end_(nullptr),
+      arena_size_(0),
+      large_records_size_(0),
+      id_chunks_size_(0),
+      next_id_(1) {
+  memset(free_records_, 0, sizeof(free_records_));
+  memset(id_chunks_, 0, sizeof(id_chunks_));
+}
 
 CallStackManager::~CallStackManager() {
   for (CallStack* call_stack : call_stacks_) {
-    CustomAllocator::Free(call_stack->stack,
-                          call_stack->depth * sizeof(*call_stack->stack));
-    CustomAllocator::Free(call_stack, sizeof(CallStack));
+    if (call_stack->depth > kMaxArenaDepth)
+      CustomAllocator::Free(call_stack, RecordSize(call_stack->depth));
   }
   call_stacks_.clear();
+  // Records of call stacks in the trie are all in the arena.
+  for (CallStack**& chunk : id_chunks_) {
+    if (chunk)
+      CustomAllocator::Free(chunk, sizeof(*chunk) * kIdChunkSize);
+  }
+  while (arena_block_) {
+    ArenaBlock* prev = arena_block_->prev;
+    CustomAllocator::Free(arena_block_, arena_block_->size);
+    arena_block_ = prev;
+  }
+}
+
+void CallStackManager::SetStorageType(StorageType storage_type) {
+  storage_type_ = storage_type;
 }
 
 const CallStack* CallStackManager::GetCallStack(
     int depth, const void* const stack[]) {
+  // This is the only place where the call stack's hash is computed. This value
+  // can be reused in the created object to avoid further hash computation.
+  return GetCallStack(
+      depth, stack,
+      base::Hash(reinterpret_cast<const char*>(stack), sizeof(*stack) * depth));
+}
+
+const CallStack* CallStackManager::GetCallStack(
+    int depth, const void* const stack[], uint32_t hash) {
+  if (storage_type_ == kTrieStorage)
+    return GetCallStackInTrie(depth, stack, hash);
+
   // Temporarily create a call stack object for lookup in |call_stacks_|.
   CallStack temp;
   temp.depth = depth;
   temp.stack = const_cast<const void**>(stack);
-  // This is the only place where the call stack's hash is computed. This value
-  // can be reused in the created object to avoid further hash computation.
-  temp.hash =
-      base::Hash(reinterpret_cast<const char*>(stack), sizeof(*stack) * depth);
+  temp.hash = hash;
 
   auto iter = call_stacks_.find(&temp);
-  if (iter != call_stacks_.end())
+  if (iter != call_stacks_.end()) {
+    ++(*iter)->num_refs;
     return *iter;
+  }
+
+  uint32_t id = AllocateId();
+  if (!id)
+    return nullptr;
 
   // Since |call_stacks_| stores CallStack pointers rather than actual objects,
-  // create new call objects manually here.
-  CallStack* call_stack =
-      new(CustomAllocator::Allocate(sizeof(CallStack))) CallStack;
+  // create new call objects manually here. Each is stored along with its
+  // addrs, so that comparing call stacks touches a single record.
+  CallStack* call_stack = AllocateRecord(depth);
   memset(call_stack, 0, sizeof(*call_stack));
   call_stack->depth = depth;
+  call_stack->id = id;
   call_stack->hash = temp.hash;  // Don't run the hash function again.
-  call_stack->stack =
-      reinterpret_cast<const void**>(
-          CustomAllocator::Allocate(sizeof(*stack) * depth));
+  call_stack->stack = reinterpret_cast<const void**>(call_stack + 1);
+  call_stack->num_refs = 1;
   std::copy(stack, stack + depth, call_stack->stack);
 
   call_stacks_.insert(call_stack);
+  id_chunks_[id / kIdChunkSize][id % kIdChunkSize] = call_stack;
+  ++num_call_stacks_;
+  return call_stack;
+}
+
+const CallStack* CallStackManager::GetCallStackInTrie(
+    int depth, const void* const stack[], uint32_t hash) {
+  uint32_t node_id = trie_.Find(depth, stack);
+  if (node_id) {
+    uint32_t* id = trie_call_stack_ids_.Find(node_id);
+    if (id) {
+      CallStack* call_stack = GetMutableCallStackById(*id);
+      ++call_stack->num_refs;
+      return call_stack;
+    }
+  }
+
+  // The path of a new call stack may exist already as part of those of deeper
+  // ones, in which case it only gains references.
+  uint32_t id = AllocateId();
+  if (!id)
+    return nullptr;
+  node_id = trie_.Insert(depth, stack);
+  if (!node_id) {
+    free_ids_.push_back(id);
+    return nullptr;
+  }
+
+  CallStack* call_stack = AllocateRecord(0);
+  memset(call_stack, 0, sizeof(*call_stack));
+  call_stack->depth = depth;
+  call_stack->id = id;
+  call_stack->hash = hash;
+  call_stack->trie_node_id = node_id;
+  call_stack->num_refs = 1;
+
+  bool inserted;
+  *trie_call_stack_ids_.Insert(node_id, &inserted) = id;
+  id_chunks_[id / kIdChunkSize][id % kIdChunkSize] = call_stack;
+  ++num_call_stacks_;
   return call_stack;
 }
 
+void CallStackManager::GetStack(const CallStack* call_stack,
+                                const void* stack[]) const {
+  if (storage_type_ == kTrieStorage)
+    trie_.GetStack(call_stack->trie_node_id, call_stack->depth, stack);
+  else
+    std::copy(call_stack->stack, call_stack->stack + call_stack->depth, stack);
+}
+
+void CallStackManager::ReleaseCallStack(uint32_t id) {
+  CallStack* call_stack = GetMutableCallStackById(id);
+  if (--call_stack->num_refs == 0 && !call_stack->unreferenced) {
+    call_stack->unreferenced = true;
+    newly_unreferenced_ids_.push_back(id);
+  }
+}
+
+void CallStackManager::ReclaimUnreferenced() {
+  // Free the call stacks that had no references at the previous call either.
+  for (uint32_t id : unreferenced_ids_) {
+    CallStack* call_stack = GetMutableCallStackById(id);
+    if (call_stack->num_refs) {
+      call_stack->unreferenced = false;
+      continue;
+    }
+    Reclaim(call_stack);
+  }
+  unreferenced_ids_.clear();
+
+  // The ones that have lost their references since then get another round.
+  for (uint32_t id : newly_unreferenced_ids_) {
+    CallStack* call_stack = GetMutableCallStackById(id);
+    if (call_stack->num_refs)
+      call_stack->unreferenced = false;
+    else
+      unreferenced_ids_.push_back(id);
+  }
+  newly_unreferenced_ids_.clear();
+}
+
+uint32_t CallStackManager::AllocateId() {
+  uint32_t id;
+  if (!free_ids_.empty()) {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  } else {
+    if (next_id_ > kMaxCallStacks)
+      return 0;
+    id = next_id_++;
+  }
+  CallStack**& id_chunk = id_chunks_[id / kIdChunkSize];
+  if (!id_chunk) {
+    id_chunk = static_cast<CallStack**>(
+        CustomAllocator::Allocate(sizeof(*id_chunk) * kIdChunkSize));
+    id_chunks_size_ += sizeof(*id_chunk) * kIdChunkSize;
+  }
+  return id;
+}
+
+void CallStackManager::Reclaim(CallStack* call_stack) {
+  uint32_t id = call_stack->id;
+  if (storage_type_ == kTrieStorage) {
+    trie_call_stack_ids_.Erase(
+        trie_call_stack_ids_.Find(call_stack->trie_node_id));
+    trie_.Release(call_stack->trie_node_id);
+  } else {
+    call_stacks_.erase(call_stack);
+  }
+  id_chunks_[id / kIdChunkSize][id % kIdChunkSize] = nullptr;
+  free_ids_.push_back(id);
+  --num_call_stacks_;
+  FreeRecord(call_stack);
+}
+
+CallStack* CallStackManager::AllocateRecord(uint32_t depth) {
+  if (depth > kMaxArenaDepth) {
+    large_records_size_ += RecordSize(depth);
+    return static_cast<CallStack*>(CustomAllocator::Allocate(RecordSize(depth)));
+  }
+  CallStack* call_stack = free_records_[depth];
+  if (call_stack) {
+    free_records_[depth] = reinterpret_cast<CallStack*>(call_stack->stack);
+    return call_stack;
+  }
+  return new(AllocateFromArena(RecordSize(depth))) CallStack;
+}
+
+void CallStackManager::FreeRecord(CallStack* call_stack) {
+  uint32_t depth = RecordDepth(call_stack);
+  if (depth > kMaxArenaDepth) {
+    large_records_size_ -= RecordSize(depth);
+    CustomAllocator::Free(call_stack, RecordSize(depth));
+    return;
+  }
+  call_stack->stack = reinterpret_cast<const void**>(free_records_[depth]);
+  free_records_[depth] = call_stack;
+}
+
+void* CallStackManager::AllocateFromArena(size_t size) {
+  size = (size + alignof(CallStack) - 1) & ~(alignof(CallStack) - 1);
+  if (size > static_cast<size_t>(arena_end_ - arena_next_)) {
+    // The rest of the current block, if any, goes unused.
+    size_t block_size = std::max(kArenaBlockSize, sizeof(ArenaBlock) + size);
+    ArenaBlock* block =
+        static_cast<ArenaBlock*>(CustomAllocator::Allocate(block_size));
+    block->prev = arena_block_;
+    block->size = block_size;
+    arena_block_ = block;
+    arena_next_ = reinterpret_cast<char*>(block + 1);
+    arena_end_ = reinterpret_cast<char*>(block) + block_size;
+    arena_size_ += block_size;
+  }
+  void* result = arena_next_;
+  arena_next_ += size;
+  return result;
+}
+
 bool CallStackManager::CallStackPointerEqual::operator() (
     const CallStack* c1, const CallStack* c2) const {
   return c1->depth == c2->depth &&
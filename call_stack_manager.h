@@ -9,40 +9,170 @@
 #include <stdint.h>
 
 #include <unordered_set>
+#include <vector>
 
 #include "base/macros.h"
+#include "components/metrics/leak_detector/call_stack_trie.h"
+#include "components/metrics/leak_detector/flat_address_map.h"
 #include "components/metrics/leak_detector/stl_allocator.h"
 
 namespace leak_detector {
 
-// Struct to represent a call stack.
+// Struct to represent a call stack. In those created by CallStackManager,
+// |stack| points to the addrs that follow the struct in the same record,
+// unless the manager stores call stacks in a trie. See
+// CallStackManager::StorageType.
 struct CallStack {
   uint32_t depth;                        // Depth of current call stack.
-  const void** stack;                    // Call stack as an array of addrs.
+  uint32_t id;                           // See CallStackManager.
+  union {
+    const void** stack;                  // Call stack as an array of addrs.
+    uint32_t trie_node_id;               // Or its path in the trie.
+  };
+
+  uint32_t hash;                         // Hash of call stack.
 
-  size_t hash;                           // Hash of call stack.
+  // Reference count and reclamation state, for CallStackManager's use.
+  uint32_t num_refs : 31;
+  uint32_t unreferenced : 1;
 };
 
 // Maintains and owns all unique call stack objects.
+//
+// Each call stack is given a nonzero id, by which it can be looked up. Ids
+// take half the space of pointers, so they are what other classes keep to
+// refer to call stacks, and 0 can stand for no call stack.
+//
+// Call stacks are reference counted, and those left without references are
+// freed by ReclaimUnreferenced(), after which their ids and memory go to new
+// call stacks. Ids count up from 1, with those of reclaimed call stacks used
+// first.
 class CallStackManager {
  public:
+  // Ways of storing the addrs of the call stacks.
+  enum StorageType {
+    // In the record of each call stack, as CallStack::stack.
+    kArrayStorage,
+
+    // In a CallStackTrie, where call stacks share the nodes of the outer
+    // frames they have in common. Takes less memory for deep call stacks, at
+    // the cost of a hash table probe per frame on each lookup. CallStack::stack
+    // is not set, so the addrs must be read with GetStack().
+    kTrieStorage,
+  };
+
+  // Number of call stacks that can exist at once. GetCallStack() returns null
+  // for new call stacks beyond this.
+  static const uint32_t kMaxCallStacks = (1 << 24) - 1;
+
   CallStackManager();
   ~CallStackManager();
 
+  // Sets how the addrs of the call stacks are stored. Defaults to
+  // kArrayStorage. Call before getting any call stacks.
+  void SetStorageType(StorageType storage_type);
+
   // Returns a CallStack object for a given call stack. Each unique call stack
   // has its own CallStack object. If the given call stack has already been
   // created by a previous call to this function, return a pointer to that same
   // call stack object.
   //
   // Returns the call stacks as const pointers because no caller should take
-  // ownership of them and modify or delete them.
+  // ownership of them and modify or delete them. Instead, each call adds a
+  // reference to the call stack, which the caller drops with
+  // ReleaseCallStack() once it no longer refers to it.
   const CallStack* GetCallStack(int depth, const void* const stack[]);
 
+  // Same as above, but takes the already computed base::Hash() of |stack| so
+  // that it need not be hashed again.
+  const CallStack* GetCallStack(int depth,
+                                const void* const stack[],
+                                uint32_t hash);
+
+  // Drops a reference added by GetCallStack() to the call stack with |id|.
+  void ReleaseCallStack(uint32_t id);
+
+  // Frees the call stacks that had no references at the previous call and
+  // still have none, so that an id of an unreferenced call stack stays valid
+  // until the second call after the last reference to it was dropped. Code
+  // that keeps such ids, like the leak analysis of the counts of the call
+  // stacks, must be done with them by then.
+  void ReclaimUnreferenced();
+
+  // Returns the call stack with |id|, which must have been returned by
+  // GetCallStack() and not been reclaimed. Call stacks do not move once
+  // created, so this may run concurrently with GetCallStack(), as long as
+  // whatever passed on |id| synchronizes with the call that returned it.
+  const CallStack* GetCallStackById(uint32_t id) const {
+    return id_chunks_[id / kIdChunkSize][id % kIdChunkSize];
+  }
+
+  // Copies the addrs of |call_stack|, which must have been returned by
+  // GetCallStack(), to |stack|, which must have room for all of them. As with
+  // GetCallStackById(), this may run concurrently with GetCallStack().
+  void GetStack(const CallStack* call_stack, const void* stack[]) const;
+
+  // Returns the number of call stacks that have not been reclaimed.
   size_t size() const {
-    return call_stacks_.size();
+    return num_call_stacks_;
+  }
+
+  // Returns the number of bytes allocated for storing call stacks, including
+  // the trie if there is one, and looking them up by id, not counting the hash
+  // table that indexes them. Memory of reclaimed call stacks is reused for new
+  // ones, but not freed.
+  size_t memory_size() const {
+    return arena_size_ + id_chunks_size_ + large_records_size_ +
+           trie_.memory_size();
   }
 
  private:
+  // Header of each block of the arena that call stacks are stored in. The
+  // blocks are allocated with CustomAllocator, and chained from the most
+  // recent one back.
+  struct ArenaBlock {
+    ArenaBlock* prev;
+    size_t size;
+  };
+
+  // Call stacks up to this depth are stored in the arena, and their records
+  // are put on free lists by depth when reclaimed. Deeper ones are allocated
+  // and freed individually.
+  static const uint32_t kMaxArenaDepth = 64;
+
+  // Returns |size| bytes from the arena, aligned for a CallStack. They stay
+  // allocated until the manager is destroyed.
+  void* AllocateFromArena(size_t size);
+
+  // Returns memory for a call stack of |depth| addrs, and frees it.
+  CallStack* AllocateRecord(uint32_t depth);
+  void FreeRecord(CallStack* call_stack);
+
+  // Returns the number of addrs in the record of |call_stack|.
+  uint32_t RecordDepth(const CallStack* call_stack) const {
+    return storage_type_ == kTrieStorage ? 0 : call_stack->depth;
+  }
+
+  // Returns a new id for a call stack, or 0 if there is none left.
+  uint32_t AllocateId();
+
+  // GetCallStack() for kTrieStorage.
+  const CallStack* GetCallStackInTrie(int depth,
+                                      const void* const stack[],
+                                      uint32_t hash);
+
+  // Frees a call stack that has no references.
+  void Reclaim(CallStack* call_stack);
+
+  // Returns the number of bytes in the record of a call stack of |depth|.
+  static size_t RecordSize(uint32_t depth) {
+    return sizeof(CallStack) + sizeof(const void*) * depth;
+  }
+
+  CallStack* GetMutableCallStackById(uint32_t id) {
+    return id_chunks_[id / kIdChunkSize][id % kIdChunkSize];
+  }
+
   // Allocator class for unique call stacks.
   using CallStackPointerAllocator = STL_Allocator<CallStack*, CustomAllocator>;
 
@@ -61,13 +191,61 @@ class CallStackManager {
     bool operator() (const CallStack* c1, const CallStack* c2) const;
   };
 
-  // Holds all call stack objects. Each object is allocated elsewhere and stored
-  // as a pointer because the container may rearrange itself internally.
+  StorageType storage_type_;
+
+  // Holds all call stack objects under kArrayStorage. Each object is allocated
+  // elsewhere and stored as a pointer because the container may rearrange
+  // itself internally.
   std::unordered_set<CallStack*,
                      CallStackPointerStoredHash,
                      CallStackPointerEqual,
                      CallStackPointerAllocator> call_stacks_;
 
+  // Under kTrieStorage, the addrs of all call stacks, and the id of the call
+  // stack whose path ends at each trie node that ends one.
+  CallStackTrie trie_;
+  FlatAddressMap<uint32_t> trie_call_stack_ids_;
+
+  size_t num_call_stacks_;
+
+  // The most recently allocated arena block, and the part of it that is not
+  // used yet. Only the most recent block is allocated from.
+  ArenaBlock* arena_block_;
+  char* arena_next_;
+  char* arena_end_;
+
+  // Total size of the arena blocks.
+  size_t arena_size_;
+
+  // Reclaimed records of call stacks in the arena, by depth, linked through
+  // CallStack::stack.
+  CallStack* free_records_[kMaxArenaDepth + 1];
+
+  // Total size of the records of call stacks deeper than |kMaxArenaDepth|.
+  size_t large_records_size_;
+
+  // The call stacks by id, in chunks of |kIdChunkSize| that are allocated as
+  // needed. Once set, a chunk pointer does not change until the manager is
+  // destroyed, nor does a call stack pointer until the call stack is
+  // reclaimed, which is what makes GetCallStackById() safe to call alongside
+  // GetCallStack(). Id 0 has no call stack.
+  static const size_t kIdChunkSize = 4096;
+  CallStack** id_chunks_[(kMaxCallStacks + 1) / kIdChunkSize];
+  size_t id_chunks_size_;
+
+  // Next id that has never been used, and the ids of reclaimed call stacks.
+  uint32_t next_id_;
+  std::vector<uint32_t, STL_Allocator<uint32_t, CustomAllocator>> free_ids_;
+
+  // Ids of call stacks that have lost their last reference since the previous
+  // ReclaimUnreferenced(), and of those that had no references at that call,
+  // all with CallStack::unreferenced set. A call stack is in one of them at
+  // most.
+  std::vector<uint32_t, STL_Allocator<uint32_t, CustomAllocator>>
+      newly_unreferenced_ids_;
+  std::vector<uint32_t, STL_Allocator<uint32_t, CustomAllocator>>
+      unreferenced_ids_;
+
   DISALLOW_COPY_AND_ASSIGN(CallStackManager);
 };
 
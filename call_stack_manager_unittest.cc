@@ -0,0 +1,290 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/call_stack_manager.h"
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Some test call stacks.
+const void* kRawStack0[] = {
+  reinterpret_cast<const void*>(0xaabbccdd),
+  reinterpret_cast<const void*>(0x11223344),
+  reinterpret_cast<const void*>(0x55667788),
+  reinterpret_cast<const void*>(0x99887766),
+};
+const void* kRawStack1[] = {
+  reinterpret_cast<const void*>(0xdeadbeef),
+  reinterpret_cast<const void*>(0x900df00d),
+  reinterpret_cast<const void*>(0xcafedeed),
+};
+
+}  // namespace
+
+class CallStackManagerTest : public ::testing::Test {
+ public:
+  CallStackManagerTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(CallStackManagerTest);
+};
+
+TEST_F(CallStackManagerTest, NewStacks) {
+  CallStackManager manager;
+  EXPECT_EQ(0U, manager.size());
+  EXPECT_EQ(0U, manager.memory_size());
+
+  const CallStack* stack0 =
+      manager.GetCallStack(arraysize(kRawStack0), kRawStack0);
+  ASSERT_TRUE(stack0);
+  EXPECT_EQ(arraysize(kRawStack0), stack0->depth);
+  // The addrs are copied.
+  EXPECT_NE(kRawStack0, stack0->stack);
+  for (size_t i = 0; i < arraysize(kRawStack0); ++i)
+    EXPECT_EQ(kRawStack0[i], stack0->stack[i]);
+
+  const CallStack* stack1 =
+      manager.GetCallStack(arraysize(kRawStack1), kRawStack1);
+  ASSERT_TRUE(stack1);
+  EXPECT_NE(stack0, stack1);
+  EXPECT_EQ(arraysize(kRawStack1), stack1->depth);
+  EXPECT_EQ(2U, manager.size());
+  EXPECT_GT(manager.memory_size(), 0U);
+
+  // Ids count up from 1.
+  EXPECT_EQ(1U, stack0->id);
+  EXPECT_EQ(2U, stack1->id);
+  EXPECT_EQ(stack0, manager.GetCallStackById(1));
+  EXPECT_EQ(stack1, manager.GetCallStackById(2));
+}
+
+TEST_F(CallStackManagerTest, SameStack) {
+  CallStackManager manager;
+  const CallStack* stack0 =
+      manager.GetCallStack(arraysize(kRawStack0), kRawStack0);
+
+  // A copy of the same call stack gets the same object.
+  std::vector<const void*> copy(kRawStack0, kRawStack0 + arraysize(kRawStack0));
+  EXPECT_EQ(stack0, manager.GetCallStack(copy.size(), copy.data()));
+  EXPECT_EQ(stack0, manager.GetCallStack(copy.size(), copy.data(),
+                                         static_cast<uint32_t>(stack0->hash)));
+
+  // A prefix of it does not, and gets the next id.
+  const CallStack* prefix = manager.GetCallStack(copy.size() - 1, copy.data());
+  EXPECT_NE(stack0, prefix);
+  EXPECT_EQ(2U, prefix->id);
+  EXPECT_EQ(2U, manager.size());
+}
+
+TEST_F(CallStackManagerTest, ManyStacks) {
+  // Enough call stacks to take several arena blocks, and some too deep to fit
+  // into one.
+  CallStackManager manager;
+  std::vector<const CallStack*> call_stacks;
+  std::vector<std::vector<const void*>> raw_stacks;
+  for (uintptr_t i = 0; i < 10000; ++i) {
+    size_t depth = i % 100 ? 1 + i % 16 : 20000;
+    std::vector<const void*> raw_stack(depth);
+    for (size_t j = 0; j < depth; ++j)
+      raw_stack[j] = reinterpret_cast<const void*>(i * 1000 + j);
+    call_stacks.push_back(manager.GetCallStack(depth, raw_stack.data()));
+    raw_stacks.push_back(std::move(raw_stack));
+  }
+  EXPECT_EQ(call_stacks.size(), manager.size());
+
+  for (size_t i = 0; i < call_stacks.size(); ++i) {
+    const CallStack* call_stack = call_stacks[i];
+    ASSERT_EQ(raw_stacks[i].size(), call_stack->depth);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(call_stack) % alignof(CallStack));
+    EXPECT_TRUE(std::equal(raw_stacks[i].begin(), raw_stacks[i].end(),
+                           call_stack->stack));
+    EXPECT_EQ(call_stack, manager.GetCallStack(raw_stacks[i].size(),
+                                               raw_stacks[i].data()));
+    EXPECT_EQ(i + 1, call_stack->id);
+    EXPECT_EQ(call_stack, manager.GetCallStackById(call_stack->id));
+  }
+}
+
+TEST_F(CallStackManagerTest, ReclaimUnreferenced) {
+  CallStackManager manager;
+  const CallStack* stack0 =
+      manager.GetCallStack(arraysize(kRawStack0), kRawStack0);
+  manager.GetCallStack(arraysize(kRawStack0), kRawStack0);
+  const CallStack* stack1 =
+      manager.GetCallStack(arraysize(kRawStack1), kRawStack1);
+  uint32_t id0 = stack0->id;
+  uint32_t id1 = stack1->id;
+
+  // An unreferenced call stack lasts until the second reclamation.
+  manager.ReleaseCallStack(id0);
+  manager.ReleaseCallStack(id1);
+  manager.ReclaimUnreferenced();
+  EXPECT_EQ(2U, manager.size());
+  EXPECT_EQ(stack1, manager.GetCallStackById(id1));
+  manager.ReclaimUnreferenced();
+  EXPECT_EQ(1U, manager.size());
+  EXPECT_FALSE(manager.GetCallStackById(id1));
+
+  // Stack 0 still has a reference.
+  EXPECT_EQ(stack0, manager.GetCallStackById(id0));
+  EXPECT_EQ(stack0, manager.GetCallStack(arraysize(kRawStack0), kRawStack0));
+
+  // A new call stack reuses the id and memory of the reclaimed one.
+  size_t memory_size = manager.memory_size();
+  const CallStack* stack2 =
+      manager.GetCallStack(arraysize(kRawStack1) - 1, kRawStack1);
+  EXPECT_EQ(id1, stack2->id);
+  EXPECT_EQ(stack2, manager.GetCallStackById(id1));
+  EXPECT_EQ(memory_size, manager.memory_size());
+  EXPECT_EQ(2U, manager.size());
+}
+
+TEST_F(CallStackManagerTest, ReferencedAgain) {
+  CallStackManager manager;
+  const CallStack* stack0 =
+      manager.GetCallStack(arraysize(kRawStack0), kRawStack0);
+  manager.ReleaseCallStack(stack0->id);
+  manager.ReclaimUnreferenced();
+
+  // Getting the call stack again before it is reclaimed keeps it.
+  EXPECT_EQ(stack0, manager.GetCallStack(arraysize(kRawStack0), kRawStack0));
+  manager.ReclaimUnreferenced();
+  manager.ReclaimUnreferenced();
+  EXPECT_EQ(stack0, manager.GetCallStackById(stack0->id));
+
+  // And it can lose its references again.
+  manager.ReleaseCallStack(stack0->id);
+  manager.ReclaimUnreferenced();
+  manager.ReclaimUnreferenced();
+  EXPECT_EQ(0U, manager.size());
+}
+
+TEST_F(CallStackManagerTest, SteadyStateMemory) {
+  // Call stacks that come and go take no more memory over time, including
+  // those too deep for the arena.
+  CallStackManager manager;
+  size_t memory_size = 0;
+  for (uintptr_t round = 0; round < 20; ++round) {
+    std::vector<uint32_t> ids;
+    for (uintptr_t i = 0; i < 1000; ++i) {
+      size_t depth = i % 100 ? 1 + i % 16 : 200;
+      std::vector<const void*> raw_stack(depth);
+      for (size_t j = 0; j < depth; ++j)
+        raw_stack[j] = reinterpret_cast<const void*>(round << 32 | i << 8 | j);
+      const CallStack* call_stack =
+          manager.GetCallStack(depth, raw_stack.data());
+      ASSERT_TRUE(call_stack);
+      EXPECT_LE(call_stack->id, 2000U);
+      ids.push_back(call_stack->id);
+    }
+    for (uint32_t id : ids)
+      manager.ReleaseCallStack(id);
+    manager.ReclaimUnreferenced();
+
+    if (round == 1)
+      memory_size = manager.memory_size();
+    if (round > 1) {
+      EXPECT_EQ(memory_size, manager.memory_size());
+    }
+  }
+  manager.ReclaimUnreferenced();
+  EXPECT_EQ(0U, manager.size());
+}
+
+TEST_F(CallStackManagerTest, TrieStorage) {
+  CallStackManager manager;
+  manager.SetStorageType(CallStackManager::kTrieStorage);
+
+  const CallStack* stack0 =
+      manager.GetCallStack(arraysize(kRawStack0), kRawStack0);
+  ASSERT_TRUE(stack0);
+  EXPECT_EQ(arraysize(kRawStack0), stack0->depth);
+  EXPECT_EQ(1U, stack0->id);
+  EXPECT_EQ(stack0, manager.GetCallStackById(1));
+
+  // A copy of the same call stack gets the same object.
+  std::vector<const void*> copy(kRawStack0, kRawStack0 + arraysize(kRawStack0));
+  EXPECT_EQ(stack0, manager.GetCallStack(copy.size(), copy.data()));
+
+  // Its outer frames are a path of the trie already, but not a call stack yet.
+  const CallStack* outer =
+      manager.GetCallStack(copy.size() - 1, copy.data() + 1);
+  ASSERT_TRUE(outer);
+  EXPECT_NE(stack0, outer);
+  EXPECT_EQ(2U, outer->id);
+  EXPECT_EQ(outer, manager.GetCallStack(copy.size() - 1, copy.data() + 1));
+
+  const CallStack* stack1 =
+      manager.GetCallStack(arraysize(kRawStack1), kRawStack1);
+  EXPECT_EQ(3U, manager.size());
+
+  const void* stack[arraysize(kRawStack0)];
+  manager.GetStack(stack0, stack);
+  for (size_t i = 0; i < arraysize(kRawStack0); ++i)
+    EXPECT_EQ(kRawStack0[i], stack[i]);
+  manager.GetStack(stack1, stack);
+  for (size_t i = 0; i < arraysize(kRawStack1); ++i)
+    EXPECT_EQ(kRawStack1[i], stack[i]);
+
+  // Reclaiming the call stack at the end of a path leaves the one on it.
+  manager.ReleaseCallStack(stack0->id);
+  manager.ReleaseCallStack(stack0->id);
+  manager.ReclaimUnreferenced();
+  manager.ReclaimUnreferenced();
+  EXPECT_EQ(2U, manager.size());
+  EXPECT_FALSE(manager.GetCallStackById(1));
+  manager.GetStack(outer, stack);
+  for (size_t i = 0; i < outer->depth; ++i)
+    EXPECT_EQ(kRawStack0[i + 1], stack[i]);
+
+  // And a new call stack gets its id.
+  const CallStack* stack2 = manager.GetCallStack(copy.size(), copy.data());
+  EXPECT_EQ(1U, stack2->id);
+  EXPECT_EQ(3U, manager.size());
+}
+
+TEST_F(CallStackManagerTest, TrieStorageSharesCallers) {
+  // Deep call stacks with the same outer frames take less memory in the trie.
+  const size_t kDepth = 32;
+  size_t memory_sizes[2];
+  for (int trie = 0; trie < 2; ++trie) {
+    CallStackManager manager;
+    if (trie)
+      manager.SetStorageType(CallStackManager::kTrieStorage);
+    for (uintptr_t i = 0; i < 10000; ++i) {
+      std::vector<const void*> raw_stack(kDepth);
+      for (size_t j = 0; j < kDepth; ++j) {
+        uintptr_t addr = j < 4 ? i * 1000 + j : (i % 10) * 1000 + j;
+        raw_stack[j] = reinterpret_cast<const void*>(addr);
+      }
+      const CallStack* call_stack =
+          manager.GetCallStack(kDepth, raw_stack.data());
+      ASSERT_TRUE(call_stack);
+      const void* stack[kDepth];
+      manager.GetStack(call_stack, stack);
+      EXPECT_TRUE(std::equal(raw_stack.begin(), raw_stack.end(), stack));
+    }
+    EXPECT_EQ(10000U, manager.size());
+    memory_sizes[trie] = manager.memory_size();
+  }
+  EXPECT_LT(memory_sizes[1] * 2, memory_sizes[0]);
+}
+
+}  // namespace leak_detector
@@ -6,7 +6,7 @@
 
 #include <utility>
 
-#include "components/metrics/leak_detector/call_stack_manager.h"
+#include "components/metrics/leak_detector/count_kernels.h"
 
 namespace leak_detector {
 
@@ -16,60 +16,95 @@ using ValueType = LeakDetectorValueType;
 
 // Get the top |kRankedListSize| entries.
 const int kRankedListSize = 16;
+static_assert(kRankedListSize <= kMaxSelectedCounts,
+              "Ranked lists are filled in with SelectTopCounts().");
 
-// Initial number of hash table buckets.
-const int kInitialHashTableSize = 1999;
+// Initial number of hash table slots.
+const size_t kInitialHashTableSize = 64;
 
 }  // namespace
 
-size_t CallStackTable::StoredHash::operator() (
-    const CallStack* call_stack) const {
-  // The call stack object should already have a hash computed when it was
-  // created.
-  //
-  // This is NOT the actual hash computation function for a new call stack.
-  return call_stack->hash;
-}
-
 CallStackTable::CallStackTable(int call_stack_suspicion_threshold)
     : num_allocs_(0),
       num_frees_(0),
+      changed_(true),
       entry_map_(kInitialHashTableSize),
       leak_analyzer_(kRankedListSize, call_stack_suspicion_threshold) {
 }
 
 CallStackTable::~CallStackTable() {}
 
-void CallStackTable::Add(const CallStack* call_stack) {
-  auto iter = entry_map_.find(call_stack);
-  Entry* entry = nullptr;
-  if (iter == entry_map_.end()) {
-    entry = &entry_map_[call_stack];
-  } else {
-    entry = &iter->second;
-  }
+void CallStackTable::Add(uint32_t call_stack_id) {
+  bool inserted;
+  Entry* entry = entry_map_.Insert(call_stack_id, &inserted);
+  if (inserted)
+    entry->net_num_allocs = 0;
 
   ++entry->net_num_allocs;
   ++num_allocs_;
+  changed_ = true;
 }
 
-void CallStackTable::Remove(const CallStack* call_stack) {
-  auto iter = entry_map_.find(call_stack);
-  if (iter == entry_map_.end())
+void CallStackTable::Remove(uint32_t call_stack_id) {
+  Entry* entry = entry_map_.Find(call_stack_id);
+  if (!entry)
     return;
-  Entry* entry = &iter->second;
   --entry->net_num_allocs;
   ++num_frees_;
+  changed_ = true;
 
   // Delete zero-alloc entries to free up space.
   if (entry->net_num_allocs == 0)
-    entry_map_.erase(iter);
+    entry_map_.Erase(entry);
 }
 
 size_t CallStackTable::Dump(const size_t buffer_size, char* buffer) const {
+  Snapshot snapshot;
+  TakeSnapshot(&snapshot);
+  return Dump(snapshot, buffer_size, buffer);
+}
+
+void CallStackTable::TestForLeaks() {
+  Snapshot snapshot;
+  TakeSnapshot(&snapshot);
+  TestForLeaks(snapshot);
+}
+
+void CallStackTable::TakeSnapshot(Snapshot* snapshot) const {
+  snapshot->num_allocs = num_allocs_;
+  snapshot->num_frees = num_frees_;
+  snapshot->num_call_stacks = entry_map_.size();
+  snapshot->has_counts = true;
+  snapshot->call_stack_ids.clear();
+  snapshot->net_num_allocs.clear();
+  snapshot->call_stack_ids.reserve(entry_map_.size());
+  snapshot->net_num_allocs.reserve(entry_map_.size());
+  entry_map_.ForEach([snapshot](uintptr_t call_stack_id, const Entry& entry) {
+    snapshot->call_stack_ids.push_back(call_stack_id);
+    snapshot->net_num_allocs.push_back(entry.net_num_allocs);
+  });
+}
+
+void CallStackTable::TakeSnapshotOfChanges(Snapshot* snapshot) {
+  if (changed_) {
+    TakeSnapshot(snapshot);
+    changed_ = false;
+    return;
+  }
+  snapshot->num_allocs = num_allocs_;
+  snapshot->num_frees = num_frees_;
+  snapshot->num_call_stacks = entry_map_.size();
+  snapshot->has_counts = false;
+  snapshot->call_stack_ids.clear();
+  snapshot->net_num_allocs.clear();
+}
+
+size_t CallStackTable::Dump(const Snapshot& snapshot,
+                            const size_t buffer_size,
+                            char* buffer) const {
   size_t size_left = buffer_size;
 
-  if (entry_map_.empty())
+  if (!snapshot.num_call_stacks)
     return size_left;
 
   int attempted_size =
@@ -78,8 +113,9 @@ size_t CallStackTable::Dump(const size_t buffer_size, char* buffer) const {
                    "Total number of frees: %u\n"
                    "Net number of allocations: %u\n"
                    "Total number of distinct stack traces: %zu\n",
-               num_allocs_, num_frees_, num_allocs_ - num_frees_,
-               entry_map_.size());
+               snapshot.num_allocs, snapshot.num_frees,
+               snapshot.num_allocs - snapshot.num_frees,
+               snapshot.num_call_stacks);
   size_left -= attempted_size;
   buffer += attempted_size;
 
@@ -92,16 +128,25 @@ size_t CallStackTable::Dump(const size_t buffer_size, char* buffer) const {
   return buffer_size - size_left;
 }
 
-void CallStackTable::TestForLeaks() {
-  // Add all entries to the ranked list.
-  RankedList ranked_list(kRankedListSize);
+void CallStackTable::TestForLeaks(const Snapshot& snapshot) {
+  if (!snapshot.has_counts) {
+    leak_analyzer_.AddUnchangedSample();
+    return;
+  }
 
-  for (const auto& entry_pair : entry_map_) {
-    const Entry& entry = entry_pair.second;
-    if (entry.net_num_allocs > 0) {
-      LeakDetectorValueType call_stack_value(entry_pair.first);
-      ranked_list.Add(call_stack_value, entry.net_num_allocs);
-    }
+  // Add the entries that make it into the ranked list. There are no entries
+  // with 0 net allocs to leave out, as those are removed from the table.
+  const int32_t* counts =
+      reinterpret_cast<const int32_t*>(snapshot.net_num_allocs.data());
+  int top_indices[kRankedListSize];
+  size_t num_top = SelectTopCounts(counts, snapshot.net_num_allocs.size(),
+                                   kRankedListSize, top_indices);
+  RankedList ranked_list(kRankedListSize);
+  for (size_t i = 0; i < num_top; ++i) {
+    int index = top_indices[i];
+    ranked_list.Add(
+        ValueType::FromCallStackId(snapshot.call_stack_ids[index]),
+        counts[index]);
   }
   leak_analyzer_.AddSample(std::move(ranked_list));
 }
@@ -8,33 +8,46 @@
 #include <gperftools/custom_allocator.h>
 #include <stdint.h>
 
-#include <functional>
-#include <unordered_map>
+#include <vector>
 
 #include "base/macros.h"
+#include "components/metrics/leak_detector/flat_address_map.h"
 #include "components/metrics/leak_detector/leak_analyzer.h"
 #include "components/metrics/leak_detector/stl_allocator.h"
 
 namespace leak_detector {
 
-struct CallStack;
-
-// Contains a hash table where the key is the call stack and the value is the
-// number of allocations from that call stack.
+// Contains a hash table where the key is the call stack, given by its
+// CallStackManager id, and the value is the number of allocations from that
+// call stack.
 class CallStackTable {
  public:
-  struct StoredHash {
-    size_t operator() (const CallStack* call_stack) const;
+  // Copy of the table's counters, from which leak analysis can run without
+  // holding the lock that protects the table.
+  struct Snapshot {
+    template <typename T>
+    using Vector = std::vector<T, STL_Allocator<T, CustomAllocator>>;
+
+    uint32_t num_allocs;
+    uint32_t num_frees;
+    size_t num_call_stacks;
+
+    // Whether |call_stack_ids| and |net_num_allocs| were filled in. See
+    // TakeSnapshotOfChanges().
+    bool has_counts;
+
+    // The call stacks in the table, and the net number of allocs of each.
+    Vector<uint32_t> call_stack_ids;
+    Vector<uint32_t> net_num_allocs;
   };
 
   explicit CallStackTable(int call_stack_suspicion_threshold);
   ~CallStackTable();
 
-  // Add/Remove an allocation for the given call stack.
-  // Note that this class does NOT own the CallStack objects. Instead, it
-  // identifies different CallStacks by their hashes.
-  void Add(const CallStack* call_stack);
-  void Remove(const CallStack* call_stack);
+  // Add/Remove an allocation for the call stack with the given id, which must
+  // not be 0.
+  void Add(uint32_t call_stack_id);
+  void Remove(uint32_t call_stack_id);
 
   // Dump contents to log buffer |buffer| of size |size|. Returns the number of
   // bytes remaining in the buffer after writing to it. The number of bytes
@@ -45,6 +58,24 @@ class CallStackTable {
   // Check for leak patterns in the allocation data.
   void TestForLeaks();
 
+  // Copies the current counters to |snapshot|.
+  void TakeSnapshot(Snapshot* snapshot) const;
+
+  // Same as TakeSnapshot(), except that the counts of each call stack are only
+  // copied if the table has changed since the previous call. If they are not,
+  // |snapshot->has_counts| is false, and TestForLeaks() on |snapshot| reuses
+  // the counts of the previous snapshot passed to it, which must be the one
+  // taken by the previous call.
+  void TakeSnapshotOfChanges(Snapshot* snapshot);
+
+  // Same as Dump() and TestForLeaks(), but on the counters in |snapshot|.
+  // These only access the leak analyzer, which Add() and Remove() don't touch,
+  // so they may run concurrently with those.
+  size_t Dump(const Snapshot& snapshot,
+              const size_t buffer_size,
+              char* buffer) const;
+  void TestForLeaks(const Snapshot& snapshot);
+
   const LeakAnalyzer& leak_analyzer() const {
     return leak_analyzer_;
   }
@@ -53,7 +84,7 @@ class CallStackTable {
     return entry_map_.size();
   }
   bool empty() const {
-    return entry_map_.empty();
+    return entry_map_.size() == 0;
   }
 
   uint32_t num_allocs() const {
@@ -74,14 +105,11 @@ class CallStackTable {
   uint32_t num_allocs_;
   uint32_t num_frees_;
 
-  // Hash table containing entries.
-  using TableEntryAllocator =
-      STL_Allocator<std::pair<const CallStack*, Entry>, CustomAllocator>;
-  std::unordered_map<const CallStack*,
-                     Entry,
-                     StoredHash,
-                     std::equal_to<const CallStack*>,
-                     TableEntryAllocator> entry_map_;
+  // Whether any count has changed since the last TakeSnapshotOfChanges().
+  bool changed_;
+
+  // Hash table containing entries, keyed by call stack id.
+  FlatAddressMap<Entry> entry_map_;
 
   // For detecting leak patterns in incoming allocations.
   LeakAnalyzer leak_analyzer_;
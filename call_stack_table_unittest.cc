@@ -5,8 +5,11 @@
 #include "components/metrics/leak_detector/call_stack_table.h"
 
 #include <gperftools/custom_allocator.h>
+#include <stdint.h>
 
 #include "base/macros.h"
+#include "base/memory/scoped_ptr.h"
+#include "components/metrics/leak_detector/call_stack_manager.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
 namespace leak_detector {
@@ -45,33 +48,6 @@ const void* kRawStack3[] = {
   reinterpret_cast<const void*>(0xbabe0008),
 };
 
-// Generates a CallStack object from a raw call stack.
-CallStack GenerateCallStack(uint32_t depth, const void** raw_call_stack) {
-  CallStack new_stack;
-  new_stack.depth = depth;
-  new_stack.stack = raw_call_stack;
-  new_stack.hash = CallStack::ComputeHash()(&new_stack);
-
-  return new_stack;
-}
-
-// The unit tests require that call stack objects are placed in the proper
-// sequence in memory. It is an important detail when checking the output of
-// LeakAnalyzer's suspected leaks, which are ordered by the leak value.
-// Instantiate the objects as part of an array to ensure their order in memory.
-const CallStack kCallStacks[] = {
-  GenerateCallStack(arraysize(kRawStack0), kRawStack0),
-  GenerateCallStack(arraysize(kRawStack1), kRawStack1),
-  GenerateCallStack(arraysize(kRawStack2), kRawStack2),
-  GenerateCallStack(arraysize(kRawStack3), kRawStack3),
-};
-
-// Unit tests should directly reference these pointers to CallStack objects.
-const CallStack* kStack0 = &kCallStacks[0];
-const CallStack* kStack1 = &kCallStacks[1];
-const CallStack* kStack2 = &kCallStacks[2];
-const CallStack* kStack3 = &kCallStacks[3];
-
 }  // namespace
 
 class CallStackTableTest : public ::testing::Test {
@@ -80,50 +56,65 @@ class CallStackTableTest : public ::testing::Test {
 
   void SetUp() override {
     CustomAllocator::InitializeForUnitTest();
+
+    // The tables only see the ids that the manager gives the call stacks. Ids
+    // are handed out in increasing order, which matters when checking the
+    // output of LeakAnalyzer's suspected leaks, which are ordered by id.
+    manager_.reset(new CallStackManager);
+    stack0_ = GetCallStackId(arraysize(kRawStack0), kRawStack0);
+    stack1_ = GetCallStackId(arraysize(kRawStack1), kRawStack1);
+    stack2_ = GetCallStackId(arraysize(kRawStack2), kRawStack2);
+    stack3_ = GetCallStackId(arraysize(kRawStack3), kRawStack3);
   }
   void TearDown() override {
+    // Must destroy all objects using CustomAllocator before shutting it down.
+    manager_.reset();
     CustomAllocator::Shutdown();
   }
 
+ protected:
+  // Returns the id of the call stack of the first |depth| addrs of
+  // |raw_call_stack|.
+  uint32_t GetCallStackId(size_t depth, const void* const raw_call_stack[]) {
+    const CallStack* call_stack =
+        manager_->GetCallStack(depth, raw_call_stack);
+    EXPECT_TRUE(call_stack);
+    return call_stack ? call_stack->id : 0;
+  }
+
+  scoped_ptr<CallStackManager> manager_;
+
+  // Ids of the test call stacks, which the tests pass to the tables.
+  uint32_t stack0_;
+  uint32_t stack1_;
+  uint32_t stack2_;
+  uint32_t stack3_;
+
  private:
   DISALLOW_COPY_AND_ASSIGN(CallStackTableTest);
 };
 
-TEST_F(CallStackTableTest, Hash) {
-  // Ensure increasing order of call stack placement in memory.
-  EXPECT_LT(kStack0, kStack1);
-  EXPECT_LT(kStack1, kStack2);
-  EXPECT_LT(kStack2, kStack3);
-
-  // Hash function should generate nonzero values.
-  EXPECT_NE(0U, kStack0->hash);
-  EXPECT_NE(0U, kStack1->hash);
-  EXPECT_NE(0U, kStack2->hash);
-  EXPECT_NE(0U, kStack3->hash);
-
-  // Hash function should generate unique hashes for each call stack.
-  EXPECT_NE(kStack0->hash, kStack1->hash);
-  EXPECT_NE(kStack0->hash, kStack2->hash);
-  EXPECT_NE(kStack0->hash, kStack3->hash);
-  EXPECT_NE(kStack1->hash, kStack2->hash);
-  EXPECT_NE(kStack1->hash, kStack3->hash);
-  EXPECT_NE(kStack2->hash, kStack3->hash);
+TEST_F(CallStackTableTest, CallStackIds) {
+  // Ensure increasing order of call stack ids.
+  EXPECT_LT(stack0_, stack1_);
+  EXPECT_LT(stack1_, stack2_);
+  EXPECT_LT(stack2_, stack3_);
+
+  // 0 is not a call stack id, and each call stack has its own.
+  EXPECT_NE(0U, stack0_);
+  EXPECT_EQ(stack0_, GetCallStackId(arraysize(kRawStack0), kRawStack0));
+  EXPECT_EQ(stack3_, GetCallStackId(arraysize(kRawStack3), kRawStack3));
 }
 
-TEST_F(CallStackTableTest, HashWithReducedDepth) {
-  ASSERT_GT(kStack3->depth, 4U);
-
-  // Hash function should only operate on the first |CallStack::depth| elements
-  // of CallStack::stack. To test this, reduce the depth value of one of the
-  // stacks and make sure the hash changes.
-  EXPECT_NE(kStack3->hash,
-            GenerateCallStack(kStack3->depth - 1, kStack3->stack).hash);
-  EXPECT_NE(kStack3->hash,
-            GenerateCallStack(kStack3->depth - 2, kStack3->stack).hash);
-  EXPECT_NE(kStack3->hash,
-            GenerateCallStack(kStack3->depth - 3, kStack3->stack).hash);
-  EXPECT_NE(kStack3->hash,
-            GenerateCallStack(kStack3->depth - 4, kStack3->stack).hash);
+TEST_F(CallStackTableTest, CallStackIdsWithReducedDepth) {
+  ASSERT_GT(arraysize(kRawStack3), 4U);
+
+  // Only the first |depth| addrs make up a call stack. To test this, reduce the
+  // depth of one of the stacks and make sure its id changes.
+  for (size_t i = 1; i <= 4; ++i) {
+    EXPECT_NE(stack3_,
+              GetCallStackId(arraysize(kRawStack3) - i, kRawStack3));
+  }
 }
 
 TEST_F(CallStackTableTest, EmptyTable) {
@@ -135,10 +126,10 @@ TEST_F(CallStackTableTest, EmptyTable) {
 
   // The table should be able to gracefully handle an attempt to remove a call
   // stack entry when none exists.
-  table.Remove(kStack0);
-  table.Remove(kStack1);
-  table.Remove(kStack2);
-  table.Remove(kStack3);
+  table.Remove(stack0_);
+  table.Remove(stack1_);
+  table.Remove(stack2_);
+  table.Remove(stack3_);
 
   EXPECT_EQ(0U, table.num_allocs());
   EXPECT_EQ(0U, table.num_frees());
@@ -147,60 +138,60 @@ TEST_F(CallStackTableTest, EmptyTable) {
 TEST_F(CallStackTableTest, InsertionAndRemoval) {
   CallStackTable table(kDefaultLeakThreshold);
 
-  table.Add(kStack0);
+  table.Add(stack0_);
   EXPECT_EQ(1U, table.size());
   EXPECT_EQ(1U, table.num_allocs());
-  table.Add(kStack1);
+  table.Add(stack1_);
   EXPECT_EQ(2U, table.size());
   EXPECT_EQ(2U, table.num_allocs());
-  table.Add(kStack2);
+  table.Add(stack2_);
   EXPECT_EQ(3U, table.size());
   EXPECT_EQ(3U, table.num_allocs());
-  table.Add(kStack3);
+  table.Add(stack3_);
   EXPECT_EQ(4U, table.size());
   EXPECT_EQ(4U, table.num_allocs());
 
   // Add some call stacks that have already been added. There should be no
   // change in the number of entries, as they are aggregated by call stack.
-  table.Add(kStack2);
+  table.Add(stack2_);
   EXPECT_EQ(4U, table.size());
   EXPECT_EQ(5U, table.num_allocs());
-  table.Add(kStack3);
+  table.Add(stack3_);
   EXPECT_EQ(4U, table.size());
   EXPECT_EQ(6U, table.num_allocs());
 
   // Start removing entries.
   EXPECT_EQ(0U, table.num_frees());
 
-  table.Remove(kStack0);
+  table.Remove(stack0_);
   EXPECT_EQ(3U, table.size());
   EXPECT_EQ(1U, table.num_frees());
-  table.Remove(kStack1);
+  table.Remove(stack1_);
   EXPECT_EQ(2U, table.size());
   EXPECT_EQ(2U, table.num_frees());
 
   // Removing call stacks with multiple counts will not reduce the overall
   // number of table entries, until the count reaches 0.
-  table.Remove(kStack2);
+  table.Remove(stack2_);
   EXPECT_EQ(2U, table.size());
   EXPECT_EQ(3U, table.num_frees());
-  table.Remove(kStack3);
+  table.Remove(stack3_);
   EXPECT_EQ(2U, table.size());
   EXPECT_EQ(4U, table.num_frees());
 
-  table.Remove(kStack2);
+  table.Remove(stack2_);
   EXPECT_EQ(1U, table.size());
   EXPECT_EQ(5U, table.num_frees());
-  table.Remove(kStack3);
+  table.Remove(stack3_);
   EXPECT_EQ(0U, table.size());
   EXPECT_EQ(6U, table.num_frees());
 
   // Now the table should be empty, but attempt to remove some more and make
   // sure nothing breaks.
-  table.Remove(kStack0);
-  table.Remove(kStack1);
-  table.Remove(kStack2);
-  table.Remove(kStack3);
+  table.Remove(stack0_);
+  table.Remove(stack1_);
+  table.Remove(stack2_);
+  table.Remove(stack3_);
 
   EXPECT_TRUE(table.empty());
   EXPECT_EQ(6U, table.num_allocs());
@@ -211,22 +202,22 @@ TEST_F(CallStackTableTest, MassiveInsertionAndRemoval) {
   CallStackTable table(kDefaultLeakThreshold);
 
   for (int i = 0; i < 100; ++i)
-    table.Add(kStack3);
+    table.Add(stack3_);
   EXPECT_EQ(1U, table.size());
   EXPECT_EQ(100U, table.num_allocs());
 
   for (int i = 0; i < 100; ++i)
-    table.Add(kStack2);
+    table.Add(stack2_);
   EXPECT_EQ(2U, table.size());
   EXPECT_EQ(200U, table.num_allocs());
 
   for (int i = 0; i < 100; ++i)
-    table.Add(kStack1);
+    table.Add(stack1_);
   EXPECT_EQ(3U, table.size());
   EXPECT_EQ(300U, table.num_allocs());
 
   for (int i = 0; i < 100; ++i)
-    table.Add(kStack0);
+    table.Add(stack0_);
   EXPECT_EQ(4U, table.size());
   EXPECT_EQ(400U, table.num_allocs());
 
@@ -235,26 +226,26 @@ TEST_F(CallStackTableTest, MassiveInsertionAndRemoval) {
   EXPECT_EQ(0U, table.num_frees());
 
   for (int i = 0; i < 100; ++i) {
-    table.Remove(kStack0);
+    table.Remove(stack0_);
     EXPECT_EQ(4U * i + 1, table.num_frees());
 
-    table.Remove(kStack1);
+    table.Remove(stack1_);
     EXPECT_EQ(4U * i + 2, table.num_frees());
 
-    table.Remove(kStack2);
+    table.Remove(stack2_);
     EXPECT_EQ(4U * i + 3, table.num_frees());
 
-    table.Remove(kStack3);
+    table.Remove(stack3_);
     EXPECT_EQ(4U * i + 4, table.num_frees());
   }
   EXPECT_EQ(400U, table.num_frees());
   EXPECT_TRUE(table.empty());
 
   // Try to remove some more from an empty table and make sure nothing breaks.
-  table.Remove(kStack0);
-  table.Remove(kStack1);
-  table.Remove(kStack2);
-  table.Remove(kStack3);
+  table.Remove(stack0_);
+  table.Remove(stack1_);
+  table.Remove(stack2_);
+  table.Remove(stack3_);
 
   EXPECT_TRUE(table.empty());
   EXPECT_EQ(400U, table.num_allocs());
@@ -266,40 +257,40 @@ TEST_F(CallStackTableTest, DetectLeak) {
 
   // Add some base number of entries.
   for (int i = 0; i < 60; ++i)
-      table.Add(kStack0);
+      table.Add(stack0_);
   for (int i = 0; i < 50; ++i)
-      table.Add(kStack1);
+      table.Add(stack1_);
   for (int i = 0; i < 64; ++i)
-      table.Add(kStack2);
+      table.Add(stack2_);
   for (int i = 0; i < 72; ++i)
-      table.Add(kStack3);
+      table.Add(stack3_);
 
   table.TestForLeaks();
   EXPECT_TRUE(table.leak_analyzer().suspected_leaks().empty());
 
   // Use the following scheme:
-  // - kStack0: increase by 4 each time -- leak suspect
-  // - kStack1: increase by 3 each time -- leak suspect
-  // - kStack2: increase by 1 each time -- not a suspect
-  // - kStack3: alternate between increasing and decreasing - not a suspect
-  bool increase_kstack3 = true;
+  // - stack0_: increase by 4 each time -- leak suspect
+  // - stack1_: increase by 3 each time -- leak suspect
+  // - stack2_: increase by 1 each time -- not a suspect
+  // - stack3_: alternate between increasing and decreasing - not a suspect
+  bool increase_stack3 = true;
   for (int i = 0; i < kDefaultLeakThreshold; ++i) {
     EXPECT_TRUE(table.leak_analyzer().suspected_leaks().empty());
 
     for (int j = 0; j < 4; ++j)
-      table.Add(kStack0);
+      table.Add(stack0_);
 
     for (int j = 0; j < 3; ++j)
-      table.Add(kStack1);
+      table.Add(stack1_);
 
-    table.Add(kStack2);
+    table.Add(stack2_);
 
     // Alternate between adding and removing.
-    if (increase_kstack3)
-      table.Add(kStack3);
+    if (increase_stack3)
+      table.Add(stack3_);
     else
-      table.Remove(kStack3);
-    increase_kstack3 = !increase_kstack3;
+      table.Remove(stack3_);
+    increase_stack3 = !increase_stack3;
 
     table.TestForLeaks();
   }
@@ -308,9 +299,9 @@ TEST_F(CallStackTableTest, DetectLeak) {
   const auto& leaks = table.leak_analyzer().suspected_leaks();
   ASSERT_EQ(2U, leaks.size());
   // Suspected leaks are reported in increasing leak value -- in this case, the
-  // CallStack object's address.
-  EXPECT_EQ(kStack0, leaks[0].call_stack());
-  EXPECT_EQ(kStack1, leaks[1].call_stack());
+  // call stack id.
+  EXPECT_EQ(stack0_, leaks[0].call_stack_id());
+  EXPECT_EQ(stack1_, leaks[1].call_stack_id());
 }
 
 }  // namespace leak_detector
@@ -0,0 +1,183 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/call_stack_trie.h"
+
+#include <gperftools/custom_allocator.h>
+#include <string.h>   // For memset.
+
+namespace leak_detector {
+
+namespace {
+
+// Number of slots the hash table starts with.
+const size_t kInitialIndexCapacity = 1024;
+
+}  // namespace
+
+CallStackTrie::CallStackTrie()
+    : index_(nullptr),
+      index_mask_(0),
+      index_shift_(64),
+      node_chunks_size_(0),
+      num_nodes_(0),
+      next_node_id_(1),
+      free_node_ids_(0) {
+  memset(node_chunks_, 0, sizeof(node_chunks_));
+}
+
+CallStackTrie::~CallStackTrie() {
+  if (index_)
+    CustomAllocator::Free(index_, sizeof(*index_) * index_capacity());
+  for (Node*& chunk : node_chunks_) {
+    if (chunk)
+      CustomAllocator::Free(chunk, sizeof(*chunk) * kNodeChunkSize);
+  }
+}
+
+uint32_t CallStackTrie::Find(int depth, const void* const stack[]) const {
+  if (!index_)
+    return 0;
+  uint32_t node_id = 0;
+  for (int i = depth - 1; i >= 0; --i) {
+    node_id = index_[FindSlot(node_id, stack[i])];
+    if (!node_id)
+      return 0;
+  }
+  return node_id;
+}
+
+uint32_t CallStackTrie::Insert(int depth, const void* const stack[]) {
+  uint32_t parent = 0;
+  for (int i = depth - 1; i >= 0; --i) {
+    size_t slot = index_ ? FindSlot(parent, stack[i]) : 0;
+    uint32_t node_id = index_ ? index_[slot] : 0;
+    if (!node_id) {
+      node_id = AllocateNode();
+      if (!node_id) {
+        // Undo the part of the path added so far.
+        if (parent)
+          Release(parent);
+        return 0;
+      }
+      if ((num_nodes_ + 1) * kMaxLoadDenominator >
+          index_capacity() * kMaxLoadNumerator) {
+        GrowIndex();
+        slot = FindSlot(parent, stack[i]);
+      }
+      Node& node = GetNode(node_id);
+      node.frame = stack[i];
+      node.parent = parent;
+      node.num_refs = 0;
+      index_[slot] = node_id;
+      ++num_nodes_;
+    }
+    ++GetNode(node_id).num_refs;
+    parent = node_id;
+  }
+  return parent;
+}
+
+void CallStackTrie::Release(uint32_t node_id) {
+  while (node_id) {
+    Node& node = GetNode(node_id);
+    uint32_t parent = node.parent;
+    if (--node.num_refs == 0)
+      FreeNode(node_id);
+    node_id = parent;
+  }
+}
+
+void CallStackTrie::GetStack(uint32_t node_id,
+                             int depth,
+                             const void* stack[]) const {
+  for (int i = 0; i < depth; ++i) {
+    const Node& node = GetNode(node_id);
+    stack[i] = node.frame;
+    node_id = node.parent;
+  }
+}
+
+size_t CallStackTrie::HomeSlot(uint32_t parent, const void* frame) const {
+  uint64_t key = reinterpret_cast<uintptr_t>(frame) ^
+                 parent * 0xc2b2ae3d27d4eb4fULL;
+  return key * 0x9e3779b97f4a7c15ULL >> index_shift_;
+}
+
+size_t CallStackTrie::FindSlot(uint32_t parent, const void* frame) const {
+  size_t slot = HomeSlot(parent, frame);
+  for (;; slot = (slot + 1) & index_mask_) {
+    uint32_t node_id = index_[slot];
+    if (!node_id)
+      return slot;
+    const Node& node = GetNode(node_id);
+    if (node.frame == frame && node.parent == parent)
+      return slot;
+  }
+}
+
+uint32_t CallStackTrie::AllocateNode() {
+  if (free_node_ids_) {
+    uint32_t node_id = free_node_ids_;
+    free_node_ids_ = GetNode(node_id).parent;
+    return node_id;
+  }
+  if (next_node_id_ > kMaxNodes)
+    return 0;
+  Node*& chunk = node_chunks_[next_node_id_ / kNodeChunkSize];
+  if (!chunk) {
+    chunk = static_cast<Node*>(
+        CustomAllocator::Allocate(sizeof(*chunk) * kNodeChunkSize));
+    node_chunks_size_ += sizeof(*chunk) * kNodeChunkSize;
+  }
+  return next_node_id_++;
+}
+
+void CallStackTrie::FreeNode(uint32_t node_id) {
+  Node& node = GetNode(node_id);
+  size_t slot = FindSlot(node.parent, node.frame);
+
+  // Shift back the nodes that follow in the same run of taken slots, unless
+  // that would move them before their home slot.
+  size_t next = (slot + 1) & index_mask_;
+  for (; index_[next]; next = (next + 1) & index_mask_) {
+    const Node& next_node = GetNode(index_[next]);
+    size_t home = HomeSlot(next_node.parent, next_node.frame);
+    if (((next - home) & index_mask_) >= ((next - slot) & index_mask_)) {
+      index_[slot] = index_[next];
+      slot = next;
+    }
+  }
+  index_[slot] = 0;
+
+  node.parent = free_node_ids_;
+  free_node_ids_ = node_id;
+  --num_nodes_;
+}
+
+void CallStackTrie::GrowIndex() {
+  uint32_t* old_index = index_;
+  size_t old_capacity = index_capacity();
+
+  size_t capacity = old_capacity ? old_capacity * 2 : kInitialIndexCapacity;
+  index_ = static_cast<uint32_t*>(
+      CustomAllocator::Allocate(sizeof(*index_) * capacity));
+  memset(index_, 0, sizeof(*index_) * capacity);
+  index_mask_ = capacity - 1;
+  index_shift_ = 64;
+  for (size_t n = capacity; n > 1; n /= 2)
+    --index_shift_;
+
+  for (size_t i = 0; i < old_capacity; ++i) {
+    uint32_t node_id = old_index[i];
+    if (!node_id)
+      continue;
+    const Node& node = GetNode(node_id);
+    index_[FindSlot(node.parent, node.frame)] = node_id;
+  }
+  if (old_index)
+    CustomAllocator::Free(old_index, sizeof(*old_index) * old_capacity);
+}
+
+}  // namespace leak_detector
@@ -0,0 +1,135 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMPONENTS_METRICS_LEAK_DETECTOR_CALL_STACK_TRIE_H_
+#define COMPONENTS_METRICS_LEAK_DETECTOR_CALL_STACK_TRIE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/macros.h"
+
+namespace leak_detector {
+
+// Stores call stacks as paths in a trie, each going from the outermost frame
+// of the call stack to the innermost one. Call stacks that share their
+// outermost frames, like those of the event loop, share the nodes of those
+// frames. A call stack is referred to by the nonzero id of the node at the end
+// of its path.
+//
+// Each node keeps a frame and the id of its parent, and is found from its
+// parent through a hash table keyed by both, so that a call stack is looked up
+// or added in one probe of the table per frame. Nodes are counted with
+// references from the call stacks whose paths go through them, and freed once
+// they have none.
+//
+// All memory comes from CustomAllocator.
+class CallStackTrie {
+ public:
+  // Number of nodes that can exist at once.
+  static const uint32_t kMaxNodes = (1 << 24) - 1;
+
+  CallStackTrie();
+  ~CallStackTrie();
+
+  // Returns the id of the node at the end of the path of the |depth| frames in
+  // |stack|, innermost first, or 0 if there is no such path. |depth| must be
+  // nonzero.
+  uint32_t Find(int depth, const void* const stack[]) const;
+
+  // Same as Find(), but adds the nodes of the path that do not exist yet, and
+  // adds a reference to each node of the path. Returns 0 if there are not
+  // enough node ids left, in which case the trie is left as it was.
+  uint32_t Insert(int depth, const void* const stack[]);
+
+  // Drops the references that Insert() added to the path ending at |node_id|,
+  // and frees the nodes left without references.
+  void Release(uint32_t node_id);
+
+  // Copies the |depth| frames of the path ending at |node_id|, innermost
+  // first, to |stack|. |depth| must be that of the path. Nodes do not move
+  // once created, so this may run concurrently with Insert() and Release(), as
+  // long as the path keeps its references.
+  void GetStack(uint32_t node_id, int depth, const void* stack[]) const;
+
+  // Returns the number of nodes.
+  size_t size() const {
+    return num_nodes_;
+  }
+
+  // Returns the number of bytes allocated for the nodes and the hash table.
+  // Memory of freed nodes is reused for new ones, but not freed.
+  size_t memory_size() const {
+    return node_chunks_size_ + sizeof(*index_) * index_capacity();
+  }
+
+ private:
+  struct Node {
+    const void* frame;
+
+    // Id of the parent node, or 0 for nodes of outermost frames. For freed
+    // nodes, the id of the next freed node.
+    uint32_t parent;
+
+    uint32_t num_refs;
+  };
+
+  // Nodes are allocated in chunks of this many, which never move.
+  static const size_t kNodeChunkSize = 4096;
+
+  // The hash table grows once this fraction of its slots is taken.
+  static const size_t kMaxLoadNumerator = 3;
+  static const size_t kMaxLoadDenominator = 4;
+
+  const Node& GetNode(uint32_t id) const {
+    return node_chunks_[id / kNodeChunkSize][id % kNodeChunkSize];
+  }
+  Node& GetNode(uint32_t id) {
+    return node_chunks_[id / kNodeChunkSize][id % kNodeChunkSize];
+  }
+
+  size_t index_capacity() const {
+    return index_ ? index_mask_ + 1 : 0;
+  }
+
+  // Returns the slot of the hash table where the child of |parent| with
+  // |frame| is, or should be put if there is none.
+  size_t FindSlot(uint32_t parent, const void* frame) const;
+
+  // Slot of the hash table where a search for the child of |parent| with
+  // |frame| starts.
+  size_t HomeSlot(uint32_t parent, const void* frame) const;
+
+  // Returns an unused node id, or 0 if there is none left.
+  uint32_t AllocateNode();
+
+  // Removes the node from the hash table and puts its id up for reuse.
+  void FreeNode(uint32_t id);
+
+  // Doubles the size of the hash table, or allocates it if there is none.
+  void GrowIndex();
+
+  // Ids of the child nodes, in slots found by linear probing from HomeSlot().
+  // 0 in empty slots. Allocated once the first node is added.
+  uint32_t* index_;
+  size_t index_mask_;
+  int index_shift_;
+
+  // Nodes by id, in chunks of |kNodeChunkSize| allocated as needed. Id 0 has
+  // no node.
+  Node* node_chunks_[(kMaxNodes + 1) / kNodeChunkSize];
+  size_t node_chunks_size_;
+
+  size_t num_nodes_;
+
+  // Next id that has never been used, and the first of the freed ones, or 0.
+  uint32_t next_node_id_;
+  uint32_t free_node_ids_;
+
+  DISALLOW_COPY_AND_ASSIGN(CallStackTrie);
+};
+
+}  // namespace leak_detector
+
+#endif  // COMPONENTS_METRICS_LEAK_DETECTOR_CALL_STACK_TRIE_H_
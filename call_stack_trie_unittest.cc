@@ -0,0 +1,160 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/call_stack_trie.h"
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Two call stacks with the same two outermost frames, and one with none in
+// common with them. Innermost frames come first.
+const void* kRawStack0[] = {
+  reinterpret_cast<const void*>(0xaabbccdd),
+  reinterpret_cast<const void*>(0x11223344),
+  reinterpret_cast<const void*>(0x55667788),
+  reinterpret_cast<const void*>(0x99887766),
+};
+const void* kRawStack1[] = {
+  reinterpret_cast<const void*>(0xdeadbeef),
+  reinterpret_cast<const void*>(0x55667788),
+  reinterpret_cast<const void*>(0x99887766),
+};
+const void* kRawStack2[] = {
+  reinterpret_cast<const void*>(0x55667788),
+  reinterpret_cast<const void*>(0xcafedeed),
+};
+
+}  // namespace
+
+class CallStackTrieTest : public ::testing::Test {
+ public:
+  CallStackTrieTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(CallStackTrieTest);
+};
+
+TEST_F(CallStackTrieTest, SharedCallers) {
+  CallStackTrie trie;
+  EXPECT_EQ(0U, trie.size());
+  EXPECT_EQ(0U, trie.memory_size());
+  EXPECT_EQ(0U, trie.Find(arraysize(kRawStack0), kRawStack0));
+
+  uint32_t node0 = trie.Insert(arraysize(kRawStack0), kRawStack0);
+  ASSERT_NE(0U, node0);
+  EXPECT_EQ(4U, trie.size());
+  EXPECT_GT(trie.memory_size(), 0U);
+
+  // Only the innermost frame of stack 1 needs a new node.
+  uint32_t node1 = trie.Insert(arraysize(kRawStack1), kRawStack1);
+  ASSERT_NE(0U, node1);
+  EXPECT_NE(node0, node1);
+  EXPECT_EQ(5U, trie.size());
+
+  // Stack 2 has a frame of the others, but not as its outermost one.
+  uint32_t node2 = trie.Insert(arraysize(kRawStack2), kRawStack2);
+  EXPECT_EQ(7U, trie.size());
+
+  EXPECT_EQ(node0, trie.Find(arraysize(kRawStack0), kRawStack0));
+  EXPECT_EQ(node1, trie.Find(arraysize(kRawStack1), kRawStack1));
+  EXPECT_EQ(node2, trie.Find(arraysize(kRawStack2), kRawStack2));
+  // The outer part of a path is a path too.
+  EXPECT_NE(0U, trie.Find(arraysize(kRawStack0) - 1, kRawStack0 + 1));
+  EXPECT_EQ(0U, trie.Find(arraysize(kRawStack0) - 1, kRawStack0));
+
+  const void* stack[arraysize(kRawStack0)];
+  trie.GetStack(node0, arraysize(kRawStack0), stack);
+  for (size_t i = 0; i < arraysize(kRawStack0); ++i)
+    EXPECT_EQ(kRawStack0[i], stack[i]);
+  trie.GetStack(node1, arraysize(kRawStack1), stack);
+  for (size_t i = 0; i < arraysize(kRawStack1); ++i)
+    EXPECT_EQ(kRawStack1[i], stack[i]);
+
+  // Inserting an existing path adds no nodes.
+  EXPECT_EQ(node0, trie.Insert(arraysize(kRawStack0), kRawStack0));
+  EXPECT_EQ(7U, trie.size());
+}
+
+TEST_F(CallStackTrieTest, Release) {
+  CallStackTrie trie;
+  uint32_t node0 = trie.Insert(arraysize(kRawStack0), kRawStack0);
+  uint32_t node1 = trie.Insert(arraysize(kRawStack1), kRawStack1);
+  trie.Insert(arraysize(kRawStack1), kRawStack1);
+
+  // The shared frames stay as long as stack 1 refers to them.
+  trie.Release(node0);
+  EXPECT_EQ(3U, trie.size());
+  EXPECT_EQ(0U, trie.Find(arraysize(kRawStack0), kRawStack0));
+  EXPECT_EQ(node1, trie.Find(arraysize(kRawStack1), kRawStack1));
+
+  trie.Release(node1);
+  EXPECT_EQ(node1, trie.Find(arraysize(kRawStack1), kRawStack1));
+  trie.Release(node1);
+  EXPECT_EQ(0U, trie.size());
+  EXPECT_EQ(0U, trie.Find(arraysize(kRawStack1), kRawStack1));
+
+  // Freed nodes are reused.
+  size_t memory_size = trie.memory_size();
+  trie.Insert(arraysize(kRawStack0), kRawStack0);
+  EXPECT_EQ(4U, trie.size());
+  EXPECT_EQ(memory_size, trie.memory_size());
+}
+
+TEST_F(CallStackTrieTest, ManyStacks) {
+  // Enough call stacks to grow the hash table several times and take several
+  // chunks of nodes. Each shares its outer 12 frames with 99 others.
+  const size_t kDepth = 16;
+  CallStackTrie trie;
+  std::vector<std::vector<const void*>> raw_stacks;
+  std::vector<uint32_t> node_ids;
+  for (uintptr_t i = 0; i < 10000; ++i) {
+    std::vector<const void*> raw_stack(kDepth);
+    for (size_t j = 0; j < kDepth; ++j) {
+      uintptr_t addr = j < 4 ? i * 1000 + j : (i / 100) * 1000 + j;
+      raw_stack[j] = reinterpret_cast<const void*>(addr);
+    }
+    uint32_t node_id = trie.Insert(kDepth, raw_stack.data());
+    ASSERT_NE(0U, node_id);
+    node_ids.push_back(node_id);
+    raw_stacks.push_back(std::move(raw_stack));
+  }
+  EXPECT_EQ(10000U * 4 + 100U * 12, trie.size());
+
+  for (size_t i = 0; i < raw_stacks.size(); ++i) {
+    EXPECT_EQ(node_ids[i], trie.Find(kDepth, raw_stacks[i].data()));
+    const void* stack[kDepth];
+    trie.GetStack(node_ids[i], kDepth, stack);
+    EXPECT_TRUE(std::equal(raw_stacks[i].begin(), raw_stacks[i].end(), stack));
+  }
+
+  // Releasing every other call stack leaves the rest intact.
+  for (size_t i = 0; i < raw_stacks.size(); i += 2)
+    trie.Release(node_ids[i]);
+  EXPECT_EQ(5000U * 4 + 100U * 12, trie.size());
+  for (size_t i = 0; i < raw_stacks.size(); ++i) {
+    EXPECT_EQ(i % 2 ? node_ids[i] : 0U,
+              trie.Find(kDepth, raw_stacks[i].data()));
+  }
+  for (size_t i = 1; i < raw_stacks.size(); i += 2)
+    trie.Release(node_ids[i]);
+  EXPECT_EQ(0U, trie.size());
+}
+
+}  // namespace leak_detector
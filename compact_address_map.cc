@@ -2,12 +2,20 @@
 
 #include <gperftools/custom_allocator.h>
 
+// static
+const size_t CompactAddressMap::kMaxSize;
+
 CompactAddressMap::CompactAddressMap()
-    : free_entries_(NULL),
+    : cluster_hash_table_size_(kInitialClusterHashTableSize),
+      cluster_hash_shift_(64),
+      last_cluster_(NULL),
+      free_entries_(NULL),
       allocated_objects_(NULL),
       num_entries_(0) {
   stats_ = {0};
-  cluster_hash_table_ = New<Cluster*>(kClusterHashTableSize);
+  cluster_hash_table_ = New<Cluster*>(cluster_hash_table_size_);
+  for (size_t n = cluster_hash_table_size_; n > 1; n /= 2)
+    --cluster_hash_shift_;
 }
 
 CompactAddressMap::~CompactAddressMap() {
@@ -29,19 +37,53 @@ void CompactAddressMap::Free(void* ptr) {
   CustomAllocator::Free(ptr, 0);
 }
 
-CompactAddressMap::Cluster* CompactAddressMap::GetCluster(uintptr_t addr) {
+void CompactAddressMap::GrowClusterHashTable() {
+  Cluster** old_table = cluster_hash_table_;
+  size_t old_size = cluster_hash_table_size_;
+  cluster_hash_table_size_ *= 2;
+  --cluster_hash_shift_;
+  cluster_hash_table_ = New<Cluster*>(cluster_hash_table_size_);
+
+  for (size_t i = 0; i < old_size; ++i) {
+    for (Cluster* c = old_table[i]; c != NULL; /**/) {
+      Cluster* next = c->next;
+      size_t index = GetClusterHashIndex(c->id);
+      c->next = cluster_hash_table_[index];
+      cluster_hash_table_[index] = c;
+      c = next;
+    }
+  }
+  Delete(old_table);
+}
+
+CompactAddressMap::Cluster* CompactAddressMap::FindCluster(uintptr_t addr) {
   uintptr_t id = addr / kClusterSize;
-  int index = id % kClusterHashTableSize;
-  for (Cluster* c = cluster_hash_table_[index]; c != NULL; c = c->next) {
-    if (c->id == id)
+  if (last_cluster_ && last_cluster_->id == id)
+    return last_cluster_;
+  for (Cluster* c = cluster_hash_table_[GetClusterHashIndex(id)]; c != NULL;
+       c = c->next) {
+    if (c->id == id) {
+      last_cluster_ = c;
       return c;
+    }
   }
+  return NULL;
+}
 
-  Cluster* c = New<Cluster>(1);
-  c->id = id;
+CompactAddressMap::Cluster* CompactAddressMap::GetCluster(uintptr_t addr) {
+  Cluster* c = FindCluster(addr);
+  if (c)
+    return c;
+
+  if (stats_.num_clusters >= cluster_hash_table_size_)
+    GrowClusterHashTable();
+  c = New<Cluster>(1);
+  c->id = addr / kClusterSize;
+  size_t index = GetClusterHashIndex(c->id);
   c->next = cluster_hash_table_[index];
   cluster_hash_table_[index] = c;
   ++stats_.num_clusters;
+  last_cluster_ = c;
   return c;
 }
 
@@ -71,9 +113,9 @@ CompactAddressMap::Page* CompactAddressMap::GetPage(uintptr_t addr) {
   return page;
 }
 
-void CompactAddressMap::Insert(const void* ptr,
-                               uint16_t size,
-                               const uint32_t* hash) {
+bool CompactAddressMap::Insert(const void* ptr,
+                               size_t size,
+                               const uint32_t* call_stack_id) {
   uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
   Page* page = GetPage(addr);
 
@@ -84,12 +126,9 @@ void CompactAddressMap::Insert(const void* ptr,
   for (Entry* entry = page->blocks[block]; entry != NULL; entry = entry->next) {
     ++num_steps;
     if (entry->offset == block_offset) {
-      entry->Store(block_offset, size, hash);
       if (num_steps > stats_.max_num_steps)
         stats_.max_num_steps = num_steps;
-      ++num_entries_;
-
-      return;
+      return false;
     }
   }
 
@@ -107,18 +146,32 @@ void CompactAddressMap::Insert(const void* ptr,
   // Detach a free entry for the current operation.
   Entry* entry = free_entries_;
   free_entries_ = entry->next;
-  entry->Store(block_offset, size, hash);
+  entry->Store(block_offset, size, call_stack_id);
   entry->next = page->blocks[block];
   page->blocks[block] = entry;
   ++num_entries_;
 
   if (num_steps > stats_.max_num_steps)
     stats_.max_num_steps = num_steps;
+  return true;
+}
+
+CompactAddressMap::Page* CompactAddressMap::FindPage(uintptr_t addr) {
+  Cluster* cluster = FindCluster(addr);
+  if (!cluster)
+    return NULL;
+  Subcluster* subcluster =
+      cluster->subclusters[(addr % kClusterSize) / kSubclusterSize];
+  if (!subcluster)
+    return NULL;
+  return subcluster->pages[(addr % kSubclusterSize) / kPageSize];
 }
 
 bool CompactAddressMap::FindAndRemove(const void *ptr, Entry* result) {
   uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  Page* page = GetPage(addr);
+  Page* page = FindPage(addr);
+  if (!page)
+    return false;
 
   // Look in linked-list for this block.
   const int block = (addr % kPageSize) / kBlockSize;
@@ -20,23 +20,35 @@ class CompactAddressMap {
 
   struct Entry {
     Entry* next;
-    uint16_t size : 15;
-    uint8_t has_call_stack : 1;
-    uint16_t offset;
-    uint32_t call_stack_hash;
+    uint32_t call_stack_id;
+    uint32_t offset : 8;
+    uint32_t has_call_stack : 1;
+    uint32_t encoded_size : 23;
 
-    void Store(uint16_t offset, uint8_t size, const uint32_t* hash) {
+    void Store(uint16_t offset, size_t size, const uint32_t* call_stack_id) {
       this->offset = offset;
-      this->size = size;
-      if (hash) {
+      encoded_size = EncodeSize(size);
+      if (call_stack_id) {
         has_call_stack = true;
-        call_stack_hash = *hash;
+        this->call_stack_id = *call_stack_id;
       } else {
         has_call_stack = false;
       }
     }
+
+    size_t size() const {
+      return DecodeSize(encoded_size);
+    }
   };
 
+  // Sizes below kExactSizeLimit are stored exactly. Larger ones are rounded
+  // down to kSizeSignificantBits significant bits, which is as much as the
+  // leak detector's size classes need, and saturate at kMaxSize.
+  static const size_t kExactSizeLimit = 1 << 22;
+  static const int kSizeSignificantBits = 17;
+  static const size_t kMaxSize =
+      ((static_cast<size_t>(1) << kSizeSignificantBits) - 1) << 31;
+
   CompactAddressMap();
   ~CompactAddressMap();
 
@@ -48,10 +60,21 @@ class CompactAddressMap {
     return num_entries_;
   }
 
-  void Insert(const void* ptr, uint16_t size, const uint32_t* hash);
+  // Adds an entry for |ptr| and returns true, unless there already is one, in
+  // which case that entry is left as it is.
+  bool Insert(const void* ptr, size_t size, const uint32_t* call_stack_id);
   bool FindAndRemove(const void *ptr, Entry* result);
 
+  // Calls |visitor(ptr, entry)| for each entry.
+  template <class Visitor>
+  void ForEach(Visitor visitor) const;
+
+  // Removes each entry for which |predicate(ptr, entry)| returns true.
+  template <class Predicate>
+  void EraseIf(Predicate predicate);
+
  private:
+  // Entry::offset has 8 bits.
   static const int kBlockSize = 256;
 
   static const int kNumBlocksPerPage = 16;
@@ -69,12 +92,17 @@ class CompactAddressMap {
   static const int kNumSubclustersPerCluster = 16;
   static const int kClusterSize = kNumSubclustersPerCluster * kSubclusterSize;
   struct Cluster {
-    uint32_t id;
+    // Address of the cluster divided by kClusterSize. Takes up to 44 bits with
+    // 64-bit addresses.
+    uintptr_t id;
     Cluster* next;
     Subcluster* subclusters[kNumSubclustersPerCluster];
   };
 
-  static const int kClusterHashTableSize = (1UL << 32) / kClusterSize;
+  // Initial number of buckets in |cluster_hash_table_|. The number is doubled
+  // whenever there are more clusters than buckets, so that chains stay short
+  // wherever in the address space the clusters are.
+  static const int kInitialClusterHashTableSize = 4096;
 
   // Allocate this many free Entries at a time.
   static const int kEntryBulkAllocCount = 64;
@@ -115,7 +143,7 @@ class CompactAddressMap {
 
   // Custom object deallocator
   template <class T>
-  T* Delete(T* ptr) {
+  void Delete(T* ptr) {
     Object* object = reinterpret_cast<Object*>(ptr) - 1;
     stats_.heap_size -= sizeof(Object) + sizeof(T) * object->count;
 
@@ -130,11 +158,57 @@ class CompactAddressMap {
     Free(object);
   }
 
+  // Convert sizes to and from Entry::encoded_size. Encoded sizes of
+  // kExactSizeLimit and up hold a 5-bit shift and the significant bits.
+  static uint32_t EncodeSize(size_t size) {
+    if (size < kExactSizeLimit)
+      return size;
+    if (size > kMaxSize)
+      size = kMaxSize;
+    int shift = 64 - __builtin_clzll(size) - kSizeSignificantBits;
+    return kExactSizeLimit | shift << kSizeSignificantBits |
+           size >> shift;
+  }
+  static size_t DecodeSize(uint32_t encoded_size) {
+    if (encoded_size < kExactSizeLimit)
+      return encoded_size;
+    int shift = (encoded_size >> kSizeSignificantBits) & 31;
+    return static_cast<size_t>(
+               encoded_size & ((1 << kSizeSignificantBits) - 1)) << shift;
+  }
+
+  // Calls |visitor(block_addr, &page->blocks[i])| for each nonempty block.
+  template <class Visitor>
+  void ForEachBlock(Visitor visitor) const;
+
+  // Returns the bucket of |cluster_hash_table_| for the cluster with |id|.
+  size_t GetClusterHashIndex(uintptr_t id) const {
+    return static_cast<uint64_t>(id) * 0x9e3779b97f4a7c15ULL >>
+           cluster_hash_shift_;
+  }
+
+  // Doubles the number of buckets in |cluster_hash_table_|.
+  void GrowClusterHashTable();
+
+  // These return the object containing |addr|, creating it if needed.
   Cluster* GetCluster(uintptr_t addr);
   Subcluster* GetSubcluster(Cluster* cluster, uintptr_t addr);
   Page* GetPage(uintptr_t addr);
 
+  // These return the object containing |addr|, or NULL if there is none. They
+  // never allocate, so that looking up an address that is not in the map does
+  // not grow it.
+  Cluster* FindCluster(uintptr_t addr);
+  Page* FindPage(uintptr_t addr);
+
   Cluster** cluster_hash_table_;
+  size_t cluster_hash_table_size_;
+  int cluster_hash_shift_;
+
+  // The cluster that was looked up last. Allocations tend to be close to the
+  // previous ones.
+  Cluster* last_cluster_;
+
   Entry* free_entries_;
   Object* allocated_objects_;
 
@@ -143,4 +217,57 @@ class CompactAddressMap {
   size_t num_entries_;
 };
 
+template <class Visitor>
+void CompactAddressMap::ForEachBlock(Visitor visitor) const {
+  for (size_t i = 0; i < cluster_hash_table_size_; ++i) {
+    for (Cluster* c = cluster_hash_table_[i]; c != NULL; c = c->next) {
+      uintptr_t cluster_addr = static_cast<uintptr_t>(c->id) * kClusterSize;
+      for (int j = 0; j < kNumSubclustersPerCluster; ++j) {
+        Subcluster* subcluster = c->subclusters[j];
+        if (!subcluster)
+          continue;
+        for (int k = 0; k < kNumPagesPerSubcluster; ++k) {
+          Page* page = subcluster->pages[k];
+          if (!page)
+            continue;
+          uintptr_t page_addr =
+              cluster_addr + j * kSubclusterSize + k * kPageSize;
+          for (int block = 0; block < kNumBlocksPerPage; ++block) {
+            if (page->blocks[block])
+              visitor(page_addr + block * kBlockSize, &page->blocks[block]);
+          }
+        }
+      }
+    }
+  }
+}
+
+template <class Visitor>
+void CompactAddressMap::ForEach(Visitor visitor) const {
+  ForEachBlock([&visitor](uintptr_t block_addr, Entry** list) {
+    for (const Entry* entry = *list; entry != NULL; entry = entry->next) {
+      visitor(reinterpret_cast<const void*>(block_addr + entry->offset),
+              *entry);
+    }
+  });
+}
+
+template <class Predicate>
+void CompactAddressMap::EraseIf(Predicate predicate) {
+  ForEachBlock([this, &predicate](uintptr_t block_addr, Entry** list) {
+    for (Entry** p = list; *p; /**/) {
+      Entry* entry = *p;
+      if (!predicate(reinterpret_cast<const void*>(block_addr + entry->offset),
+                     *entry)) {
+        p = &entry->next;
+        continue;
+      }
+      *p = entry->next;
+      entry->next = free_entries_;
+      free_entries_ = entry;
+      --num_entries_;
+    }
+  });
+}
+
 #endif  // COMPACT_ADDRESS_MAP_H_
@@ -1,17 +1,33 @@
 #include "compact_address_map.h"
 
 #include <gperftools/custom_allocator.h>
+#include <stdio.h>
+#include <time.h>
 
 #include <map>
+#include <random>
+#include <vector>
 
 #include "base/macros.h"
 #include "gtest/gtest.h"
 
 struct AllocInfo {
   uint16_t size;
-  uint32_t hash;
+  uint32_t call_stack_id;
 };
 
+double NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Returns a random 16-byte aligned address with |bits| significant bits.
+const void* RandomAddress(std::mt19937_64* random, int bits) {
+  uintptr_t addr = (*random)() & ((1ULL << bits) - 1) & ~15ULL;
+  return reinterpret_cast<const void*>(addr | 16);
+}
+
 class CompactAddressMapTest : public ::testing::Test {
  public:
   CompactAddressMapTest() {}
@@ -35,9 +51,9 @@ TEST_F(CompactAddressMapTest, Test) {
   for (size_t n = 0; n < 1000; ++n) {
     uint8_t size = rand() & UINT8_MAX;
     int* ptr = new int[size];
-    uint32_t hash = ~reinterpret_cast<uint64_t>(ptr);
-    map[ptr] = { size, hash };
-    cam.Insert(ptr, size, &hash);
+    uint32_t call_stack_id = ~reinterpret_cast<uint64_t>(ptr);
+    map[ptr] = { size, call_stack_id };
+    cam.Insert(ptr, size, &call_stack_id);
     EXPECT_EQ(n + 1, cam.size());
   }
 
@@ -48,11 +64,189 @@ TEST_F(CompactAddressMapTest, Test) {
     CompactAddressMap::Entry entry = {};
     EXPECT_TRUE(cam.FindAndRemove(ptr, &entry));
 
-    EXPECT_EQ(info.size, entry.size);
+    EXPECT_EQ(info.size, entry.size());
 
     EXPECT_TRUE(entry.has_call_stack);
-    EXPECT_EQ(info.hash, entry.call_stack_hash);
+    EXPECT_EQ(info.call_stack_id, entry.call_stack_id);
 
     delete [] ptr;
   }
 }
+
+TEST_F(CompactAddressMapTest, InsertExisting) {
+  CompactAddressMap cam;
+  int value;
+  uint32_t call_stack_id = 1234;
+  EXPECT_TRUE(cam.Insert(&value, 4, &call_stack_id));
+  // The existing entry is kept.
+  EXPECT_FALSE(cam.Insert(&value, 8, nullptr));
+  EXPECT_EQ(1U, cam.size());
+
+  CompactAddressMap::Entry entry = {};
+  EXPECT_TRUE(cam.FindAndRemove(&value, &entry));
+  EXPECT_EQ(4U, entry.size());
+  EXPECT_TRUE(entry.has_call_stack);
+  EXPECT_EQ(call_stack_id, entry.call_stack_id);
+  EXPECT_FALSE(cam.FindAndRemove(&value, &entry));
+  EXPECT_EQ(0U, cam.size());
+}
+
+TEST_F(CompactAddressMapTest, LargeSize) {
+  CompactAddressMap cam;
+  int values[4];
+  cam.Insert(&values[0], 100000, nullptr);
+  cam.Insert(&values[1], (1 << 30) + 1, nullptr);
+  cam.Insert(&values[2], 0x123456789, nullptr);
+  cam.Insert(&values[3], SIZE_MAX, nullptr);
+
+  CompactAddressMap::Entry entry = {};
+  EXPECT_TRUE(cam.FindAndRemove(&values[0], &entry));
+  EXPECT_EQ(100000U, entry.size());
+  EXPECT_FALSE(entry.has_call_stack);
+  // Rounded down to 17 significant bits.
+  EXPECT_TRUE(cam.FindAndRemove(&values[1], &entry));
+  EXPECT_EQ(1U << 30, entry.size());
+  EXPECT_TRUE(cam.FindAndRemove(&values[2], &entry));
+  EXPECT_EQ(0x123450000U, entry.size());
+  EXPECT_TRUE(cam.FindAndRemove(&values[3], &entry));
+  EXPECT_EQ(CompactAddressMap::kMaxSize, entry.size());
+}
+
+TEST_F(CompactAddressMapTest, ForEachAndEraseIf) {
+  std::map<const void*, size_t> map;
+  CompactAddressMap cam;
+  // Spread over several pages and clusters.
+  const uintptr_t kBase = 0x7f1234560000;
+  for (uintptr_t n = 0; n < 1000; ++n) {
+    const void* ptr = reinterpret_cast<const void*>(kBase + n * n * 48);
+    map[ptr] = n;
+    cam.Insert(ptr, n, nullptr);
+  }
+
+  std::map<const void*, size_t> visited;
+  cam.ForEach([&visited](const void* ptr,
+                         const CompactAddressMap::Entry& entry) {
+    visited[ptr] = entry.size();
+  });
+  EXPECT_EQ(map, visited);
+
+  cam.EraseIf([](const void* /* ptr */,
+                 const CompactAddressMap::Entry& entry) {
+    return entry.size() % 3 == 0;
+  });
+  visited.clear();
+  cam.ForEach([&visited](const void* ptr,
+                         const CompactAddressMap::Entry& entry) {
+    visited[ptr] = entry.size();
+  });
+  for (auto it = map.begin(); it != map.end(); /**/) {
+    if (it->second % 3 == 0)
+      it = map.erase(it);
+    else
+      ++it;
+  }
+  EXPECT_EQ(map, visited);
+  EXPECT_EQ(map.size(), cam.size());
+}
+
+TEST_F(CompactAddressMapTest, HighAddresses) {
+  CompactAddressMap cam;
+  // The same low 52 bits at each of the top bits of a 57-bit address, so that
+  // cluster ids truncated to 32 bits would collide.
+  const uintptr_t kLowBits = 0x000abcdef1234560;
+  for (uintptr_t n = 0; n < 32; ++n)
+    cam.Insert(reinterpret_cast<const void*>(kLowBits | n << 52), n, nullptr);
+  cam.Insert(reinterpret_cast<const void*>(0x7ffffffff000), 1000, nullptr);
+  EXPECT_EQ(33U, cam.size());
+
+  std::map<const void*, size_t> visited;
+  cam.ForEach([&visited](const void* ptr,
+                         const CompactAddressMap::Entry& entry) {
+    visited[ptr] = entry.size();
+  });
+  EXPECT_EQ(33U, visited.size());
+  EXPECT_EQ(1000U, visited[reinterpret_cast<const void*>(0x7ffffffff000)]);
+
+  CompactAddressMap::Entry entry = {};
+  for (uintptr_t n = 0; n < 32; ++n) {
+    const void* ptr = reinterpret_cast<const void*>(kLowBits | n << 52);
+    EXPECT_EQ(n, visited[ptr]);
+    ASSERT_TRUE(cam.FindAndRemove(ptr, &entry));
+    EXPECT_EQ(n, entry.size());
+  }
+  EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<const void*>(0x7ffffffff000),
+                                &entry));
+  EXPECT_EQ(0U, cam.size());
+}
+
+TEST_F(CompactAddressMapTest, RandomHighAddressBenchmark) {
+  const size_t kNumEntries = 200000;
+  for (int bits : {48, 57}) {
+    CompactAddressMap cam;
+    std::mt19937_64 random(bits);
+    std::vector<const void*> ptrs(kNumEntries);
+    for (const void*& ptr : ptrs)
+      ptr = RandomAddress(&random, bits);
+
+    double start_ns = NowNs();
+    for (size_t i = 0; i < kNumEntries; ++i)
+      cam.Insert(ptrs[i], i & 0xff, nullptr);
+    double insert_ns = (NowNs() - start_ns) / kNumEntries;
+    size_t num_entries = cam.size();
+    EXPECT_GT(num_entries, kNumEntries * 99 / 100);
+
+    CompactAddressMap::Entry entry = {};
+    size_t num_found = 0;
+    start_ns = NowNs();
+    for (const void* ptr : ptrs)
+      num_found += cam.FindAndRemove(ptr, &entry);
+    double remove_ns = (NowNs() - start_ns) / kNumEntries;
+    EXPECT_EQ(num_entries, num_found);
+    EXPECT_EQ(0U, cam.size());
+
+    printf("%d-bit addresses: %.1f ns per insert, %.1f ns per removal, "
+           "%zu clusters, max %zu steps\n",
+           bits, insert_ns, remove_ns, cam.stats().num_clusters,
+           cam.stats().max_num_steps);
+  }
+}
+
+TEST_F(CompactAddressMapTest, RandomMissBenchmark) {
+  const size_t kNumEntries = 100000;
+  const size_t kNumMisses = 1000000;
+  CompactAddressMap cam;
+  std::mt19937_64 random(1);
+  // Entries clustered like a heap, looked up among addresses that are either
+  // nearby or anywhere.
+  const uintptr_t kHeapBase = 0x7f0000000000;
+  for (size_t i = 0; i < kNumEntries; ++i) {
+    cam.Insert(reinterpret_cast<const void*>(kHeapBase + i * 64), 32,
+               nullptr);
+  }
+  const CompactAddressMap::Stats stats = cam.stats();
+
+  std::vector<const void*> misses(kNumMisses);
+  for (size_t i = 0; i < kNumMisses; ++i) {
+    misses[i] = i % 2 ? RandomAddress(&random, 48)
+                      : reinterpret_cast<const void*>(
+                            kHeapBase + (random() % (kNumEntries * 4)) * 16 +
+                            8);
+  }
+
+  CompactAddressMap::Entry entry = {};
+  size_t num_found = 0;
+  double start_ns = NowNs();
+  for (const void* ptr : misses)
+    num_found += cam.FindAndRemove(ptr, &entry);
+  double miss_ns = (NowNs() - start_ns) / kNumMisses;
+  EXPECT_EQ(0U, num_found);
+
+  // Nothing was allocated for the misses.
+  EXPECT_EQ(kNumEntries, cam.size());
+  EXPECT_EQ(stats.heap_size, cam.stats().heap_size);
+  EXPECT_EQ(stats.num_clusters, cam.stats().num_clusters);
+  EXPECT_EQ(stats.num_pages, cam.stats().num_pages);
+
+  printf("%.1f ns per missed lookup, %zu bytes for %zu entries\n", miss_ns,
+         cam.stats().heap_size, cam.size());
+}
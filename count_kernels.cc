@@ -0,0 +1,248 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/count_kernels.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <functional>
+
+namespace leak_detector {
+
+namespace {
+
+// On x86-64, the kernels come in an SSE2 and an AVX2 version. SSE2 is always
+// there. Unless the compiler targets AVX2 throughout, the AVX2 version is
+// built for AVX2 on its own, and only called once the CPU is found to have it.
+#if defined(__x86_64__)
+#define HAS_AVX2_KERNELS
+#if defined(__AVX2__)
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+// Each Lanes type below compares or subtracts |kNumLanes| counters at once.
+// Loads are unaligned, so the arrays need no particular alignment.
+
+struct ScalarLanes {
+  static const size_t kNumLanes = 1;
+
+  // Returns a mask with bit i set for each of the |kNumLanes| counts starting
+  // at |counts| for which counts[i] > |threshold|.
+  static unsigned GreaterMask(const int32_t* counts, int32_t threshold) {
+    return counts[0] > threshold;
+  }
+
+  // Sets |kNumLanes| |net_counts| to |num_allocs| - |num_frees|.
+  static void Subtract(const uint32_t* num_allocs,
+                       const uint32_t* num_frees,
+                       uint32_t* net_counts) {
+    net_counts[0] = num_allocs[0] - num_frees[0];
+  }
+};
+
+#if defined(__SSE2__)
+struct Sse2Lanes {
+  static const size_t kNumLanes = 4;
+
+  static unsigned GreaterMask(const int32_t* counts, int32_t threshold) {
+    __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(counts));
+    __m128i greater = _mm_cmpgt_epi32(values, _mm_set1_epi32(threshold));
+    return _mm_movemask_ps(_mm_castsi128_ps(greater));
+  }
+
+  static void Subtract(const uint32_t* num_allocs,
+                       const uint32_t* num_frees,
+                       uint32_t* net_counts) {
+    __m128i allocs =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(num_allocs));
+    __m128i frees = _mm_loadu_si128(reinterpret_cast<const __m128i*>(num_frees));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(net_counts),
+                     _mm_sub_epi32(allocs, frees));
+  }
+};
+
+typedef Sse2Lanes DefaultLanes;
+#else
+typedef ScalarLanes DefaultLanes;
+#endif
+
+#if defined(HAS_AVX2_KERNELS)
+struct Avx2Lanes {
+  static const size_t kNumLanes = 8;
+
+  AVX2_FUNCTION static unsigned GreaterMask(const int32_t* counts,
+                                            int32_t threshold) {
+    __m256i values =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counts));
+    __m256i greater = _mm256_cmpgt_epi32(values, _mm256_set1_epi32(threshold));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(greater));
+  }
+
+  AVX2_FUNCTION static void Subtract(const uint32_t* num_allocs,
+                                     const uint32_t* num_frees,
+                                     uint32_t* net_counts) {
+    __m256i allocs =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(num_allocs));
+    __m256i frees =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(num_frees));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(net_counts),
+                        _mm256_sub_epi32(allocs, frees));
+  }
+};
+
+// Whether the CPU can run the AVX2 kernels.
+bool CanUseAvx2() {
+#if defined(__AVX2__)
+  return true;
+#else
+  // This may run before the constructor that sets up the CPU model for
+  // __builtin_cpu_supports(), if the detector is started from another
+  // constructor.
+  static const bool can_use_avx2 =
+      (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return can_use_avx2;
+#endif
+}
+#endif  // defined(HAS_AVX2_KERNELS)
+
+// Calls |visit(index)| for each index below |size| whose count is greater than
+// |threshold()|, in increasing order, while |visit| returns true. |threshold|
+// is called again after each visit, as a visit may change it.
+template <typename Lanes, typename Threshold, typename Visitor>
+void ForEachGreaterCount(const int32_t* counts,
+                         size_t begin,
+                         size_t size,
+                         Threshold threshold,
+                         Visitor visit) {
+  size_t i = begin;
+  for (; i + Lanes::kNumLanes <= size; i += Lanes::kNumLanes) {
+    unsigned mask = Lanes::GreaterMask(counts + i, threshold());
+    for (; mask; mask &= mask - 1) {
+      size_t index = i + __builtin_ctz(mask);
+      if (counts[index] > threshold() && !visit(index))
+        return;
+    }
+  }
+  for (; i < size; ++i) {
+    if (counts[i] > threshold() && !visit(i))
+      return;
+  }
+}
+
+template <typename Lanes>
+void ComputeNetCountsWith(const uint32_t* num_allocs,
+                          const uint32_t* num_frees,
+                          size_t size,
+                          uint32_t* net_counts) {
+  size_t i = 0;
+  for (; i + Lanes::kNumLanes <= size; i += Lanes::kNumLanes)
+    Lanes::Subtract(num_allocs + i, num_frees + i, net_counts + i);
+  for (; i < size; ++i)
+    net_counts[i] = num_allocs[i] - num_frees[i];
+}
+
+template <typename Lanes>
+size_t SelectTopCountsWith(const int32_t* counts,
+                           size_t size,
+                           size_t max_count,
+                           int* indices) {
+  if (size <= max_count) {
+    for (size_t i = 0; i < size; ++i)
+      indices[i] = i;
+    return size;
+  }
+  if (!max_count)
+    return 0;
+
+  // Find the |max_count|th largest count, as the smallest in a min-heap of the
+  // largest counts so far. Most counts are skipped a vector at a time for not
+  // exceeding it.
+  int32_t heap[kMaxSelectedCounts];
+  std::greater<int32_t> heap_order;
+  std::copy(counts, counts + max_count, heap);
+  std::make_heap(heap, heap + max_count, heap_order);
+  ForEachGreaterCount<Lanes>(
+      counts, max_count, size, [&heap]() { return heap[0]; },
+      [&](size_t index) {
+        std::pop_heap(heap, heap + max_count, heap_order);
+        heap[max_count - 1] = counts[index];
+        std::push_heap(heap, heap + max_count, heap_order);
+        return true;
+      });
+  const int32_t min_count = heap[0];
+
+  // Select all larger counts, and as many of those equal to |min_count| as
+  // there are left in the heap, first come first served.
+  size_t num_equal_left = std::count(heap, heap + max_count, min_count);
+  size_t num_selected = 0;
+  auto select = [&](size_t index) {
+    if (counts[index] > min_count) {
+      indices[num_selected++] = index;
+    } else if (num_equal_left > 0) {
+      indices[num_selected++] = index;
+      --num_equal_left;
+    }
+    return num_selected < max_count;
+  };
+  if (min_count == INT32_MIN) {
+    for (size_t i = 0; i < size && select(i); ++i) {
+    }
+  } else {
+    ForEachGreaterCount<Lanes>(counts, 0, size,
+                               [min_count]() { return min_count - 1; }, select);
+  }
+  return num_selected;
+}
+
+#if defined(HAS_AVX2_KERNELS)
+// The AVX2 kernels. Everything they call is inlined into them, so that the
+// AVX2 lanes are inlined into AVX2 code.
+AVX2_FUNCTION __attribute__((flatten)) void ComputeNetCountsAvx2(
+    const uint32_t* num_allocs,
+    const uint32_t* num_frees,
+    size_t size,
+    uint32_t* net_counts) {
+  ComputeNetCountsWith<Avx2Lanes>(num_allocs, num_frees, size, net_counts);
+}
+
+AVX2_FUNCTION __attribute__((flatten)) size_t SelectTopCountsAvx2(
+    const int32_t* counts,
+    size_t size,
+    size_t max_count,
+    int* indices) {
+  return SelectTopCountsWith<Avx2Lanes>(counts, size, max_count, indices);
+}
+#endif  // defined(HAS_AVX2_KERNELS)
+
+}  // namespace
+
+void ComputeNetCounts(const uint32_t* num_allocs,
+                      const uint32_t* num_frees,
+                      size_t size,
+                      uint32_t* net_counts) {
+#if defined(HAS_AVX2_KERNELS)
+  if (CanUseAvx2())
+    return ComputeNetCountsAvx2(num_allocs, num_frees, size, net_counts);
+#endif
+  ComputeNetCountsWith<DefaultLanes>(num_allocs, num_frees, size, net_counts);
+}
+
+size_t SelectTopCounts(const int32_t* counts,
+                       size_t size,
+                       size_t max_count,
+                       int* indices) {
+#if defined(HAS_AVX2_KERNELS)
+  if (CanUseAvx2())
+    return SelectTopCountsAvx2(counts, size, max_count, indices);
+#endif
+  return SelectTopCountsWith<DefaultLanes>(counts, size, max_count, indices);
+}
+
+}  // namespace leak_detector
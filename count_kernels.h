@@ -0,0 +1,39 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMPONENTS_METRICS_LEAK_DETECTOR_COUNT_KERNELS_H_
+#define COMPONENTS_METRICS_LEAK_DETECTOR_COUNT_KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Scans over arrays of counters, for leak analysis. On x86-64 they use AVX2
+// instructions if the CPU has them, and SSE2 otherwise. Elsewhere they use
+// plain loops.
+
+namespace leak_detector {
+
+// Max |max_count| of SelectTopCounts().
+const size_t kMaxSelectedCounts = 64;
+
+// Sets |net_counts[i]| to |num_allocs[i]| - |num_frees[i]| for each i below
+// |size|.
+void ComputeNetCounts(const uint32_t* num_allocs,
+                      const uint32_t* num_frees,
+                      size_t size,
+                      uint32_t* net_counts);
+
+// Writes to |indices| the indices of the |max_count| largest of the |size|
+// |counts|, in increasing order, and returns how many were written. Of equal
+// counts, those with lower indices are selected first. Adding just these
+// counts to a RankedList of size |max_count|, in the order of |indices|, has
+// the same result as adding all |counts| in order.
+size_t SelectTopCounts(const int32_t* counts,
+                       size_t size,
+                       size_t max_count,
+                       int* indices);
+
+}  // namespace leak_detector
+
+#endif  // COMPONENTS_METRICS_LEAK_DETECTOR_COUNT_KERNELS_H_
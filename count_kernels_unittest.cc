@@ -0,0 +1,150 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/count_kernels.h"
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "base/macros.h"
+#include "components/metrics/leak_detector/leak_detector_value_type.h"
+#include "components/metrics/leak_detector/ranked_list.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Size of the ranked lists that LeakDetectorImpl fills in.
+const size_t kRankedListSize = 16;
+
+// Returns the (value, count) pairs of |list|, with values being indices.
+std::vector<std::pair<uint32_t, int>> ListEntries(const RankedList& list) {
+  std::vector<std::pair<uint32_t, int>> entries;
+  for (const RankedList::Entry& entry : list)
+    entries.push_back(std::make_pair(entry.value.size(), entry.count));
+  return entries;
+}
+
+// Checks that adding only the counts selected by SelectTopCounts() to a
+// RankedList makes the same list as adding all of them.
+void CheckSelectTopCounts(const std::vector<int32_t>& counts,
+                          size_t max_count) {
+  RankedList all_list(max_count);
+  for (size_t i = 0; i < counts.size(); ++i)
+    all_list.Add(LeakDetectorValueType(i), counts[i]);
+
+  int indices[kMaxSelectedCounts];
+  size_t num_selected =
+      SelectTopCounts(counts.data(), counts.size(), max_count, indices);
+  ASSERT_LE(num_selected, max_count);
+  RankedList selected_list(max_count);
+  for (size_t i = 0; i < num_selected; ++i) {
+    if (i > 0) {
+      EXPECT_LT(indices[i - 1], indices[i]);
+    }
+    selected_list.Add(LeakDetectorValueType(indices[i]), counts[indices[i]]);
+  }
+  EXPECT_EQ(ListEntries(all_list), ListEntries(selected_list));
+}
+
+}  // namespace
+
+class CountKernelsTest : public ::testing::Test {
+ public:
+  CountKernelsTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(CountKernelsTest);
+};
+
+TEST_F(CountKernelsTest, ComputeNetCounts) {
+  std::mt19937 random(1);
+  // Sizes that leave a partial vector at the end.
+  for (size_t size : {0, 1, 7, 8, 9, 33, 2200}) {
+    std::vector<uint32_t> num_allocs(size), num_frees(size);
+    for (size_t i = 0; i < size; ++i) {
+      num_allocs[i] = random();
+      // Some frees outnumber allocs, when frees of unrecorded allocs count.
+      num_frees[i] = i % 3 ? num_allocs[i] - random() % 1000 : random();
+    }
+    std::vector<uint32_t> net_counts(size + 1, 12345);
+    ComputeNetCounts(num_allocs.data(), num_frees.data(), size,
+                     net_counts.data());
+    for (size_t i = 0; i < size; ++i)
+      EXPECT_EQ(num_allocs[i] - num_frees[i], net_counts[i]);
+    // Nothing is written past the end.
+    EXPECT_EQ(12345U, net_counts[size]);
+  }
+}
+
+TEST_F(CountKernelsTest, SelectTopCountsFewCounts) {
+  CheckSelectTopCounts({}, kRankedListSize);
+  CheckSelectTopCounts({3, -1, 0, 3}, kRankedListSize);
+  CheckSelectTopCounts(std::vector<int32_t>(kRankedListSize, 5),
+                       kRankedListSize);
+}
+
+TEST_F(CountKernelsTest, SelectTopCountsZeroMaxCount) {
+  std::vector<int32_t> counts = {1, 2, 3};
+  int indices[1];
+  EXPECT_EQ(0U, SelectTopCounts(counts.data(), counts.size(), 0, indices));
+}
+
+TEST_F(CountKernelsTest, SelectTopCountsMostlyZero) {
+  // Like the net counts of the size classes: mostly 0, some small, a few large
+  // and some below zero.
+  std::vector<int32_t> counts(2200, 0);
+  counts[5] = 100;
+  counts[700] = 3;
+  counts[701] = -4;
+  counts[2199] = 100000;
+  CheckSelectTopCounts(counts, kRankedListSize);
+}
+
+TEST_F(CountKernelsTest, SelectTopCountsTies) {
+  // More counts equal to the smallest selected count than fit, spread across
+  // vectors.
+  std::vector<int32_t> counts(1000, 1);
+  for (size_t i = 0; i < counts.size(); i += 37)
+    counts[i] = 7;
+  for (size_t i = 3; i < counts.size(); i += 101)
+    counts[i] = 2;
+  CheckSelectTopCounts(counts, kRankedListSize);
+  CheckSelectTopCounts(counts, 1);
+  CheckSelectTopCounts(counts, kMaxSelectedCounts);
+}
+
+TEST_F(CountKernelsTest, SelectTopCountsExtremes) {
+  std::vector<int32_t> counts(100, INT32_MIN);
+  CheckSelectTopCounts(counts, kRankedListSize);
+  counts[50] = INT32_MAX;
+  counts[99] = INT32_MAX;
+  CheckSelectTopCounts(counts, kRankedListSize);
+  CheckSelectTopCounts(counts, 1);
+}
+
+TEST_F(CountKernelsTest, SelectTopCountsRandom) {
+  std::mt19937 random(2);
+  for (int run = 0; run < 200; ++run) {
+    std::vector<int32_t> counts(random() % 3000);
+    // Narrow ranges make for many ties.
+    int32_t range = run % 2 ? 10 : 1000000;
+    for (int32_t& count : counts)
+      count = static_cast<int32_t>(random() % (2 * range)) - range / 4;
+    CheckSelectTopCounts(counts, 1 + random() % kMaxSelectedCounts);
+  }
+}
+
+}  // namespace leak_detector
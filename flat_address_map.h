@@ -0,0 +1,356 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMPONENTS_METRICS_LEAK_DETECTOR_FLAT_ADDRESS_MAP_H_
+#define COMPONENTS_METRICS_LEAK_DETECTOR_FLAT_ADDRESS_MAP_H_
+
+#include <gperftools/custom_allocator.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <initializer_list>
+#include <type_traits>
+
+#include "base/macros.h"
+
+namespace leak_detector {
+
+// Hash table from nonzero addresses to values of type |Value|, kept in a single
+// array of slots allocated with CustomAllocator. Collisions are resolved by
+// robin hood linear probing, and removals shift the following slots back
+// instead of leaving tombstones, so lookups stay short no matter how many
+// entries come and go.
+//
+// When the table fills up, its entries are moved to one twice the size a few
+// at a time by each subsequent Insert() and Erase(), so that no single call
+// has to move all of them.
+//
+// Pointers returned by Find() and Insert() are invalidated by the next call
+// that modifies the map.
+template <typename Value>
+class FlatAddressMap {
+ public:
+  // |initial_capacity| is rounded up to a power of two, of at least 8.
+  explicit FlatAddressMap(size_t initial_capacity);
+  ~FlatAddressMap();
+
+  size_t size() const { return size_; }
+
+  // Returns the number of bytes allocated for the table.
+  size_t memory_size() const {
+    return (table_.capacity() + old_table_.capacity()) * sizeof(Slot);
+  }
+
+  // Returns the value of |addr|, or null if it is not in the map.
+  Value* Find(uintptr_t addr);
+
+  // Returns the value of |addr|, adding it if it is not in the map yet, in
+  // which case |*inserted| is set and the value must be assigned. |addr| must
+  // not be 0.
+  Value* Insert(uintptr_t addr, bool* inserted);
+
+  // Removes the entry whose value was returned by Find() or Insert().
+  void Erase(Value* value);
+
+  // Prefetches the slot where a lookup of |addr| would start.
+  void Prefetch(uintptr_t addr) const {
+    __builtin_prefetch(&table_.slots[table_.HomeIndex(addr)], 1);
+  }
+
+  // Calls |visitor(addr, value)| for each entry.
+  template <typename Visitor>
+  void ForEach(Visitor visitor) const;
+
+  // Removes each entry for which |predicate(addr, value)| returns true.
+  template <typename Predicate>
+  void EraseIf(Predicate predicate);
+
+ private:
+  static_assert(std::is_trivially_copyable<Value>::value,
+                "Values are moved around as plain bytes.");
+
+  struct Slot {
+    // 0 if the slot is empty.
+    uintptr_t addr;
+    Value value;
+  };
+
+  struct Table {
+    Table() : slots(nullptr), mask(0), shift(0) {}
+
+    size_t capacity() const { return slots ? mask + 1 : 0; }
+
+    // Fibonacci hashing, which takes the top bits of the product. Those depend
+    // on all bits of the address, including the varying middle bits of heap
+    // addresses.
+    size_t HomeIndex(uintptr_t addr) const {
+      return static_cast<uint64_t>(addr) * 0x9e3779b97f4a7c15ULL >> shift;
+    }
+
+    // Number of slots between where the entry in slot |index| is and where it
+    // would ideally be.
+    size_t Distance(size_t index) const {
+      return (index - HomeIndex(slots[index].addr)) & mask;
+    }
+
+    Slot* slots;
+    size_t mask;
+    int shift;
+  };
+
+  // Entries are moved to a larger table once they take up this fraction of
+  // the slots.
+  static const size_t kMaxLoadNumerator = 4;
+  static const size_t kMaxLoadDenominator = 5;
+
+  // Number of slots of the old table that each modification moves, or skips
+  // over if they are empty, while the map is growing. The old table holds at
+  // most 4/5 as many entries as it has slots, and has half as many slots as
+  // the new one, so it is emptied before the new one fills up.
+  static const size_t kSlotsMovedPerCall = 8;
+
+  static void AllocateTable(size_t capacity, Table* table);
+  static void FreeTable(Table* table);
+
+  // Returns the index of |addr| in |table|, or -1 if it is not there.
+  static ptrdiff_t FindIndex(const Table& table, uintptr_t addr);
+
+  // Puts |slot| into |table|, which must not contain its address yet. Returns
+  // where it was put.
+  static Slot* InsertSlot(Table* table, const Slot& slot);
+
+  // Empties slot |index| of |table|, shifting back the entries that follow.
+  static void EraseIndex(Table* table, size_t index);
+
+  // Moves |table_| to |old_table_|, and allocates a larger |table_|.
+  void StartGrowing();
+
+  // Moves up to |num_slots| slots' worth of entries from |old_table_|.
+  void MoveOldSlots(size_t num_slots);
+
+  // The table that entries are inserted into.
+  Table table_;
+
+  // The previous table while its entries are being moved into |table_|. All
+  // slots before |old_table_index_| are empty.
+  Table old_table_;
+  size_t old_table_index_;
+
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(FlatAddressMap);
+};
+
+template <typename Value>
+FlatAddressMap<Value>::FlatAddressMap(size_t initial_capacity)
+    : old_table_index_(0), size_(0) {
+  size_t capacity = 8;
+  while (capacity < initial_capacity)
+    capacity *= 2;
+  AllocateTable(capacity, &table_);
+}
+
+template <typename Value>
+FlatAddressMap<Value>::~FlatAddressMap() {
+  FreeTable(&table_);
+  FreeTable(&old_table_);
+}
+
+template <typename Value>
+Value* FlatAddressMap<Value>::Find(uintptr_t addr) {
+  ptrdiff_t index = FindIndex(table_, addr);
+  if (index >= 0)
+    return &table_.slots[index].value;
+  if (old_table_.slots) {
+    index = FindIndex(old_table_, addr);
+    if (index >= 0)
+      return &old_table_.slots[index].value;
+  }
+  return nullptr;
+}
+
+template <typename Value>
+Value* FlatAddressMap<Value>::Insert(uintptr_t addr, bool* inserted) {
+  if (old_table_.slots) {
+    MoveOldSlots(kSlotsMovedPerCall);
+    // Only new entries go into |table_|, so the old table must be checked.
+    if (old_table_.slots) {
+      ptrdiff_t index = FindIndex(old_table_, addr);
+      if (index >= 0) {
+        *inserted = false;
+        return &old_table_.slots[index].value;
+      }
+    }
+  }
+  ptrdiff_t index = FindIndex(table_, addr);
+  if (index >= 0) {
+    *inserted = false;
+    return &table_.slots[index].value;
+  }
+
+  if ((size_ + 1) * kMaxLoadDenominator >
+      table_.capacity() * kMaxLoadNumerator) {
+    StartGrowing();
+  }
+  *inserted = true;
+  ++size_;
+  Slot slot = {addr, Value()};
+  return &InsertSlot(&table_, slot)->value;
+}
+
+template <typename Value>
+void FlatAddressMap<Value>::Erase(Value* value) {
+  Slot* slot = reinterpret_cast<Slot*>(reinterpret_cast<char*>(value) -
+                                       offsetof(Slot, value));
+  Table* table = slot >= table_.slots && slot < table_.slots + table_.capacity()
+                     ? &table_
+                     : &old_table_;
+  EraseIndex(table, slot - table->slots);
+  --size_;
+  if (old_table_.slots)
+    MoveOldSlots(kSlotsMovedPerCall);
+}
+
+template <typename Value>
+template <typename Visitor>
+void FlatAddressMap<Value>::ForEach(Visitor visitor) const {
+  for (const Table* table : {&table_, &old_table_}) {
+    for (size_t i = 0; i < table->capacity(); ++i) {
+      if (table->slots[i].addr)
+        visitor(table->slots[i].addr, table->slots[i].value);
+    }
+  }
+}
+
+template <typename Value>
+template <typename Predicate>
+void FlatAddressMap<Value>::EraseIf(Predicate predicate) {
+  MoveOldSlots(old_table_.capacity());
+
+  // Start after an empty slot, so that entries shifted back by a removal are
+  // always ones that have not been visited yet.
+  size_t start = 0;
+  while (table_.slots[start].addr)
+    ++start;
+  for (size_t n = 1; n <= table_.mask; ++n) {
+    size_t index = (start + n) & table_.mask;
+    while (table_.slots[index].addr &&
+           predicate(table_.slots[index].addr, table_.slots[index].value)) {
+      EraseIndex(&table_, index);
+      --size_;
+    }
+  }
+}
+
+// static
+template <typename Value>
+void FlatAddressMap<Value>::AllocateTable(size_t capacity, Table* table) {
+  table->slots =
+      static_cast<Slot*>(CustomAllocator::Allocate(capacity * sizeof(Slot)));
+  memset(static_cast<void*>(table->slots), 0, capacity * sizeof(Slot));
+  table->mask = capacity - 1;
+  table->shift = 64;
+  for (size_t n = capacity; n > 1; n /= 2)
+    --table->shift;
+}
+
+// static
+template <typename Value>
+void FlatAddressMap<Value>::FreeTable(Table* table) {
+  if (table->slots)
+    CustomAllocator::Free(table->slots, table->capacity() * sizeof(Slot));
+  *table = Table();
+}
+
+// static
+template <typename Value>
+ptrdiff_t FlatAddressMap<Value>::FindIndex(const Table& table,
+                                           uintptr_t addr) {
+  size_t index = table.HomeIndex(addr);
+  for (size_t distance = 0;; ++distance) {
+    const Slot& slot = table.slots[index];
+    if (slot.addr == addr)
+      return index;
+    // Had |addr| been inserted, it would have displaced any entry closer to
+    // its own home.
+    if (!slot.addr || table.Distance(index) < distance)
+      return -1;
+    index = (index + 1) & table.mask;
+  }
+}
+
+// static
+template <typename Value>
+typename FlatAddressMap<Value>::Slot* FlatAddressMap<Value>::InsertSlot(
+    Table* table,
+    const Slot& slot) {
+  Slot pending = slot;
+  Slot* result = nullptr;
+  size_t index = table->HomeIndex(pending.addr);
+  for (size_t distance = 0;; ++distance) {
+    Slot* current = &table->slots[index];
+    if (!current->addr) {
+      *current = pending;
+      return result ? result : current;
+    }
+    // Take the slot from an entry that is closer to its home, and find
+    // another one for that entry instead.
+    size_t current_distance = table->Distance(index);
+    if (current_distance < distance) {
+      Slot displaced = *current;
+      *current = pending;
+      if (!result)
+        result = current;
+      pending = displaced;
+      distance = current_distance;
+    }
+    index = (index + 1) & table->mask;
+  }
+}
+
+// static
+template <typename Value>
+void FlatAddressMap<Value>::EraseIndex(Table* table, size_t index) {
+  size_t next = (index + 1) & table->mask;
+  while (table->slots[next].addr && table->Distance(next) > 0) {
+    table->slots[index] = table->slots[next];
+    index = next;
+    next = (next + 1) & table->mask;
+  }
+  table->slots[index].addr = 0;
+}
+
+template <typename Value>
+void FlatAddressMap<Value>::StartGrowing() {
+  // Normally the previous move has long finished by now.
+  MoveOldSlots(old_table_.capacity());
+  old_table_ = table_;
+  old_table_index_ = 0;
+  AllocateTable(table_.capacity() * 2, &table_);
+}
+
+template <typename Value>
+void FlatAddressMap<Value>::MoveOldSlots(size_t num_slots) {
+  if (!old_table_.slots)
+    return;
+  size_t capacity = old_table_.capacity();
+  for (size_t n = 0; n < num_slots && old_table_index_ < capacity; ++n) {
+    Slot* slot = &old_table_.slots[old_table_index_];
+    if (!slot->addr) {
+      ++old_table_index_;
+      continue;
+    }
+    // Removing the entry may shift the next one into this slot, but never
+    // into one that has been passed, as those are all empty.
+    InsertSlot(&table_, *slot);
+    EraseIndex(&old_table_, old_table_index_);
+  }
+  if (old_table_index_ == capacity)
+    FreeTable(&old_table_);
+}
+
+}  // namespace leak_detector
+
+#endif  // COMPONENTS_METRICS_LEAK_DETECTOR_FLAT_ADDRESS_MAP_H_
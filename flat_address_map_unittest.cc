@@ -0,0 +1,158 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/flat_address_map.h"
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+
+#include <map>
+#include <random>
+
+#include "base/macros.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace {
+
+struct TestValue {
+  uint64_t size;
+  uint32_t id;
+};
+
+using TestMap = FlatAddressMap<TestValue>;
+
+// Checks that |map| holds exactly the entries of |expected|.
+void ExpectSameEntries(const std::map<uintptr_t, TestValue>& expected,
+                       TestMap* map) {
+  EXPECT_EQ(expected.size(), map->size());
+  for (const auto& entry : expected) {
+    const TestValue* value = map->Find(entry.first);
+    ASSERT_TRUE(value);
+    EXPECT_EQ(entry.second.size, value->size);
+    EXPECT_EQ(entry.second.id, value->id);
+  }
+
+  size_t num_visited = 0;
+  map->ForEach([&](uintptr_t addr, const TestValue& value) {
+    auto iter = expected.find(addr);
+    ASSERT_TRUE(iter != expected.end());
+    EXPECT_EQ(iter->second.id, value.id);
+    ++num_visited;
+  });
+  EXPECT_EQ(expected.size(), num_visited);
+}
+
+}  // namespace
+
+class FlatAddressMapTest : public ::testing::Test {
+ public:
+  FlatAddressMapTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(FlatAddressMapTest);
+};
+
+TEST_F(FlatAddressMapTest, InsertFindErase) {
+  TestMap map(16);
+  EXPECT_EQ(0U, map.size());
+  EXPECT_FALSE(map.Find(0x1000));
+
+  bool inserted = false;
+  TestValue* value = map.Insert(0x1000, &inserted);
+  EXPECT_TRUE(inserted);
+  *value = {32, 1};
+
+  // Inserting the same address again returns the existing value.
+  value = map.Insert(0x1000, &inserted);
+  EXPECT_FALSE(inserted);
+  EXPECT_EQ(32U, value->size);
+  EXPECT_EQ(1U, map.size());
+
+  value = map.Find(0x1000);
+  ASSERT_TRUE(value);
+  EXPECT_EQ(1U, value->id);
+  map.Erase(value);
+  EXPECT_EQ(0U, map.size());
+  EXPECT_FALSE(map.Find(0x1000));
+}
+
+TEST_F(FlatAddressMapTest, RandomOperationsWhileGrowing) {
+  // Starts small, so that the map grows several times, and entries are
+  // inserted and erased while they are being moved to a larger table.
+  TestMap map(8);
+  std::map<uintptr_t, TestValue> expected;
+  std::mt19937 random(1234);
+
+  uint32_t next_id = 0;
+  for (int i = 0; i < 100000; ++i) {
+    // Heap-like addresses, which are aligned and clustered together.
+    uintptr_t addr = 0x7f0000000000 + (random() % 8192) * 16;
+    auto iter = expected.find(addr);
+    if (iter == expected.end()) {
+      bool inserted = false;
+      TestValue* value = map.Insert(addr, &inserted);
+      ASSERT_TRUE(inserted);
+      *value = {addr / 16, next_id};
+      expected[addr] = {addr / 16, next_id};
+      ++next_id;
+    } else {
+      TestValue* value = map.Find(addr);
+      ASSERT_TRUE(value);
+      EXPECT_EQ(iter->second.id, value->id);
+      map.Erase(value);
+      expected.erase(iter);
+    }
+    ASSERT_EQ(expected.size(), map.size());
+  }
+  ExpectSameEntries(expected, &map);
+
+  // Erasing everything leaves the map usable.
+  map.EraseIf([](uintptr_t /* addr */, const TestValue& /* value */) {
+    return true;
+  });
+  EXPECT_EQ(0U, map.size());
+  bool inserted = false;
+  map.Insert(0x1234, &inserted);
+  EXPECT_TRUE(inserted);
+  EXPECT_EQ(1U, map.size());
+}
+
+TEST_F(FlatAddressMapTest, EraseIf) {
+  TestMap map(8);
+  std::map<uintptr_t, TestValue> expected;
+  for (uint32_t i = 0; i < 5000; ++i) {
+    uintptr_t addr = 0x10000 + i * 48;
+    bool inserted = false;
+    *map.Insert(addr, &inserted) = {i % 7, i};
+    if (i % 7 != 3)
+      expected[addr] = {i % 7, i};
+  }
+
+  // Each entry is visited once, even while entries are shifted around by the
+  // erasing of others.
+  size_t num_visited = 0;
+  map.EraseIf([&num_visited](uintptr_t /* addr */, const TestValue& value) {
+    ++num_visited;
+    return value.size == 3;
+  });
+  EXPECT_EQ(5000U, num_visited);
+  ExpectSameEntries(expected, &map);
+}
+
+TEST_F(FlatAddressMapTest, MemorySize) {
+  TestMap map(1000);
+  EXPECT_EQ(1024U * (sizeof(uintptr_t) + sizeof(TestValue)),
+            map.memory_size());
+}
+
+}  // namespace leak_detector
@@ -5,14 +5,25 @@
 #ifndef SPINLOCK_WRAPPER_H_
 #define SPINLOCK_WRAPPER_H_
 
-class SpinLock;
+#include <stdint.h>
 
-// A container class for using tcmalloc's SpinLock class.
-// This allows users of this class to avoid including base/spinlock.h, which
-// causes #include path conflicts.
+#include <atomic>
 
-// SpinLockWrapper depends on CustomAllocator, which must be initialized before
-// any instance of this class is created.
+// Contention statistics of a SpinLockWrapper.
+struct SpinLockStats {
+  // Number of times the lock was acquired.
+  uint64_t num_acquisitions;
+
+  // Number of those times the lock was held by another thread, and the total
+  // time spent waiting for it then.
+  uint64_t num_contended_acquisitions;
+  uint64_t total_wait_ns;
+};
+
+// A lock that never allocates memory, so that it can be used from within the
+// malloc hooks. A thread that finds the lock taken spins for a while, adapting
+// the number of spins to how long the lock has been held recently, and then
+// sleeps on a futex until the lock is released.
 class SpinLockWrapper {
  public:
   SpinLockWrapper();
@@ -21,8 +32,26 @@ class SpinLockWrapper {
   void Lock();
   void Unlock();
 
+  // Reads the statistics without taking the lock, so they may be slightly out
+  // of date.
+  void GetStats(SpinLockStats* stats) const;
+
  private:
-  SpinLock* lock_;
+  // Lock() for when the lock is not immediately available.
+  void LockSlow();
+
+  // 0 if unlocked, 1 if locked, 2 if locked and there may be threads sleeping
+  // on the futex.
+  std::atomic<int> state_;
+
+  // Moving average of the number of spins in recent contended acquisitions,
+  // counting the ones that had to sleep as having spun for as long as allowed.
+  std::atomic<int> average_spins_;
+
+  // Statistics. Only modified by the thread holding the lock.
+  std::atomic<uint64_t> num_acquisitions_;
+  std::atomic<uint64_t> num_contended_acquisitions_;
+  std::atomic<uint64_t> total_wait_ns_;
 };
 
 // Corresponding locker object that arranges to acquire a spinlock for the
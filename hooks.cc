@@ -4,14 +4,25 @@
 
 #include <algorithm>
 
+#include "base/hash.h"
+#include "stack_unwinder.h"
+
 namespace MallocHook {
 
 namespace {
 
 NewHookType new_hook_ = NULL;
 DeleteHookType delete_hook_ = NULL;
-void* stack_trace_[32];
-int depth_;
+// Points to the stack most recently passed to SetCallerStackTrace() by this
+// thread. The caller keeps it alive until the hooks for that allocation have
+// run. Per thread, so that several threads can pass their allocations to the
+// hooks at once.
+__thread void* const* stack_trace_ = NULL;
+__thread int depth_ = 0;
+
+// Hash of |stack_trace_|, if |has_hash_| is set.
+__thread uint32_t hash_ = 0;
+__thread bool has_hash_ = false;
 
 }  // namespace
 
@@ -38,14 +49,45 @@ void InvokeDeleteHook(const void* ptr) {
 }
 
 void SetCallerStackTrace(int depth, void* const stack[]) {
-  memcpy(stack_trace_, stack, sizeof(*stack) * depth);
+  stack_trace_ = stack;
+  depth_ = depth;
+  has_hash_ = false;
+}
+
+void SetCallerStackTrace(int depth, void* const stack[], uint32_t hash) {
+  stack_trace_ = stack;
   depth_ = depth;
+  hash_ = hash;
+  has_hash_ = true;
 }
 
-int GetCallerStackTrace(void* stack[], int depth, int /* skip */) {
+int GetCallerStackTrace(void* stack[], int depth, int skip) {
+  if (!stack_trace_) {
+    uint32_t hash;
+    return UnwindFramePointers(stack, depth, skip + 1, &hash);
+  }
   int actual_depth = std::min(depth, depth_);
   memcpy(stack, stack_trace_, sizeof(*stack) * actual_depth);
   return actual_depth;
 }
 
+int GetCallerStackTrace(void* stack[], int depth, int skip, uint32_t* hash) {
+  if (!stack_trace_) {
+    // Through a local, so that the unwind is not a tail call that would leave
+    // no frame of this function to skip.
+    uint32_t unwound_hash;
+    int actual_depth =
+        UnwindFramePointers(stack, depth, skip + 1, &unwound_hash);
+    *hash = unwound_hash;
+    return actual_depth;
+  }
+  int actual_depth = GetCallerStackTrace(stack, depth, skip);
+  // The known hash only applies if the whole stack was returned.
+  if (has_hash_ && actual_depth == depth_)
+    *hash = hash_;
+  else
+    *hash = base::Hash(stack, sizeof(*stack) * actual_depth);
+  return actual_depth;
+}
+
 }  // namespace MallocHook
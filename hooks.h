@@ -2,6 +2,7 @@
 #define _HOOKS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 namespace MallocHook {
 
@@ -15,7 +16,16 @@ void InvokeNewHook(const void* ptr, size_t size);
 void InvokeDeleteHook(const void* ptr);
 
 void SetCallerStackTrace(int depth, void* const stack[]);
+// Same as above, with the known base::Hash() of |stack|.
+void SetCallerStackTrace(int depth, void* const stack[], uint32_t hash);
+
+// Returns the call stack of the current allocation: the one most recently
+// passed to SetCallerStackTrace() on this thread, or if there was none, that
+// of the caller, unwound with UnwindFramePointers() after skipping |skip|
+// frames.
 int GetCallerStackTrace(void* stack[], int depth, int skip);
+// Same as above, and also returns base::Hash() of the returned frames in |hash|.
+int GetCallerStackTrace(void* stack[], int depth, int skip, uint32_t* hash);
 
 }  // namespace MallocHook
 
@@ -37,6 +37,17 @@ void LeakAnalyzer::AddSample(RankedList&& ranked_list) {
   AnalyzeDeltas(ranked_deltas);
 }
 
+void LeakAnalyzer::AddUnchangedSample() {
+  // Entries added in rank order keep that order.
+  RankedList ranked_list(ranked_entries_.max_size());
+  for (const RankedEntry& entry : ranked_entries_)
+    ranked_list.Add(entry.value, entry.count);
+  prev_ranked_entries_ = std::move(ranked_list);
+
+  // All deltas would be 0.
+  AnalyzeDeltas(RankedList(ranking_size_));
+}
+
 size_t LeakAnalyzer::Dump(const size_t buffer_size, char* buffer) const {
   size_t size_remaining = buffer_size;
   int attempted_size = 0;
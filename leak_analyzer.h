@@ -39,6 +39,11 @@ class LeakAnalyzer {
   // of |ranked_list|.
   void AddSample(RankedList&& ranked_list);
 
+  // Same as AddSample() with a copy of the most recent sample, for when the
+  // counts it was taken from have not changed. No entry has grown, so nothing
+  // is suspected.
+  void AddUnchangedSample();
+
   // Used to report suspected leaks. Reported leaks are sorted by ValueType.
   const std::vector<ValueType, Allocator<ValueType>>& suspected_leaks() const {
     return suspected_leaks_;
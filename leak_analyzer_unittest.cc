@@ -362,4 +362,44 @@ TEST_F(LeakAnalyzerTest, LeakMultipleSizesWithLargeThreshold) {
   }
 }
 
+TEST_F(LeakAnalyzerTest, UnchangedSample) {
+  // |unchanged_analyzer| gets AddUnchangedSample() where |analyzer| gets the
+  // same sample as last time. Both should end up in the same state.
+  LeakAnalyzer analyzer(kDefaultRankedListSize, kDefaultLeakThreshold);
+  LeakAnalyzer unchanged_analyzer(kDefaultRankedListSize,
+                                  kDefaultLeakThreshold);
+  const int kUnchangedIteration = kDefaultLeakThreshold + 2;
+
+  for (int i = 0; i < 2 * kUnchangedIteration; ++i) {
+    int leak_iteration = i < kUnchangedIteration ? i : i - 1;
+    for (LeakAnalyzer* current : {&analyzer, &unchanged_analyzer}) {
+      if (i == kUnchangedIteration && current == &unchanged_analyzer) {
+        current->AddUnchangedSample();
+        continue;
+      }
+      RankedList list(kDefaultRankedListSize);
+      list.Add(Size(32), 10);
+      list.Add(Size(56), 90);
+      list.Add(Size(24), 30 + leak_iteration * 10);  // A potential leak.
+      list.Add(Size(64), 40);
+      current->AddSample(std::move(list));
+    }
+
+    // The leak is reported until the sample that does not change, and again
+    // once it has been growing for long enough after that.
+    if (i == kUnchangedIteration - 1 || i == 2 * kUnchangedIteration - 1) {
+      EXPECT_EQ(1U, analyzer.suspected_leaks().size());
+    } else if (i == kUnchangedIteration) {
+      EXPECT_TRUE(analyzer.suspected_leaks().empty());
+    }
+    EXPECT_EQ(analyzer.suspected_leaks(), unchanged_analyzer.suspected_leaks());
+
+    char buffer[1024];
+    char unchanged_buffer[1024];
+    analyzer.Dump(sizeof(buffer), buffer);
+    unchanged_analyzer.Dump(sizeof(unchanged_buffer), unchanged_buffer);
+    EXPECT_STREQ(buffer, unchanged_buffer);
+  }
+}
+
 }  // namespace leak_detector
@@ -9,13 +9,24 @@
 #include <gperftools/malloc_hook.h>
 #include <gperftools/spin_lock_wrapper.h>
 #include <link.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
 #include <new>
 
+#include "base/hash.h"
 #include "base/logging.h"
 #include "components/metrics/leak_detector/leak_detector_impl.h"
+#include "components/metrics/leak_detector/sampled_address_filter.h"
 #include "hooks.h"
 
 namespace leak_detector {
@@ -33,6 +44,33 @@ static const int kStripFrames = 2;
 static const int kStripFrames = 3;
 #endif
 
+// RecordEvents() samples the events passed to it, and hands them to
+// LeakDetectorImpl::RecordEvents(), this many at a time.
+const size_t kMaxSampledEventBatchSize = 256;
+
+// Number of sampled events each thread buffers before handing them to the leak
+// detector, and the deepest call stack it can buffer with an event.
+const size_t kThreadEventBufferSize = 32;
+const int kMaxBufferedStackDepth = 32;
+
+// Each thread hands its allocated byte count to the leak detector at least this
+// many times per dump interval, so that leak analysis is not delayed by much.
+const uint64_t kThreadFlushesPerDumpInterval = 16;
+
+// Bounds of the sampling rate when it is adjusted to an overhead target.
+const int kMinSamplingFactor = 1;
+const int kMaxSamplingFactor = 256;
+const uint64_t kMinSamplingIntervalBytes = 256;
+const uint64_t kMaxSamplingIntervalBytes = 1ULL << 30;
+
+// Each adjustment changes the sampling rate by at most this factor, so that a
+// noisy overhead measurement cannot swing it far.
+const double kMaxSamplingRateChange = 2;
+
+// The overhead is measured over at least this much process CPU time before the
+// sampling rate is adjusted.
+const uint64_t kMinOverheadMeasurementNs = 10 * 1000 * 1000;
+
 // For storing the address range of the Chrome binary in memory.
 struct MappingInfo {
   uintptr_t addr;
@@ -55,18 +93,56 @@ int EnvToInt(const char* envname, const int default_value) {
       : strtol(getenv(envname), nullptr, 10);
 }
 
+// Reads a number of kilobytes, and returns it in bytes. Values that are not
+// positive are ignored in favor of |default_kb|.
+uint64_t EnvKilobytesToBytes(const char* envname, const int default_kb) {
+  long long kb = !getenv(envname)
+      ? default_kb
+      : strtoll(getenv(envname), nullptr, 10);
+  if (kb <= 0)
+    kb = default_kb;
+  return static_cast<uint64_t>(kb) * 1024;
+}
+
+double EnvToDouble(const char* envname, const double default_value) {
+  return !getenv(envname)
+      ? default_value
+      : strtod(getenv(envname), nullptr);
+}
+
 // Used for sampling allocs and frees. Randomly samples |g_sampling_factor|/256
-// of the pointers being allocated and freed.
-int g_sampling_factor = EnvToInt("LEAK_DETECTOR_SAMPLING_FACTOR", 1);
+// of the pointers being allocated and freed. Atomic because the overhead
+// budget may change it; modify it only when locked.
+std::atomic<int> g_sampling_factor(
+    EnvToInt("LEAK_DETECTOR_SAMPLING_FACTOR", 1));
+
+// If nonzero, sample allocs by the number of bytes allocated instead, at an
+// average of one sampled alloc per this many bytes. Larger allocs are then more
+// likely to be sampled. Overrides |g_sampling_factor|. The overhead budget may
+// change it, but never between zero and nonzero; modify it only when locked.
+std::atomic<uint64_t> g_sampling_interval_bytes(
+    EnvKilobytesToBytes("LEAK_DETECTOR_SAMPLING_INTERVAL_KB", 0));
+
+// If nonzero, adjust the sampling rate at each dump interval so that the leak
+// detector takes about this percentage of the CPU time used by the process.
+// The configured rate is only the starting point.
+double g_overhead_target_percent =
+    EnvToDouble("LEAK_DETECTOR_OVERHEAD_TARGET_PERCENT", 0);
 
 // The number of call stack levels to unwind when profiling allocations by call
 // stack.
 int g_stack_depth = EnvToInt("LEAK_DETECTOR_STACK_DEPTH", 4);
 
+// If nonzero and below |g_stack_depth|, unwind only this many levels for the
+// allocation sizes of each new call stack table, and go up to |g_stack_depth|
+// for a size once one of its call stacks is suspected. See
+// LeakDetectorImpl::SetStackDepth().
+int g_initial_stack_depth = EnvToInt("LEAK_DETECTOR_INITIAL_STACK_DEPTH", 0);
+
 // Dump allocation stats and check for memory leaks after this many bytes have
 // been allocated since the last dump/check. Does not get affected by sampling.
 uint64_t g_dump_interval_bytes =
-    EnvToInt("LEAK_DETECTOR_DUMP_INTERVAL_KB", 32768) * 1024;
+    EnvKilobytesToBytes("LEAK_DETECTOR_DUMP_INTERVAL_KB", 32768);
 
 // Enable verbose logging. Dump all leak analysis data, not just analysis
 // summaries and suspected leak reports.
@@ -82,6 +158,30 @@ int g_size_suspicion_threshold =
 int g_call_stack_suspicion_threshold =
     EnvToInt("LEAK_DETECTOR_CALL_STACK_SUSPICION_THRESHOLD", 4);
 
+// Have each thread buffer its sampled events and count its allocated bytes by
+// itself, only taking the heap lock to hand them over in bulk. Otherwise every
+// allocation takes the heap lock.
+bool g_use_thread_buffers = EnvToBool("LEAK_DETECTOR_THREAD_BUFFERS", false);
+
+// Run leak analysis on a dedicated thread, rather than on whichever thread
+// allocates past the next dump threshold.
+bool g_analyze_in_background =
+    EnvToBool("LEAK_DETECTOR_BACKGROUND_ANALYSIS", false);
+
+// How to rank allocation sizes to find leaks, as a
+// LeakDetectorImpl::LeakRanking: 0 by net number of allocs, 1 by net bytes, 2
+// by both.
+int g_leak_ranking = EnvToInt("LEAK_DETECTOR_LEAK_RANKING", 0);
+
+// Track the recorded allocs in a CompactAddressMap, which takes less memory
+// than the default FlatAddressMap but is slower.
+bool g_use_compact_address_map =
+    EnvToBool("LEAK_DETECTOR_COMPACT_ADDRESS_MAP", false);
+
+// Store call stacks in a trie that shares their common outer frames, which
+// takes less memory for deep call stacks but is slower to look them up in.
+bool g_use_call_stack_trie = EnvToBool("LEAK_DETECTOR_CALL_STACK_TRIE", false);
+
 // Use a simple spinlock for locking. Don't use a mutex, which can call malloc
 // and cause infinite recursion.
 SpinLockWrapper* g_heap_lock = nullptr;
@@ -90,6 +190,10 @@ SpinLockWrapper* g_heap_lock = nullptr;
 // Modify this only when locked.
 LeakDetectorImpl* g_leak_detector = nullptr;
 
+// With byte sampling, the addresses of sampled allocs, so that the frees of
+// other allocs can be skipped.
+SampledAddressFilter* g_sampled_addresses = nullptr;
+
 // Keep track of the total number of bytes allocated.
 // Modify this only when locked.
 uint64_t g_total_alloc_size = 0;
@@ -98,18 +202,79 @@ uint64_t g_total_alloc_size = 0;
 // Modify this only when locked.
 uint64_t g_last_alloc_dump_size = 0;
 
-// Dump allocation stats and check for leaks after |g_dump_interval_bytes| bytes
-// have been allocated since the last time that was done. Should be called with
-// a lock since it modifies the global variable |g_last_alloc_dump_size|.
-inline void MaybeDumpStatsAndCheckForLeaks() {
-  if (g_total_alloc_size > g_last_alloc_dump_size + g_dump_interval_bytes) {
-    g_last_alloc_dump_size = g_total_alloc_size;
+// Number of leak analyses started or finished, each of which may change the
+// sampling factor or the sizes that need call stacks. RecordEvents() checks it
+// to tell whether events it sampled without the lock are still up to date.
+// Modify this only when locked.
+std::atomic<uint32_t> g_num_analysis_changes(0);
 
-    InternalVector<InternalLeakReport> reports;
-    g_leak_detector->TestForLeaks(true /* do_logging */, &reports);
+// Sampled events and allocated bytes of one thread that have not been handed to
+// |g_leak_detector| yet. Plain data, so that it can be thread-local without any
+// allocation or destructor registration by the C++ runtime.
+struct ThreadEventBuffer {
+  uint64_t alloc_size;
+  size_t num_events;
+  LeakDetectorImpl::Event events[kThreadEventBufferSize];
+  void* stacks[kThreadEventBufferSize][kMaxBufferedStackDepth];
+
+  // Whether the buffer will be drained when the thread exits.
+  bool registered;
+
+  // Id of the buffer as a LeakDetectorImpl::AddEventSource() source, or 0 if it
+  // has none, in which case its events are recorded as if they were in order.
+  uint32_t source;
+};
+
+__thread ThreadEventBuffer t_event_buffer;
+
+// Used to drain each thread's event buffer when the thread exits.
+pthread_key_t g_thread_buffer_key;
+
+// Per-thread state of the byte sampler.
+struct ThreadSamplerState {
+  // Bytes left to allocate until the next sample point.
+  int64_t bytes_until_sample;
+
+  // State of the random number generator, or 0 if the thread has not drawn a
+  // sample point yet.
+  uint64_t random_state;
+};
+
+__thread ThreadSamplerState t_sampler_state;
+
+// Values of |g_analysis_state|.
+enum AnalysisState {
+  kAnalysisIdle,
+  kAnalysisRequested,
+  kAnalysisStopping,
+};
+
+// What the background analysis thread should do next. The thread sleeps on
+// this as a futex while it is idle.
+std::atomic<int> g_analysis_state(kAnalysisIdle);
+
+pthread_t g_analysis_thread;
+
+// Has the background analysis thread run a leak analysis, unless it is already
+// waiting to do so.
+inline void RequestAnalysis() {
+  int idle = kAnalysisIdle;
+  if (g_analysis_state.compare_exchange_strong(idle, kAnalysisRequested)) {
+    syscall(SYS_futex, reinterpret_cast<int*>(&g_analysis_state),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
   }
 }
 
+// Rebuilds |g_sampled_addresses| from the allocs that are still live, so that
+// it does not fill up. Should be called with a lock.
+void RefreshSampledAddressFilter() {
+  if (!g_sampled_addresses)
+    return;
+  g_sampled_addresses->StartNewGeneration();
+  g_leak_detector->AddLiveAddressesToFilter(g_sampled_addresses);
+  g_sampled_addresses->FinishNewGeneration();
+}
+
 // Convert a pointer to a hash value. Returns only the upper eight bits.
 inline uint64_t PointerToHash(const void* ptr) {
   // The input data is the pointer address, not the location in memory pointed
@@ -123,7 +288,216 @@ inline uint64_t PointerToHash(const void* ptr) {
 
 // Uses PointerToHash() to pseudorandomly sample |ptr|.
 inline bool ShouldSample(const void* ptr) {
-  return PointerToHash(ptr) < static_cast<uint64_t>(g_sampling_factor);
+  return PointerToHash(ptr) <
+         static_cast<uint64_t>(
+             g_sampling_factor.load(std::memory_order_relaxed));
+}
+
+// Returns |state| with its random number generator seeded.
+ThreadSamplerState* SeededSamplerState(ThreadSamplerState* state) {
+  if (!state->random_state) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    state->random_state =
+        (reinterpret_cast<uint64_t>(state) ^ ts.tv_nsec) * 0x9ddfea08eb382d69ULL
+        | 1;
+  }
+  return state;
+}
+
+// Returns a random number that is uniform in (0, 1]. |state| must be seeded.
+double NextUniform(ThreadSamplerState* state) {
+  // xorshift64*.
+  uint64_t x = state->random_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  state->random_state = x;
+  return ((x * 0x2545f4914f6cdd1dULL >> 11) + 1) / 9007199254740992.0;
+}
+
+// Returns the number of bytes from one byte sampling point to the next. These
+// are exponentially distributed, which makes the sample points a Poisson
+// process over the bytes allocated by the thread.
+int64_t NextSampleInterval(ThreadSamplerState* state) {
+  return static_cast<int64_t>(
+             -log(NextUniform(state)) *
+             g_sampling_interval_bytes.load(std::memory_order_relaxed)) + 1;
+}
+
+// Called when an alloc reaches the countdown to the next sample point. Starts
+// the next countdown, and returns whether to sample the alloc.
+bool ReachedSamplePoint(ThreadSamplerState* state, size_t size) {
+  if (!state->random_state) {
+    // There was no countdown yet, so start one at the beginning of this alloc.
+    SeededSamplerState(state);
+    state->bytes_until_sample = NextSampleInterval(state) - size;
+    if (state->bytes_until_sample > 0)
+      return false;
+  }
+  // Even if the alloc spans several sample points, it is sampled once. The next
+  // countdown can start at its end, as the intervals are memoryless.
+  state->bytes_until_sample = NextSampleInterval(state);
+  return true;
+}
+
+// Decides whether to sample the alloc of |size| bytes at |ptr|. With byte
+// sampling, this is a subtraction and a branch unless the alloc is sampled.
+inline bool ShouldSampleAlloc(const void* ptr, size_t size) {
+  if (!g_sampling_interval_bytes.load(std::memory_order_relaxed))
+    return ShouldSample(ptr);
+
+  ThreadSamplerState* state = &t_sampler_state;
+  state->bytes_until_sample -= size;
+  if (state->bytes_until_sample > 0)
+    return false;
+  return ReachedSamplePoint(state, size);
+}
+
+// Decides whether to sample the free of |ptr|, which should be done if its
+// alloc was sampled.
+inline bool ShouldSampleFree(const void* ptr) {
+  if (!g_sampling_interval_bytes.load(std::memory_order_relaxed))
+    return ShouldSample(ptr);
+  return g_sampled_addresses->MayContain(ptr);
+}
+
+// Time spent in the leak detector so far, as measured by ScopedOverheadTimer.
+std::atomic<uint64_t> g_overhead_ns(0);
+
+// |g_overhead_ns| and the CPU time of the process when the sampling rate was
+// last adjusted. Modify these only when locked.
+uint64_t g_last_overhead_ns = 0;
+uint64_t g_last_process_cpu_ns = 0;
+
+// The sampling interval before it was last increased. See ShouldThinAlloc().
+uint64_t g_previous_sampling_interval_bytes = 0;
+
+uint64_t ClockNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Adds the time from its construction to its destruction to |g_overhead_ns|,
+// if there is an overhead target. Measures wall time, as reading the thread's
+// CPU time is much slower, so time spent waiting for the heap lock counts too.
+// Only sampled events are timed, so the overhead of the unsampled fast path,
+// which does not depend on the sampling rate, is left out.
+class ScopedOverheadTimer {
+ public:
+  ScopedOverheadTimer()
+      : start_ns_(g_overhead_target_percent ? ClockNs(CLOCK_MONOTONIC) : 0) {}
+
+  ~ScopedOverheadTimer() {
+    if (start_ns_) {
+      g_overhead_ns.fetch_add(ClockNs(CLOCK_MONOTONIC) - start_ns_,
+                              std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  const uint64_t start_ns_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedOverheadTimer);
+};
+
+// LeakDetectorImpl::ForgetAllocs() predicates for when sampling becomes
+// sparser. Pointer sampling is deterministic, so exactly the allocs that are no
+// longer sampled are forgotten. Byte-sampled allocs are thinned at random, so
+// that each remains with the probability of sampling it at the new interval.
+bool IsUnsampledAlloc(const void* ptr, size_t /* size */) {
+  return !ShouldSample(ptr);
+}
+
+bool ShouldThinAlloc(const void* /* ptr */, size_t size) {
+  double keep_probability =
+      expm1(-static_cast<double>(size) / g_sampling_interval_bytes) /
+      expm1(-static_cast<double>(size) / g_previous_sampling_interval_bytes);
+  return NextUniform(SeededSamplerState(&t_sampler_state)) > keep_probability;
+}
+
+// Adjusts the sampling rate so that the time measured by ScopedOverheadTimer
+// approaches |g_overhead_target_percent| of the CPU time used by the process.
+// The overhead is roughly proportional to the sampling rate, so the rate is
+// scaled by the ratio of the target to the measured overhead.
+//
+// Where sampling becomes sparser, the recorded allocs that the new rate would
+// not have sampled are forgotten, so the counts stay consistent with the rate.
+// Where it becomes denser, allocs from before the change are underrepresented
+// until they are freed. Should be called with a lock.
+void MaybeAdjustSamplingRate() {
+  if (!g_overhead_target_percent)
+    return;
+  uint64_t process_cpu_ns = ClockNs(CLOCK_PROCESS_CPUTIME_ID);
+  uint64_t cpu_ns = process_cpu_ns - g_last_process_cpu_ns;
+  if (cpu_ns < kMinOverheadMeasurementNs)
+    return;
+  uint64_t overhead_ns = g_overhead_ns.load(std::memory_order_relaxed);
+  double overhead_percent = 100.0 * (overhead_ns - g_last_overhead_ns) / cpu_ns;
+  g_last_process_cpu_ns = process_cpu_ns;
+  g_last_overhead_ns = overhead_ns;
+
+  double change = overhead_percent > 0
+                      ? g_overhead_target_percent / overhead_percent
+                      : kMaxSamplingRateChange;
+  change = std::min(std::max(change, 1 / kMaxSamplingRateChange),
+                    kMaxSamplingRateChange);
+
+  char buf[256];
+  uint64_t interval = g_sampling_interval_bytes;
+  if (interval) {
+    uint64_t new_interval = std::min<double>(
+        std::max<double>(round(interval / change), kMinSamplingIntervalBytes),
+        kMaxSamplingIntervalBytes);
+    if (new_interval == interval)
+      return;
+    g_sampling_interval_bytes = new_interval;
+    if (new_interval > interval) {
+      g_previous_sampling_interval_bytes = interval;
+      g_leak_detector->ForgetAllocs(&ShouldThinAlloc);
+    }
+    g_leak_detector->SetByteSampling(new_interval);
+    snprintf(buf, sizeof(buf),
+             "Overhead %.3f%%, setting sampling interval to %" PRIu64
+             " bytes\n", overhead_percent, new_interval);
+  } else {
+    int factor = g_sampling_factor;
+    int new_factor = std::min<long>(
+        std::max<long>(lround(factor * change), kMinSamplingFactor),
+        kMaxSamplingFactor);
+    if (new_factor == factor)
+      return;
+    g_sampling_factor = new_factor;
+    if (new_factor < factor)
+      g_leak_detector->ForgetAllocs(&IsUnsampledAlloc);
+    g_leak_detector->SetUniformSampling(new_factor / 256.0);
+    snprintf(buf, sizeof(buf),
+             "Overhead %.3f%%, setting sampling factor to %d\n",
+             overhead_percent, new_factor);
+  }
+  RAW_LOG(ERROR, buf);
+}
+
+// Dump allocation stats and check for leaks after |g_dump_interval_bytes| bytes
+// have been allocated since the last time that was done. Should be called with
+// a lock since it modifies the global variable |g_last_alloc_dump_size|.
+inline void MaybeDumpStatsAndCheckForLeaks() {
+  if (g_total_alloc_size > g_last_alloc_dump_size + g_dump_interval_bytes) {
+    g_last_alloc_dump_size = g_total_alloc_size;
+    if (g_analyze_in_background) {
+      // The sampling rate is adjusted by the analysis thread, as it may walk
+      // all recorded allocs.
+      RequestAnalysis();
+      return;
+    }
+
+    g_num_analysis_changes.fetch_add(1, std::memory_order_relaxed);
+    MaybeAdjustSamplingRate();
+    RefreshSampledAddressFilter();
+    InternalVector<InternalLeakReport> reports;
+    g_leak_detector->TestForLeaks(true /* do_logging */, &reports);
+  }
 }
 
 // Allocation/deallocation hooks for MallocHook.
@@ -133,32 +507,192 @@ void NewHook(const void* ptr, size_t size) {
     g_total_alloc_size += size;
   }
 
-  if (!ShouldSample(ptr) || !ptr || !g_leak_detector)
+  if (!ShouldSampleAlloc(ptr, size) || !ptr || !g_leak_detector)
     return;
 
+  ScopedOverheadTimer timer;
+
   // Take the stack trace outside the critical section.
-  // |g_leak_detector->ShouldGetStackTraceForSize()| is const; there is no need
-  // for a lock.
+  // |g_leak_detector->GetStackDepthForSize()| is const; there is no need for a
+  // lock.
   void* stack[g_stack_depth];
-  int depth = 0;
-  if (g_leak_detector->ShouldGetStackTraceForSize(size)) {
+  int depth =
+      std::min(g_stack_depth, g_leak_detector->GetStackDepthForSize(size));
+  uint32_t stack_hash = 0;
+  if (depth) {
     depth = MallocHook::GetCallerStackTrace(
-        stack, g_stack_depth, kStripFrames + 1);
+        stack, depth, kStripFrames + 1, &stack_hash);
   }
 
   ScopedSpinLockHolder lock(g_heap_lock);
-  g_leak_detector->RecordAlloc(ptr, size, depth, stack);
+  // The sampling factor may have been lowered since |ptr| was sampled, in
+  // which case its free would not be sampled.
+  if (!g_sampling_interval_bytes && !ShouldSample(ptr))
+    return;
+  g_leak_detector->RecordAlloc(ptr, size, depth, stack, stack_hash);
+  if (g_sampled_addresses)
+    g_sampled_addresses->Add(ptr);
   MaybeDumpStatsAndCheckForLeaks();
 }
 
 void DeleteHook(const void* ptr) {
-  if (!ShouldSample(ptr) || !ptr || !g_leak_detector)
+  if (!ShouldSampleFree(ptr) || !ptr || !g_leak_detector)
     return;
 
+  ScopedOverheadTimer timer;
   ScopedSpinLockHolder lock(g_heap_lock);
   g_leak_detector->RecordFree(ptr);
 }
 
+// Hands the contents of |buffer| to the leak detector under a single
+// acquisition of the heap lock.
+void DrainThreadEventBuffer(ThreadEventBuffer* buffer) {
+  ScopedOverheadTimer timer;
+  ScopedSpinLockHolder lock(g_heap_lock);
+  g_total_alloc_size += buffer->alloc_size;
+  buffer->alloc_size = 0;
+  if (g_overhead_target_percent && !g_sampling_interval_bytes) {
+    // Drop the events of addresses that are no longer sampled since the
+    // sampling factor was lowered. Their allocs have been forgotten, or will
+    // not be recorded.
+    size_t num_events = 0;
+    for (size_t i = 0; i < buffer->num_events; ++i) {
+      if (ShouldSample(buffer->events[i].ptr))
+        buffer->events[num_events++] = buffer->events[i];
+    }
+    buffer->num_events = num_events;
+  }
+  if (g_leak_detector) {
+    g_leak_detector->RecordEvents(buffer->events, buffer->num_events,
+                                  buffer->source);
+    MaybeDumpStatsAndCheckForLeaks();
+  }
+  buffer->num_events = 0;
+}
+
+void DrainThreadEventBufferOnExit(void* arg) {
+  ThreadEventBuffer* buffer = static_cast<ThreadEventBuffer*>(arg);
+  DrainThreadEventBuffer(buffer);
+  ScopedSpinLockHolder lock(g_heap_lock);
+  if (g_leak_detector && buffer->source)
+    g_leak_detector->RemoveEventSource(buffer->source);
+  buffer->source = 0;
+}
+
+ThreadEventBuffer* RegisterThreadEventBuffer(ThreadEventBuffer* buffer) {
+  // Set first, as pthread_setspecific() may allocate.
+  buffer->registered = true;
+  {
+    ScopedSpinLockHolder lock(g_heap_lock);
+    if (g_leak_detector)
+      buffer->source = g_leak_detector->AddEventSource();
+  }
+  pthread_setspecific(g_thread_buffer_key, buffer);
+  return buffer;
+}
+
+inline ThreadEventBuffer* GetThreadEventBuffer() {
+  ThreadEventBuffer* buffer = &t_event_buffer;
+  if (!buffer->registered)
+    return RegisterThreadEventBuffer(buffer);
+  return buffer;
+}
+
+// Adds a sampled event to |buffer| and returns it, for the caller to fill in.
+inline LeakDetectorImpl::Event* AddBufferedEvent(ThreadEventBuffer* buffer) {
+  return &buffer->events[buffer->num_events++];
+}
+
+inline void MaybeDrainThreadEventBuffer(ThreadEventBuffer* buffer) {
+  if (buffer->num_events == kThreadEventBufferSize ||
+      buffer->alloc_size >=
+          g_dump_interval_bytes / kThreadFlushesPerDumpInterval) {
+    DrainThreadEventBuffer(buffer);
+  }
+}
+
+// Allocation/deallocation hooks used instead of NewHook() and DeleteHook() when
+// |g_use_thread_buffers| is set. A thread's own events stay in order in its
+// buffer, and out-of-order events from different threads are reconciled by
+// LeakDetectorImpl::RecordEvents(), with each buffer as its own event source.
+void BufferedNewHook(const void* ptr, size_t size) {
+  ThreadEventBuffer* buffer = GetThreadEventBuffer();
+  buffer->alloc_size += size;
+
+  if (ShouldSampleAlloc(ptr, size) && ptr && g_leak_detector) {
+    if (g_sampled_addresses)
+      g_sampled_addresses->Add(ptr);
+
+    void** stack = buffer->stacks[buffer->num_events];
+    LeakDetectorImpl::Event* event = AddBufferedEvent(buffer);
+    event->type = LeakDetectorImpl::Event::kAlloc;
+    event->ptr = ptr;
+    event->size = size;
+    int depth = std::min({g_stack_depth, kMaxBufferedStackDepth,
+                          g_leak_detector->GetStackDepthForSize(size)});
+    event->stack_depth = 0;
+    if (depth) {
+      event->stack_depth = MallocHook::GetCallerStackTrace(
+          stack, depth, kStripFrames + 1, &event->call_stack_hash);
+      event->call_stack = stack;
+    }
+  }
+
+  MaybeDrainThreadEventBuffer(buffer);
+}
+
+void BufferedDeleteHook(const void* ptr) {
+  if (!ShouldSampleFree(ptr) || !ptr || !g_leak_detector)
+    return;
+
+  ThreadEventBuffer* buffer = GetThreadEventBuffer();
+  LeakDetectorImpl::Event* event = AddBufferedEvent(buffer);
+  event->type = LeakDetectorImpl::Event::kFree;
+  event->ptr = ptr;
+  MaybeDrainThreadEventBuffer(buffer);
+}
+
+// Runs leak analyses as requested by RequestAnalysis(). The heap lock is only
+// held to adjust the sampling rate and copy the counters at the start, and to
+// add any new stack tables at the end.
+void* AnalysisThreadMain(void* /* arg */) {
+  // Kept across analyses, so that they reuse the memory of earlier ones.
+  LeakDetectorImpl::AnalysisSnapshot snapshot;
+  InternalVector<InternalLeakReport> reports;
+
+  while (true) {
+    int state = g_analysis_state.load(std::memory_order_acquire);
+    if (state == kAnalysisStopping)
+      break;
+    if (state == kAnalysisIdle) {
+      syscall(SYS_futex, reinterpret_cast<int*>(&g_analysis_state),
+              FUTEX_WAIT_PRIVATE, kAnalysisIdle, nullptr, nullptr, 0);
+      continue;
+    }
+    // Go back to idle before starting, so that a request made during this
+    // analysis leads to another one.
+    if (!g_analysis_state.compare_exchange_strong(state, kAnalysisIdle))
+      continue;
+
+    ScopedOverheadTimer timer;
+    {
+      ScopedSpinLockHolder lock(g_heap_lock);
+      MaybeAdjustSamplingRate();
+      g_num_analysis_changes.fetch_add(1, std::memory_order_relaxed);
+      RefreshSampledAddressFilter();
+      g_leak_detector->TakeAnalysisSnapshot(&snapshot);
+    }
+    g_leak_detector->AnalyzeSnapshot(&snapshot, true /* do_logging */,
+                                     &reports);
+    {
+      ScopedSpinLockHolder lock(g_heap_lock);
+      g_leak_detector->AddSuspectedStackTables(snapshot);
+      g_num_analysis_changes.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  return nullptr;
+}
+
 // Callback for dl_iterate_phdr() to find the Chrome binary mapping.
 int IterateLoadedObjects(struct dl_phdr_info *shared_object,
                          size_t /* size */,
@@ -197,11 +731,143 @@ int IterateLoadedObjects(struct dl_phdr_info *shared_object,
     return 0;
 }
 
+// Events of a batch passed to RecordEvents() that were sampled, in order.
+struct SampledEventBatch {
+  LeakDetectorImpl::Event events[kMaxSampledEventBatchSize];
+
+  // Index of each event in the batch.
+  size_t batch_indices[kMaxSampledEventBatchSize];
+
+  size_t num_events;
+};
+
+// Sets the call stack of |*sampled_event| to as much of that of |event|, an
+// alloc, as |g_leak_detector| asks for. Does not need the lock, but may need to
+// be done again once the lock is taken if the depth asked for has changed by
+// then.
+void SetSampledCallStack(const HeapEvent& event,
+                         LeakDetectorImpl::Event* sampled_event) {
+  int depth = std::min({event.stack_depth, g_stack_depth,
+                        g_leak_detector->GetStackDepthForSize(event.size)});
+  sampled_event->stack_depth = depth;
+  if (!depth)
+    return;
+  sampled_event->call_stack = event.stack;
+  // The given hash only applies if the whole stack is used.
+  sampled_event->call_stack_hash =
+      event.stack_hash && depth == event.stack_depth
+      ? *event.stack_hash
+      : base::Hash(event.stack, sizeof(*event.stack) * depth);
+}
+
+// Brings the events of |sampled| from |first| on up to date with changes made
+// since they were sampled, e.g. by a leak analysis. Drops those that are no
+// longer sampled since the sampling factor was lowered, as
+// DrainThreadEventBuffer() does, and captures the call stacks of allocs again
+// if their size needs a different depth. Must be called with the lock held.
+void RefreshSampledEvents(const HeapEvent* events,
+                          size_t first,
+                          SampledEventBatch* sampled) {
+  bool may_be_unsampled =
+      g_overhead_target_percent && !g_sampling_interval_bytes;
+  size_t num_events = first;
+  for (size_t i = first; i < sampled->num_events; ++i) {
+    LeakDetectorImpl::Event* sampled_event = &sampled->events[i];
+    if (may_be_unsampled && !ShouldSample(sampled_event->ptr))
+      continue;
+    sampled->events[num_events] = *sampled_event;
+    sampled->batch_indices[num_events] = sampled->batch_indices[i];
+    sampled_event = &sampled->events[num_events];
+    if (sampled_event->type == LeakDetectorImpl::Event::kAlloc) {
+      const HeapEvent& event = events[sampled->batch_indices[num_events]];
+      int depth = std::min({event.stack_depth, g_stack_depth,
+                            g_leak_detector->GetStackDepthForSize(event.size)});
+      if (depth != sampled_event->stack_depth)
+        SetSampledCallStack(event, sampled_event);
+    }
+    ++num_events;
+  }
+  sampled->num_events = num_events;
+}
+
+// Records the |num_events| events of a batch passed to RecordEvents(), at most
+// kMaxSampledEventBatchSize. As in the hooks, sampling them and hashing their
+// call stacks are done before taking the lock.
+void RecordEventBatch(const HeapEvent* events, size_t num_events) {
+  uint32_t num_analysis_changes =
+      g_num_analysis_changes.load(std::memory_order_relaxed);
+  SampledEventBatch sampled;
+  sampled.num_events = 0;
+  uint64_t alloc_size = 0;
+  for (size_t i = 0; i < num_events; ++i) {
+    const HeapEvent& event = events[i];
+    if (event.is_alloc)
+      alloc_size += event.size;
+    bool is_sampled = event.is_alloc ? ShouldSampleAlloc(event.ptr, event.size)
+                                     : ShouldSampleFree(event.ptr);
+    if (!is_sampled || !event.ptr)
+      continue;
+    if (event.is_alloc && g_sampled_addresses)
+      g_sampled_addresses->Add(event.ptr);
+
+    size_t index = sampled.num_events++;
+    sampled.batch_indices[index] = i;
+    LeakDetectorImpl::Event* sampled_event = &sampled.events[index];
+    sampled_event->ptr = event.ptr;
+    if (event.is_alloc) {
+      sampled_event->type = LeakDetectorImpl::Event::kAlloc;
+      sampled_event->size = event.size;
+      SetSampledCallStack(event, sampled_event);
+    } else {
+      sampled_event->type = LeakDetectorImpl::Event::kFree;
+    }
+  }
+
+  ScopedSpinLockHolder lock(g_heap_lock);
+  if (g_num_analysis_changes.load(std::memory_order_relaxed) !=
+      num_analysis_changes) {
+    RefreshSampledEvents(events, 0, &sampled);
+  }
+  uint64_t total_alloc_size = g_total_alloc_size;
+  size_t num_recorded = 0;
+  if (total_alloc_size + alloc_size >
+      g_last_alloc_dump_size + g_dump_interval_bytes) {
+    // Leak analysis can change which sizes need call stacks, so everything
+    // sampled up to the alloc that crosses the dump threshold must be recorded
+    // before the analysis runs, and the rest brought up to date after it.
+    uint64_t batch_alloc_size = 0;
+    size_t batch_index = 0;
+    for (size_t i = 0; i < sampled.num_events; ++i) {
+      if (sampled.events[i].type != LeakDetectorImpl::Event::kAlloc)
+        continue;
+      for (; batch_index <= sampled.batch_indices[i]; ++batch_index) {
+        if (events[batch_index].is_alloc)
+          batch_alloc_size += events[batch_index].size;
+      }
+      g_total_alloc_size = total_alloc_size + batch_alloc_size;
+      if (g_total_alloc_size > g_last_alloc_dump_size + g_dump_interval_bytes) {
+        {
+          ScopedOverheadTimer timer;
+          g_leak_detector->RecordEvents(sampled.events + num_recorded,
+                                        i + 1 - num_recorded, 0);
+        }
+        num_recorded = i + 1;
+        MaybeDumpStatsAndCheckForLeaks();
+        RefreshSampledEvents(events, num_recorded, &sampled);
+      }
+    }
+  }
+  g_total_alloc_size = total_alloc_size + alloc_size;
+  ScopedOverheadTimer timer;
+  g_leak_detector->RecordEvents(sampled.events + num_recorded,
+                                sampled.num_events - num_recorded, 0);
+}
+
 }  // namespace
 
 void Initialize() {
   // If the sampling factor is too low, don't bother enabling the leak detector.
-  if (g_sampling_factor < 1) {
+  if (g_sampling_factor < 1 && !g_sampling_interval_bytes) {
     LOG(ERROR) << "Not enabling leak detector because g_sampling_factor="
                << g_sampling_factor;
     return;
@@ -235,40 +901,114 @@ void Initialize() {
   g_heap_lock = new(CustomAllocator::Allocate(sizeof(SpinLockWrapper)))
       SpinLockWrapper;
 
+  // Start the thread before the hooks are set, as creating it may allocate.
+  // It does nothing until the hooks request an analysis.
+  if (g_analyze_in_background) {
+    g_analysis_state = kAnalysisIdle;
+    CHECK(pthread_create(&g_analysis_thread, nullptr, &AnalysisThreadMain,
+                         nullptr) == 0);
+  }
+
   ScopedSpinLockHolder lock(g_heap_lock);
   if (g_leak_detector)
     return;
 
-  LOG(ERROR) << "Starting leak detector. Sampling factor: "
-             << g_sampling_factor;
+  if (g_overhead_target_percent) {
+    LOG(ERROR) << "Adjusting sampling rate to overhead target: "
+               << g_overhead_target_percent << "%";
+    g_last_process_cpu_ns = ClockNs(CLOCK_PROCESS_CPUTIME_ID);
+    g_last_overhead_ns = g_overhead_ns;
+  }
+
+  if (g_sampling_interval_bytes) {
+    LOG(ERROR) << "Starting leak detector. Sampling interval: "
+               << g_sampling_interval_bytes << " bytes";
+  } else {
+    LOG(ERROR) << "Starting leak detector. Sampling factor: "
+               << g_sampling_factor;
+  }
 
   g_leak_detector = new(CustomAllocator::Allocate(sizeof(LeakDetectorImpl)))
       LeakDetectorImpl(chrome_mapping.addr,
                        chrome_mapping.size,
                        g_size_suspicion_threshold,
                        g_call_stack_suspicion_threshold,
-                       g_dump_leak_analysis);
+                       g_dump_leak_analysis,
+                       g_use_compact_address_map
+                           ? LeakDetectorImpl::kCompactAddressMap
+                           : LeakDetectorImpl::kFlatAddressMap);
+  if (g_leak_ranking >= LeakDetectorImpl::kRankByCount &&
+      g_leak_ranking <= LeakDetectorImpl::kRankByCountAndBytes) {
+    g_leak_detector->SetLeakRanking(
+        static_cast<LeakDetectorImpl::LeakRanking>(g_leak_ranking));
+  } else {
+    LOG(ERROR) << "Ignoring invalid leak ranking " << g_leak_ranking;
+  }
+  if (g_use_call_stack_trie)
+    g_leak_detector->SetCallStackStorage(CallStackManager::kTrieStorage);
+  if (g_initial_stack_depth > 0 && g_initial_stack_depth < g_stack_depth)
+    g_leak_detector->SetStackDepth(g_initial_stack_depth, g_stack_depth);
+  if (g_sampling_interval_bytes) {
+    g_leak_detector->SetByteSampling(g_sampling_interval_bytes);
+    g_sampled_addresses =
+        new(CustomAllocator::Allocate(sizeof(SampledAddressFilter)))
+            SampledAddressFilter;
+  } else {
+    g_leak_detector->SetUniformSampling(g_sampling_factor / 256.0);
+  }
 
   // Now set the hooks that capture new/delete and malloc/free. Make sure
   // nothing is already set.
-  CHECK(MallocHook::SetNewHook(&NewHook) == nullptr);
-  CHECK(MallocHook::SetDeleteHook(&DeleteHook) == nullptr);
+  if (g_use_thread_buffers) {
+    CHECK(pthread_key_create(&g_thread_buffer_key,
+                             &DrainThreadEventBufferOnExit) == 0);
+    CHECK(MallocHook::SetNewHook(&BufferedNewHook) == nullptr);
+    CHECK(MallocHook::SetDeleteHook(&BufferedDeleteHook) == nullptr);
+  } else {
+    CHECK(MallocHook::SetNewHook(&NewHook) == nullptr);
+    CHECK(MallocHook::SetDeleteHook(&DeleteHook) == nullptr);
+  }
 }
 
 void Shutdown() {
   if (!IsInitialized())
     return;
 
+  if (g_use_thread_buffers) {
+    // Events still buffered by other threads are dropped.
+    DrainThreadEventBuffer(&t_event_buffer);
+    pthread_key_delete(g_thread_buffer_key);
+  }
+
+  if (g_analyze_in_background) {
+    // A pending analysis is skipped.
+    g_analysis_state = kAnalysisStopping;
+    syscall(SYS_futex, reinterpret_cast<int*>(&g_analysis_state),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    pthread_join(g_analysis_thread, nullptr);
+  }
+
   {
     ScopedSpinLockHolder lock(g_heap_lock);
 
     // Unset our new/delete hooks, checking they were previously set.
-    CHECK_EQ(MallocHook::SetNewHook(nullptr), &NewHook);
-    CHECK_EQ(MallocHook::SetDeleteHook(nullptr), &DeleteHook);
+    if (g_use_thread_buffers) {
+      CHECK_EQ(MallocHook::SetNewHook(nullptr), &BufferedNewHook);
+      CHECK_EQ(MallocHook::SetDeleteHook(nullptr), &BufferedDeleteHook);
+    } else {
+      CHECK_EQ(MallocHook::SetNewHook(nullptr), &NewHook);
+      CHECK_EQ(MallocHook::SetDeleteHook(nullptr), &DeleteHook);
+    }
 
     g_leak_detector->~LeakDetectorImpl();
     CustomAllocator::Free(g_leak_detector, sizeof(LeakDetectorImpl));
     g_leak_detector = nullptr;
+
+    if (g_sampled_addresses) {
+      g_sampled_addresses->~SampledAddressFilter();
+      CustomAllocator::Free(g_sampled_addresses, sizeof(SampledAddressFilter));
+      g_sampled_addresses = nullptr;
+    }
   }
 
   g_heap_lock->~SpinLockWrapper();
@@ -284,4 +1024,23 @@ bool IsInitialized() {
   return g_leak_detector;
 }
 
+bool GetHeapLockStats(SpinLockStats* stats) {
+  if (!IsInitialized())
+    return false;
+  g_heap_lock->GetStats(stats);
+  return true;
+}
+
+void RecordEvents(const HeapEvent* events, size_t num_events) {
+  if (!g_leak_detector)
+    return;
+
+  while (num_events) {
+    size_t batch_size = std::min(num_events, kMaxSampledEventBatchSize);
+    RecordEventBatch(events, batch_size);
+    events += batch_size;
+    num_events -= batch_size;
+  }
+}
+
 }  // namespace leak_detector
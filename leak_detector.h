@@ -5,8 +5,25 @@
 #ifndef COMPONENTS_METRICS_LEAK_DETECTOR_LEAK_DETECTOR_H_
 #define COMPONENTS_METRICS_LEAK_DETECTOR_LEAK_DETECTOR_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+struct SpinLockStats;
+
 namespace leak_detector {
 
+// An alloc or free observed outside of the malloc hooks, e.g. while replaying
+// a trace. |stack_hash| is optional and, if not null, points to the
+// base::Hash() of |stack|.
+struct HeapEvent {
+  bool is_alloc;
+  const void* ptr;
+  size_t size;
+  int stack_depth;
+  const void* const* stack;
+  const uint32_t* stack_hash;
+};
+
 // The top level leak detector is a singleton instance. Implement it as a
 // namespace with init/shutdown functions rather than as a class with static
 // member functions.
@@ -16,6 +33,14 @@ void Shutdown();
 
 bool IsInitialized();
 
+// Gets the contention statistics of the lock that serializes access to the leak
+// detector. Returns false if the leak detector is not initialized.
+bool GetHeapLockStats(SpinLockStats* stats);
+
+// Records |num_events| allocs and frees in order, sampling and accounting for
+// each one as the malloc hooks would, but taking the heap lock only once.
+void RecordEvents(const HeapEvent* events, size_t num_events);
+
 }  // namespace leak_detector
 
 #endif  // COMPONENTS_METRICS_LEAK_DETECTOR_LEAK_DETECTOR_H_
@@ -5,16 +5,21 @@
 #include "leak_detector_impl.h"
 
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <stddef.h>
 #include <unistd.h>  // for getpid()
 
 #include <algorithm>
+#include <initializer_list>
 #include <new>
 #include <utility>
 
 #include "base/hash.h"
 #include "components/metrics/leak_detector/call_stack_table.h"
+#include "components/metrics/leak_detector/count_kernels.h"
 #include "components/metrics/leak_detector/ranked_list.h"
+#include "components/metrics/leak_detector/sampled_address_filter.h"
 
 namespace leak_detector {
 
@@ -23,14 +28,36 @@ namespace {
 // Look for leaks in the the top N entries in each tier, where N is this value.
 const int kRankedListSize = 16;
 
-// Initial hash table size for |LeakDetectorImpl::address_map_|.
-const int kAddressMapNumBuckets = 100003;
-
-// Number of entries in the alloc size table. As sizes are aligned to 32-bits
-// the max supported allocation size is (kNumSizeEntries * 4 - 1). Any larger
-// sizes are ignored. This value is chosen high enough that such large sizes
-// are rare if not nonexistent.
-const int kNumSizeEntries = 2048;
+// When recording events in bulk, prefetch table slots for the event this many
+// positions ahead of the one being recorded.
+const size_t kPrefetchDistance = 8;
+
+// Held back frees whose allocs can no longer be recorded, e.g. because they
+// were made before the leak detector was started, are only looked for once
+// there are this many. Should there be as many that might still be matched,
+// they are all dropped.
+const size_t kMaxOrphanFrees = 4096;
+
+// Initial number of slots of |LeakDetectorImpl::address_map_|. It grows as
+// needed.
+const size_t kAddressMapInitialCapacity = 4096;
+
+// Allocation sizes below 8 KB have an entry in the alloc size table for each 4
+// bytes. Larger sizes share entries in size classes, of which there are
+// 1 << kSizeClassBits for each power of two, up to 4 GB. Sizes of 4 GB and up
+// go in a last class of their own. Allocations that large are rare, but a leak
+// of them is the one that takes down a process, so they get stack tables like
+// any other.
+const int kNumExactSizeEntries = 2048;
+const size_t kMaxExactSize = kNumExactSizeEntries * sizeof(uint32_t);
+const int kSizeClassBits = 3;
+const int kMinSizeClassLog2 = 13;
+const int kMaxSizeClassLog2 = 32;
+
+// Number of entries in the alloc size table, including the one for 4 GB and up.
+const int kNumSizeEntries =
+    kNumExactSizeEntries +
+    ((kMaxSizeClassLog2 - kMinSizeClassLog2) << kSizeClassBits) + 1;
 
 using ValueType = LeakDetectorValueType;
 
@@ -65,16 +92,114 @@ void PrintWithPidOnEachLine(char* str) {
 }
 
 // Functions to convert an allocation size to/from the array index used for
-// |LeakDetectorImpl::size_entries_|.
+// |LeakDetectorImpl::size_num_allocs_| and the like. IndexToSize() returns the
+// smallest size of the size class.
 int SizeToIndex(const size_t size) {
-  int result = static_cast<int>(size / sizeof(uint32_t));
-  if (result < kNumSizeEntries)
-    return result;
-  return 0;
+  if (size < kMaxExactSize)
+    return static_cast<int>(size / sizeof(uint32_t));
+  int log2 = 63 - __builtin_clzll(size);
+  if (log2 >= kMaxSizeClassLog2)
+    return kNumSizeEntries - 1;
+  int size_class = (size >> (log2 - kSizeClassBits)) &
+                   ((1 << kSizeClassBits) - 1);
+  return kNumExactSizeEntries +
+         ((log2 - kMinSizeClassLog2) << kSizeClassBits) + size_class;
 }
 
 size_t IndexToSize(int index){
-  return sizeof(uint32_t) * index;
+  if (index < kNumExactSizeEntries)
+    return sizeof(uint32_t) * index;
+  index -= kNumExactSizeEntries;
+  int log2 = kMinSizeClassLog2 + (index >> kSizeClassBits);
+  size_t significand =
+      (1 << kSizeClassBits) + (index & ((1 << kSizeClassBits) - 1));
+  return significand << (log2 - kSizeClassBits);
+}
+
+// Returns the largest size of the size class with |index|.
+size_t IndexToMaxSize(int index) {
+  if (index == kNumSizeEntries - 1)
+    return SIZE_MAX;
+  return IndexToSize(index + 1) - 1;
+}
+
+// Writes the sizes of the size class with |index| to |buffer|: just the size
+// for the exact sizes below 8 KB, and the range for the larger classes.
+void SizeClassToString(int index, size_t buffer_size, char* buffer) {
+  if (index < kNumExactSizeEntries) {
+    snprintf(buffer, buffer_size, "%zu", IndexToSize(index));
+  } else if (index == kNumSizeEntries - 1) {
+    snprintf(buffer, buffer_size, "%zu+", IndexToSize(index));
+  } else {
+    snprintf(buffer, buffer_size, "%zu-%zu", IndexToSize(index),
+             IndexToMaxSize(index));
+  }
+}
+
+// Returns the number of allocs that each recorded alloc stands for, for the
+// size with the given index in |LeakDetectorImpl::size_num_allocs_|. See
+// LeakDetectorImpl::SetUniformSampling().
+double GetSampleWeight(const LeakDetectorImpl::AnalysisSnapshot& snapshot,
+                       int size_index) {
+  if (!snapshot.sampling_interval_bytes)
+    return 1 / snapshot.sampling_probability;
+  // Weigh the allocs of a size class as the smallest of them, and those of
+  // fewer than 4 bytes as if they had 1.
+  size_t size = std::max<size_t>(IndexToSize(size_index), 1);
+  return 1 / -expm1(-static_cast<double>(size) /
+                     snapshot.sampling_interval_bytes);
+}
+
+// Returns the net number of KB taken by |net_num_allocs| allocs of the size
+// class with |index|, counting each as the smallest size of the class. The
+// result is a count for a RankedList, so it saturates at the limits of int.
+int NetKilobytes(uint32_t net_num_allocs, int index) {
+  // Net counts below zero wrap around, as frees of allocs that were never
+  // recorded are counted too.
+  int64_t bytes = static_cast<int64_t>(static_cast<int32_t>(net_num_allocs)) *
+                  static_cast<int64_t>(IndexToSize(index));
+  int64_t kilobytes = bytes / 1024;
+  return std::max<int64_t>(std::min<int64_t>(kilobytes, INT_MAX), INT_MIN);
+}
+
+// Scales a sampled count by |weight|, saturating at the max count.
+inline uint32_t ScaleCount(uint32_t count, double weight) {
+  return std::min<double>(round(count * weight), UINT32_MAX);
+}
+
+// Scales the counts in |snapshot| up to estimates for all allocs, so that
+// counts taken under different sampling rates remain comparable, and sizes
+// that byte sampling favors are not ranked above more numerous smaller ones.
+void ScaleSnapshotCounts(LeakDetectorImpl::AnalysisSnapshot* snapshot) {
+  if (!snapshot->sampling_interval_bytes && snapshot->sampling_probability == 1)
+    return;
+  for (size_t i = 0; i < snapshot->net_num_allocs.size(); ++i) {
+    // Most sizes have no live allocs, and would stay at 0 anyway.
+    if (!snapshot->net_num_allocs[i])
+      continue;
+    double weight = GetSampleWeight(*snapshot, snapshot->changed_sizes[i]);
+    snapshot->net_num_allocs[i] =
+        ScaleCount(snapshot->net_num_allocs[i], weight);
+  }
+  for (auto& stack_table : snapshot->stack_tables) {
+    double weight = GetSampleWeight(*snapshot, stack_table.size_index);
+    for (uint32_t& count : stack_table.counts.net_num_allocs)
+      count = ScaleCount(count, weight);
+  }
+}
+
+// Adds the counts in |tree| of the sizes that make it into a ranked list to
+// one, in rank order, which makes for the same list as adding all of them. The
+// list is added to |leak_analyzer| as a sample.
+void AddSizeSample(const RankedCountTree& tree, LeakAnalyzer* leak_analyzer) {
+  int top_indices[kRankedListSize];
+  size_t num_top = tree.GetTopCounts(kRankedListSize, top_indices);
+  RankedList ranked_list(kRankedListSize);
+  for (size_t i = 0; i < num_top; ++i) {
+    int index = top_indices[i];
+    ranked_list.Add(ValueType(IndexToSize(index)), tree.count(index));
+  }
+  leak_analyzer->AddSample(std::move(ranked_list));
 }
 
 }  // namespace
@@ -95,115 +220,507 @@ LeakDetectorImpl::LeakDetectorImpl(uintptr_t mapping_addr,
                                    size_t mapping_size,
                                    int size_suspicion_threshold,
                                    int call_stack_suspicion_threshold,
-                                   bool verbose)
-    : num_stack_tables_(0),
-      address_map_(kAddressMapNumBuckets),
+                                   bool verbose,
+                                   AddressMapType address_map_type)
+    : num_allocs_(0),
+      num_frees_(0),
+      alloc_size_(0),
+      free_size_(0),
+      num_allocs_with_call_stack_(0),
+      num_stack_tables_(0),
+      address_map_(nullptr),
+      compact_address_map_(nullptr),
+      num_source_calls_(0),
       size_leak_analyzer_(kRankedListSize, size_suspicion_threshold),
-      size_entries_(kNumSizeEntries, {0}),
+      size_bytes_leak_analyzer_(kRankedListSize, size_suspicion_threshold),
+      leak_ranking_(kRankByCount),
+      size_num_allocs_(kNumSizeEntries, 0),
+      size_num_frees_(kNumSizeEntries, 0),
+      size_stack_tables_(kNumSizeEntries, nullptr),
+      size_stack_depths_(kNumSizeEntries, 0),
+      size_changed_bits_((kNumSizeEntries + 63) / 64, 0),
+      snapshot_sampling_probability_(1),
+      snapshot_sampling_interval_bytes_(0),
+      size_count_tree_(kNumSizeEntries),
+      size_kilobytes_tree_(kNumSizeEntries),
       mapping_addr_(mapping_addr),
       mapping_size_(mapping_size),
       call_stack_suspicion_threshold_(call_stack_suspicion_threshold),
-      verbose_(verbose) {
+      initial_stack_depth_(INT_MAX),
+      max_stack_depth_(INT_MAX),
+      verbose_(verbose),
+      sampling_probability_(1),
+      sampling_interval_bytes_(0) {
+  switch (address_map_type) {
+    case kFlatAddressMap:
+      address_map_ = new(CustomAllocator::Allocate(sizeof(AddressMap)))
+          AddressMap(kAddressMapInitialCapacity);
+      break;
+    case kCompactAddressMap:
+      compact_address_map_ =
+          new(CustomAllocator::Allocate(sizeof(CompactAddressMap)))
+              CompactAddressMap;
+      break;
+  }
 }
 
 LeakDetectorImpl::~LeakDetectorImpl() {
+  if (address_map_) {
+    address_map_->~AddressMap();
+    CustomAllocator::Free(address_map_, sizeof(AddressMap));
+  }
+  if (compact_address_map_) {
+    compact_address_map_->~CompactAddressMap();
+    CustomAllocator::Free(compact_address_map_, sizeof(CompactAddressMap));
+  }
+
   // Free any call stack tables.
-  for (AllocSizeEntry& entry : size_entries_) {
-    CallStackTable* table = entry.stack_table;
+  for (CallStackTable* table : size_stack_tables_) {
     if (!table)
       continue;
     table->~CallStackTable();
     CustomAllocator::Free(table, sizeof(CallStackTable));
   }
-  size_entries_.clear();
+  size_stack_tables_.clear();
 }
 
-bool LeakDetectorImpl::ShouldGetStackTraceForSize(size_t size) const {
-  return size_entries_[SizeToIndex(size)].stack_table != nullptr;
+int LeakDetectorImpl::GetStackDepthForSize(size_t size) const {
+  return size_stack_depths_[SizeToIndex(size)];
 }
 
 void LeakDetectorImpl::RecordAlloc(
     const void* ptr, size_t size,
     int stack_depth, const void* const stack[]) {
+  RecordAllocWithHash(ptr, size, stack_depth, stack, nullptr);
+}
+
+void LeakDetectorImpl::RecordAlloc(
+    const void* ptr, size_t size,
+    int stack_depth, const void* const stack[], uint32_t stack_hash) {
+  RecordAllocWithHash(ptr, size, stack_depth, stack, &stack_hash);
+}
+
+void LeakDetectorImpl::RecordAllocWithHash(
+    const void* ptr, size_t size,
+    int stack_depth, const void* const stack[], const uint32_t* stack_hash) {
   AllocInfo alloc_info;
   alloc_info.size = size;
 
   alloc_size_ += alloc_info.size;
   ++num_allocs_;
 
-  AllocSizeEntry* entry = &size_entries_[SizeToIndex(size)];
-  ++entry->num_allocs;
+  int index = SizeToIndex(size);
+  ++size_num_allocs_[index];
+  MarkSizeChanged(index);
 
-  if (entry->stack_table && stack_depth > 0) {
-    alloc_info.call_stack =
-        call_stack_manager_.GetCallStack(stack_depth, stack);
-    entry->stack_table->Add(alloc_info.call_stack);
+  CallStackTable* stack_table = size_stack_tables_[index];
+  if (stack_table && stack_depth > 0) {
+    const CallStack* call_stack = stack_hash
+        ? call_stack_manager_.GetCallStack(stack_depth, stack, *stack_hash)
+        : call_stack_manager_.GetCallStack(stack_depth, stack);
+    if (call_stack) {
+      alloc_info.call_stack_id = call_stack->id;
+      stack_table->Add(call_stack->id);
 
-    ++num_allocs_with_call_stack_;
+      ++num_allocs_with_call_stack_;
+    }
   }
 
-  uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  address_map_.insert(std::pair<uintptr_t, AllocInfo>(addr, alloc_info));
+  // An address that is already recorded keeps its existing info. The call
+  // stack keeps the reference added for the new info all the same, as the
+  // stack table keeps counting the alloc.
+  if (compact_address_map_) {
+    compact_address_map_->Insert(
+        ptr, size,
+        alloc_info.call_stack_id ? &alloc_info.call_stack_id : nullptr);
+    return;
+  }
+  bool inserted;
+  AllocInfo* info =
+      address_map_->Insert(reinterpret_cast<uintptr_t>(ptr), &inserted);
+  if (inserted)
+    *info = alloc_info;
 }
 
 void LeakDetectorImpl::RecordFree(const void* ptr) {
+  RecordFreeOfRecordedAlloc(ptr);
+}
+
+bool LeakDetectorImpl::RecordFreeOfRecordedAlloc(const void* ptr) {
+  if (compact_address_map_) {
+    CompactAddressMap::Entry entry;
+    if (!compact_address_map_->FindAndRemove(ptr, &entry))
+      return false;
+    AccountForFree(entry);
+    return true;
+  }
+
   // Look up address.
-  uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  auto iter = address_map_.find(addr);
-  if (iter == address_map_.end())
-    return;
+  AllocInfo* alloc_info =
+      address_map_->Find(reinterpret_cast<uintptr_t>(ptr));
+  if (!alloc_info)
+    return false;
+
+  AccountForFree(*alloc_info);
+  address_map_->Erase(alloc_info);
+  return true;
+}
 
-  const AllocInfo& alloc_info = iter->second;
+void LeakDetectorImpl::AccountForFree(const AllocInfo& alloc_info) {
+  CallStackTable* stack_table = AccountForFreeOfSize(alloc_info.size);
+  if (alloc_info.call_stack_id && stack_table) {
+    stack_table->Remove(alloc_info.call_stack_id);
+    call_stack_manager_.ReleaseCallStack(alloc_info.call_stack_id);
+  }
+}
 
-  AllocSizeEntry* entry = &size_entries_[SizeToIndex(alloc_info.size)];
-  ++entry->num_frees;
+void LeakDetectorImpl::AccountForFree(const CompactAddressMap::Entry& entry) {
+  CallStackTable* stack_table = AccountForFreeOfSize(entry.size());
+  if (entry.has_call_stack && stack_table) {
+    stack_table->Remove(entry.call_stack_id);
+    call_stack_manager_.ReleaseCallStack(entry.call_stack_id);
+  }
+}
 
-  const CallStack* call_stack = alloc_info.call_stack;
-  if (call_stack) {
-    if (entry->stack_table)
-      entry->stack_table->Remove(call_stack);
+CallStackTable* LeakDetectorImpl::AccountForFreeOfSize(size_t size) {
+  int index = SizeToIndex(size);
+  ++size_num_frees_[index];
+  MarkSizeChanged(index);
+  ++num_frees_;
+  free_size_ += size;
+  return size_stack_tables_[index];
+}
+
+void LeakDetectorImpl::RecordEvents(const Event* events,
+                                    size_t num_events,
+                                    uint32_t source) {
+  uint64_t call = 0;
+  uint64_t last_call = 0;
+  if (source) {
+    call = ++num_source_calls_;
+    EventSource* event_source = &event_sources_[source - 1];
+    last_call = event_source->last_call;
+    event_source->last_call = call;
+  }
+
+  for (size_t i = 0; i < num_events; ++i) {
+    if (i + kPrefetchDistance < num_events) {
+      const Event& upcoming = events[i + kPrefetchDistance];
+      if (address_map_)
+        address_map_->Prefetch(reinterpret_cast<uintptr_t>(upcoming.ptr));
+      if (upcoming.type == Event::kAlloc)
+        __builtin_prefetch(&size_num_allocs_[SizeToIndex(upcoming.size)], 1);
+    }
+
+    const Event& event = events[i];
+    if (event.type == Event::kAlloc) {
+      if (source && MatchOrphanFree(event.ptr, event.size, last_call, call))
+        continue;
+      RecordAllocWithHash(
+          event.ptr, event.size, event.stack_depth, event.call_stack,
+          event.call_stack_hash ? &event.call_stack_hash : nullptr);
+    } else if (!RecordFreeOfRecordedAlloc(event.ptr) && source) {
+      AddOrphanFree(event.ptr, source, call);
+    }
   }
+}
+
+uint32_t LeakDetectorImpl::AddEventSource() {
+  size_t index = 0;
+  while (index < event_sources_.size() && event_sources_[index].in_use)
+    ++index;
+  if (index == event_sources_.size())
+    event_sources_.push_back(EventSource());
+  event_sources_[index].in_use = true;
+  event_sources_[index].last_call = num_source_calls_;
+  return index + 1;
+}
+
+void LeakDetectorImpl::RemoveEventSource(uint32_t source) {
+  event_sources_[source - 1].in_use = false;
+}
+
+bool LeakDetectorImpl::MatchOrphanFree(const void* ptr,
+                                       size_t size,
+                                       uint64_t last_call,
+                                       uint64_t call) {
+  if (orphan_frees_.empty())
+    return false;
+
+  auto iter = orphan_frees_.find(reinterpret_cast<uintptr_t>(ptr));
+  // A free held back by this same call happened before the alloc, and so
+  // belongs to an earlier alloc of the address. So does one held back before
+  // the last call of this source, which would have recorded the alloc then.
+  // This also keeps a source's own frees from matching its later allocs.
+  if (iter == orphan_frees_.end() || iter->second.call <= last_call ||
+      iter->second.call >= call) {
+    return false;
+  }
+  orphan_frees_.erase(iter);
+
+  // Account for the alloc and its free as if they had been recorded in order.
+  // They would cancel out in the stack tables and the net count of the size,
+  // so those are left alone.
+  alloc_size_ += size;
+  free_size_ += size;
+  ++num_allocs_;
   ++num_frees_;
-  free_size_ += alloc_info.size;
 
-  address_map_.erase(iter);
+  int index = SizeToIndex(size);
+  ++size_num_allocs_[index];
+  ++size_num_frees_[index];
+  return true;
+}
+
+void LeakDetectorImpl::AddOrphanFree(const void* ptr,
+                                     uint32_t source,
+                                     uint64_t call) {
+  if (orphan_frees_.size() >= kMaxOrphanFrees) {
+    ExpireOrphanFrees();
+    if (orphan_frees_.size() >= kMaxOrphanFrees)
+      orphan_frees_.clear();
+  }
+
+  // Only one free per address can be pending. Should the address be freed
+  // again before its allocs are recorded, keep the latest free; at worst, one
+  // of the allocs is then left looking live.
+  OrphanFree* orphan_free = &orphan_frees_[reinterpret_cast<uintptr_t>(ptr)];
+  orphan_free->source = source;
+  orphan_free->call = call;
+}
+
+void LeakDetectorImpl::ExpireOrphanFrees() {
+  // A free from source S can only be matched while some other source has not
+  // been called since. Of the sources in use, find the two that were called
+  // the longest ago, so that the one to compare with is known for every S.
+  uint32_t oldest_source = 0;
+  uint64_t oldest_call = UINT64_MAX;
+  uint64_t second_oldest_call = UINT64_MAX;
+  for (size_t i = 0; i < event_sources_.size(); ++i) {
+    const EventSource& event_source = event_sources_[i];
+    if (!event_source.in_use)
+      continue;
+    if (event_source.last_call < oldest_call) {
+      second_oldest_call = oldest_call;
+      oldest_call = event_source.last_call;
+      oldest_source = i + 1;
+    } else if (event_source.last_call < second_oldest_call) {
+      second_oldest_call = event_source.last_call;
+    }
+  }
+
+  for (auto iter = orphan_frees_.begin(); iter != orphan_frees_.end();) {
+    uint64_t other_call = iter->second.source == oldest_source
+                              ? second_oldest_call
+                              : oldest_call;
+    if (iter->second.call < other_call)
+      iter = orphan_frees_.erase(iter);
+    else
+      ++iter;
+  }
+}
+
+void LeakDetectorImpl::SetUniformSampling(double probability) {
+  sampling_probability_ = probability;
+  sampling_interval_bytes_ = 0;
+}
+
+void LeakDetectorImpl::SetByteSampling(uint64_t mean_interval_bytes) {
+  sampling_interval_bytes_ = mean_interval_bytes;
+}
+
+void LeakDetectorImpl::SetLeakRanking(LeakRanking leak_ranking) {
+  leak_ranking_ = leak_ranking;
+}
+
+void LeakDetectorImpl::SetCallStackStorage(
+    CallStackManager::StorageType storage_type) {
+  call_stack_manager_.SetStorageType(storage_type);
+}
+
+void LeakDetectorImpl::SetStackDepth(int initial_depth, int max_depth) {
+  initial_stack_depth_ = initial_depth;
+  max_stack_depth_ = std::max(initial_depth, max_depth);
+}
+
+void LeakDetectorImpl::ForgetAllocs(
+    bool (*should_forget)(const void* ptr, size_t size)) {
+  if (compact_address_map_) {
+    compact_address_map_->EraseIf(
+        [this, should_forget](const void* ptr,
+                              const CompactAddressMap::Entry& entry) {
+          if (!should_forget(ptr, entry.size()))
+            return false;
+          AccountForFree(entry);
+          return true;
+        });
+    return;
+  }
+  address_map_->EraseIf([this, should_forget](uintptr_t addr,
+                                              const AllocInfo& alloc_info) {
+    if (!should_forget(reinterpret_cast<const void*>(addr), alloc_info.size))
+      return false;
+    AccountForFree(alloc_info);
+    return true;
+  });
+}
+
+void LeakDetectorImpl::AddLiveAddressesToFilter(
+    SampledAddressFilter* filter) const {
+  if (compact_address_map_) {
+    compact_address_map_->ForEach(
+        [filter](const void* ptr, const CompactAddressMap::Entry& /* entry */) {
+          filter->AddToNewGeneration(ptr);
+        });
+    return;
+  }
+  address_map_->ForEach([filter](uintptr_t addr, const AllocInfo& /* info */) {
+    filter->AddToNewGeneration(reinterpret_cast<const void*>(addr));
+  });
 }
 
 void LeakDetectorImpl::TestForLeaks(
     bool do_logging,
     InternalVector<InternalLeakReport>* reports) {
+  AnalysisSnapshot snapshot;
+  TakeAnalysisSnapshot(&snapshot);
+  AnalyzeSnapshot(&snapshot, do_logging, reports);
+  AddSuspectedStackTables(snapshot);
+}
+
+void LeakDetectorImpl::TakeAnalysisSnapshot(AnalysisSnapshot* snapshot) {
+  // The previous check is done with its snapshot, so the call stacks that had
+  // no references when it was taken, and still have none, are not referred to
+  // anywhere anymore.
+  call_stack_manager_.ReclaimUnreferenced();
+
+  snapshot->num_allocs = num_allocs_;
+  snapshot->alloc_size = alloc_size_;
+  snapshot->free_size = free_size_;
+  snapshot->num_allocs_with_call_stack = num_allocs_with_call_stack_;
+  snapshot->num_stack_tables = num_stack_tables_;
+  snapshot->num_call_stacks = call_stack_manager_.size();
+  snapshot->call_stacks_size = call_stack_manager_.memory_size();
+  if (compact_address_map_) {
+    snapshot->num_live_allocs = compact_address_map_->size();
+    snapshot->address_map_size = compact_address_map_->stats().heap_size;
+  } else {
+    snapshot->num_live_allocs = address_map_->size();
+    snapshot->address_map_size = address_map_->memory_size();
+  }
+  snapshot->sampling_probability = sampling_probability_;
+  snapshot->sampling_interval_bytes = sampling_interval_bytes_;
+
+  // Counts scale differently under different sampling, so all of them change
+  // with it.
+  bool sampling_changed =
+      sampling_probability_ != snapshot_sampling_probability_ ||
+      sampling_interval_bytes_ != snapshot_sampling_interval_bytes_;
+  snapshot_sampling_probability_ = sampling_probability_;
+  snapshot_sampling_interval_bytes_ = sampling_interval_bytes_;
+
+  snapshot->changed_sizes.clear();
+  if (sampling_changed) {
+    snapshot->net_num_allocs.resize(size_num_allocs_.size());
+    ComputeNetCounts(size_num_allocs_.data(), size_num_frees_.data(),
+                     size_num_allocs_.size(), snapshot->net_num_allocs.data());
+    for (size_t i = 0; i < size_num_allocs_.size(); ++i)
+      snapshot->changed_sizes.push_back(i);
+    std::fill(size_changed_bits_.begin(), size_changed_bits_.end(), 0);
+  } else {
+    snapshot->net_num_allocs.clear();
+    for (size_t word = 0; word < size_changed_bits_.size(); ++word) {
+      for (uint64_t bits = size_changed_bits_[word]; bits; bits &= bits - 1) {
+        int index = word * 64 + __builtin_ctzll(bits);
+        snapshot->changed_sizes.push_back(index);
+        snapshot->net_num_allocs.push_back(size_num_allocs_[index] -
+                                           size_num_frees_[index]);
+      }
+      size_changed_bits_[word] = 0;
+    }
+  }
+
+  // Reuses the buffers of earlier snapshots.
+  snapshot->stack_tables.resize(stack_table_sizes_.size());
+  for (size_t i = 0; i < stack_table_sizes_.size(); ++i) {
+    AnalysisSnapshot::StackTable* stack_table = &snapshot->stack_tables[i];
+    stack_table->size_index = stack_table_sizes_[i];
+    stack_table->table = size_stack_tables_[stack_table->size_index];
+    if (sampling_changed)
+      stack_table->table->TakeSnapshot(&stack_table->counts);
+    else
+      stack_table->table->TakeSnapshotOfChanges(&stack_table->counts);
+  }
+}
+
+void LeakDetectorImpl::AnalyzeSnapshot(
+    AnalysisSnapshot* snapshot,
+    bool do_logging,
+    InternalVector<InternalLeakReport>* reports) {
   if (do_logging)
-    DumpStats();
-
-  // Add net alloc counts for each size to a ranked list.
-  RankedList size_ranked_list(kRankedListSize);
-  for (size_t i = 0; i < size_entries_.size(); ++i) {
-    const AllocSizeEntry& entry = size_entries_[i];
-    ValueType size_value(IndexToSize(i));
-    size_ranked_list.Add(size_value, entry.num_allocs - entry.num_frees);
+    DumpStats(*snapshot);
+
+  // All counts below are estimates for all allocs, not just sampled ones.
+  ScaleSnapshotCounts(snapshot);
+
+  // Update the net alloc counts of the sizes that changed, and the bytes they
+  // take. A RankedList takes counts as int, so net counts below zero wrap
+  // around the same way here.
+  for (size_t i = 0; i < snapshot->changed_sizes.size(); ++i) {
+    int index = snapshot->changed_sizes[i];
+    uint32_t net_num_allocs = snapshot->net_num_allocs[i];
+    size_count_tree_.SetCount(index, static_cast<int32_t>(net_num_allocs));
+    size_kilobytes_tree_.SetCount(
+        index, net_num_allocs ? NetKilobytes(net_num_allocs, index) : 0);
   }
-  size_leak_analyzer_.AddSample(std::move(size_ranked_list));
+
+  bool rank_by_count = leak_ranking_ != kRankByBytes;
+  bool rank_by_bytes = leak_ranking_ != kRankByCount;
+  if (rank_by_count)
+    AddSizeSample(size_count_tree_, &size_leak_analyzer_);
+  if (rank_by_bytes)
+    AddSizeSample(size_kilobytes_tree_, &size_bytes_leak_analyzer_);
 
   // Dump out the top entries.
   char buf[0x4000];
   if (do_logging && verbose_) {
-    if (size_leak_analyzer_.Dump(sizeof(buf), buf) < sizeof(buf))
+    if (rank_by_count &&
+        size_leak_analyzer_.Dump(sizeof(buf), buf) < sizeof(buf)) {
       PrintWithPidOnEachLine(buf);
+    }
+    if (rank_by_bytes) {
+      PrintWithPid("Sizes ranked by net KB:");
+      if (size_bytes_leak_analyzer_.Dump(sizeof(buf), buf) < sizeof(buf))
+        PrintWithPidOnEachLine(buf);
+    }
   }
 
-  // Get suspected leaks by size.
-  for (const ValueType& size_value : size_leak_analyzer_.suspected_leaks()) {
-    uint32_t size = size_value.size();
-    AllocSizeEntry* entry = &size_entries_[SizeToIndex(size)];
-    if (entry->stack_table)
+  // Get suspected leaks by size. Only AddSuspectedStackTables() sets
+  // |size_stack_tables_| and |size_stack_depths_|, so they can be read here
+  // without the lock.
+  snapshot->new_stack_table_sizes.clear();
+  snapshot->deeper_stack_sizes.clear();
+  char size_class[64];
+  for (const LeakAnalyzer* leak_analyzer :
+       {rank_by_count ? &size_leak_analyzer_ : nullptr,
+        rank_by_bytes ? &size_bytes_leak_analyzer_ : nullptr}) {
+    if (!leak_analyzer)
       continue;
-    if (do_logging) {
-      snprintf(buf, sizeof(buf), "Adding stack table for size %u\n", size);
-      PrintWithPidOnEachLine(buf);
+    for (const ValueType& size_value : leak_analyzer->suspected_leaks()) {
+      int index = SizeToIndex(size_value.size());
+      if (size_stack_tables_[index] ||
+          std::count(snapshot->new_stack_table_sizes.begin(),
+                     snapshot->new_stack_table_sizes.end(), index)) {
+        continue;
+      }
+      if (do_logging) {
+        SizeClassToString(index, sizeof(size_class), size_class);
+        snprintf(buf, sizeof(buf), "Adding stack table for size %s\n",
+                 size_class);
+        PrintWithPidOnEachLine(buf);
+      }
+      snapshot->new_stack_table_sizes.push_back(index);
     }
-    entry->stack_table = new(CustomAllocator::Allocate(sizeof(CallStackTable)))
-        CallStackTable(call_stack_suspicion_threshold_);
-    ++num_stack_tables_;
   }
 
   // Check for leaks in each CallStackTable. It makes sense to this before
@@ -212,45 +729,80 @@ void LeakDetectorImpl::TestForLeaks(
   // small since this function is run very rarely. So handle the leak checks of
   // Tier 2 here.
   reports->clear();
-  for (size_t i = 0; i < size_entries_.size(); ++i) {
-    const AllocSizeEntry& entry = size_entries_[i];
-    CallStackTable* stack_table = entry.stack_table;
-    if (!stack_table || stack_table->empty())
+  // Addrs of the call stack being reported.
+  InternalVector<const void*> stack;
+  for (const AnalysisSnapshot::StackTable& snapshot_table :
+       snapshot->stack_tables) {
+    CallStackTable* stack_table = snapshot_table.table;
+    const CallStackTable::Snapshot& counts = snapshot_table.counts;
+    if (!counts.num_call_stacks)
       continue;
 
-    size_t size = IndexToSize(i);
+    size_t size = IndexToSize(snapshot_table.size_index);
+    SizeClassToString(snapshot_table.size_index, sizeof(size_class),
+                      size_class);
     if (do_logging && verbose_) {
       // Dump table info.
-      snprintf(buf, sizeof(buf), "Stack table for size %zu:\n", size);
+      snprintf(buf, sizeof(buf), "Stack table for size %s:\n", size_class);
       PrintWithPidOnEachLine(buf);
 
-      if (stack_table->Dump(sizeof(buf), buf) < sizeof(buf))
+      if (stack_table->Dump(counts, sizeof(buf), buf) < sizeof(buf))
         PrintWithPidOnEachLine(buf);
     }
 
-    // Get suspected leaks by call stack.
-    stack_table->TestForLeaks();
+    // Get suspected leaks by call stack. A table whose counts were left out of
+    // the snapshot has not changed, so it has none.
+    stack_table->TestForLeaks(counts);
     const LeakAnalyzer& leak_analyzer = stack_table->leak_analyzer();
+    int stack_depth = size_stack_depths_[snapshot_table.size_index];
     for (const ValueType& call_stack_value : leak_analyzer.suspected_leaks()) {
-      const CallStack* call_stack = call_stack_value.call_stack();
+      uint32_t call_stack_id = call_stack_value.call_stack_id();
+      const CallStack* call_stack =
+          call_stack_manager_.GetCallStackById(call_stack_id);
+
+      // A call stack with as many frames as were captured may go deeper, so
+      // capture more of them from now on.
+      if (stack_depth < max_stack_depth_ &&
+          static_cast<int>(call_stack->depth) >= stack_depth) {
+        if (do_logging) {
+          snprintf(buf, sizeof(buf),
+                   "Capturing %d frames of call stacks for size %s\n",
+                   max_stack_depth_, size_class);
+          PrintWithPidOnEachLine(buf);
+        }
+        snapshot->deeper_stack_sizes.push_back(snapshot_table.size_index);
+        stack_depth = max_stack_depth_;
+      }
 
       // Return reports by storing in |*reports|.
       reports->resize(reports->size() + 1);
       InternalLeakReport* report = &reports->back();
       report->alloc_size_bytes = size;
+      report->max_alloc_size_bytes = IndexToMaxSize(snapshot_table.size_index);
+      report->estimated_num_allocs = 0;
+      for (size_t j = 0; j < counts.call_stack_ids.size(); ++j) {
+        if (counts.call_stack_ids[j] == call_stack_id) {
+          report->estimated_num_allocs = counts.net_num_allocs[j];
+          break;
+        }
+      }
+      stack.resize(call_stack->depth);
+      call_stack_manager_.GetStack(call_stack, stack.data());
       report->call_stack.resize(call_stack->depth);
       for (size_t j = 0; j < call_stack->depth; ++j) {
-        report->call_stack[j] = GetOffset(call_stack->stack[j]);
+        report->call_stack[j] = GetOffset(stack[j]);
       }
 
       if (do_logging) {
         int offset = snprintf(buf, sizeof(buf),
-                              "Suspected call stack for size %zu, %p:\n",
-                              size, call_stack);
+                              "Suspected call stack for size %s, %p, "
+                              "~%" PRIu64 " live allocs:\n",
+                              size_class, call_stack,
+                              report->estimated_num_allocs);
         for (size_t j = 0; j < call_stack->depth; ++j) {
           offset += snprintf(buf + offset, sizeof(buf) - offset,
                              "\t%" PRIxPTR "\n",
-                             GetOffset(call_stack->stack[j]));
+                             report->call_stack[j]);
         }
         PrintWithPidOnEachLine(buf);
       }
@@ -258,6 +810,24 @@ void LeakDetectorImpl::TestForLeaks(
   }
 }
 
+void LeakDetectorImpl::AddSuspectedStackTables(
+    const AnalysisSnapshot& snapshot) {
+  for (int index : snapshot.new_stack_table_sizes) {
+    CallStackTable** stack_table = &size_stack_tables_[index];
+    if (*stack_table)
+      continue;
+    *stack_table = new(CustomAllocator::Allocate(sizeof(CallStackTable)))
+        CallStackTable(call_stack_suspicion_threshold_);
+    size_stack_depths_[index] = initial_stack_depth_;
+    stack_table_sizes_.insert(std::lower_bound(stack_table_sizes_.begin(),
+                                               stack_table_sizes_.end(), index),
+                              index);
+    ++num_stack_tables_;
+  }
+  for (int index : snapshot.deeper_stack_sizes)
+    size_stack_depths_[index] = max_stack_depth_;
+}
+
 size_t LeakDetectorImpl::AddressHash::operator() (uintptr_t addr) const {
   return base::Hash(reinterpret_cast<const char*>(&addr), sizeof(addr));
 }
@@ -269,7 +839,7 @@ uintptr_t LeakDetectorImpl::GetOffset(const void *ptr) const {
   return ptr_value;
 }
 
-void LeakDetectorImpl::DumpStats() const {
+void LeakDetectorImpl::DumpStats(const AnalysisSnapshot& snapshot) const {
   char buf[1024];
   snprintf(buf, sizeof(buf),
            "Alloc size: %" PRIu64"\n"
@@ -277,10 +847,17 @@ void LeakDetectorImpl::DumpStats() const {
            "Net alloc size: %" PRIu64 "\n"
            "Number of stack tables: %u\n"
            "Percentage of allocs with stack traces: %.2f%%\n"
-           "Number of call stack buckets: %zu\n",
-           alloc_size_, free_size_, alloc_size_ - free_size_, num_stack_tables_,
-           num_allocs_ ? 100.0f * num_allocs_with_call_stack_ / num_allocs_ : 0,
-           call_stack_manager_.size());
+           "Number of call stack buckets: %zu in %zu bytes\n"
+           "Address map: %zu live allocs in %zu bytes\n",
+           snapshot.alloc_size, snapshot.free_size,
+           snapshot.alloc_size - snapshot.free_size, snapshot.num_stack_tables,
+           snapshot.num_allocs
+               ? 100.0f * snapshot.num_allocs_with_call_stack /
+                     snapshot.num_allocs
+               : 0,
+           snapshot.num_call_stacks, snapshot.call_stacks_size,
+           snapshot.num_live_allocs,
+           snapshot.address_map_size);
   PrintWithPidOnEachLine(buf);
 }
 
@@ -13,7 +13,11 @@
 
 #include "base/macros.h"
 #include "components/metrics/leak_detector/call_stack_manager.h"
+#include "components/metrics/leak_detector/call_stack_table.h"
+#include "components/metrics/leak_detector/compact_address_map.h"
+#include "components/metrics/leak_detector/flat_address_map.h"
 #include "components/metrics/leak_detector/leak_analyzer.h"
+#include "components/metrics/leak_detector/ranked_count_tree.h"
 
 namespace leak_detector {
 
@@ -22,10 +26,18 @@ namespace leak_detector {
 template <typename T>
 using InternalVector = std::vector<T, STL_Allocator<T, CustomAllocator>>;
 
-struct CallStackTable;
+class SampledAddressFilter;
 
 struct InternalLeakReport {
+  // The leaked allocs are of a size class, of which these are the smallest and
+  // largest sizes. Below 8 KB, each class spans 4 bytes.
   size_t alloc_size_bytes;
+  size_t max_alloc_size_bytes;
+
+  // Estimated number of live allocations of this size from this call stack,
+  // scaled up from the sampled allocations. See
+  // LeakDetectorImpl::SetUniformSampling().
+  uint64_t estimated_num_allocs;
 
   // Unlike the CallStack struct, which consists of addresses, this call stack
   // will contain offsets in the executable binary.
@@ -39,16 +51,110 @@ struct InternalLeakReport {
 // Class that contains the actual leak detection mechanism.
 class LeakDetectorImpl {
  public:
+  // Data structures that can keep track of the recorded allocs.
+  enum AddressMapType {
+    // FlatAddressMap. The faster of the two.
+    kFlatAddressMap,
+
+    // CompactAddressMap, which takes 16 bytes per recorded alloc, plus its
+    // page tables. It rounds down sizes of 4 MB and up, within their size
+    // class.
+    kCompactAddressMap,
+  };
+
+  // How allocation sizes are ranked to find the ones that may be leaking.
+  enum LeakRanking {
+    // By the net number of allocs of each size.
+    kRankByCount,
+
+    // By the net number of bytes of each size, so that a leak of a few large
+    // allocs can outrank one of many small allocs.
+    kRankByBytes,
+
+    // Both of the above. A size is suspected if either ranking suspects it.
+    kRankByCountAndBytes,
+  };
+
+  // An alloc or free, for recording in bulk with RecordEvents().
+  struct Event {
+    enum Type {
+      kAlloc,
+      kFree,
+    };
+
+    Type type;
+    const void* ptr;
+
+    // The remaining fields are only used for allocs. |call_stack_hash| is the
+    // base::Hash() of |call_stack|, or 0 if it has not been computed, in which
+    // case RecordEvents() hashes the call stack itself if it needs the hash.
+    // A call stack whose hash really is 0 is then merely hashed again.
+    size_t size;
+    int stack_depth;
+    const void* const* call_stack;
+    uint32_t call_stack_hash;
+  };
+
+  // Counters copied out of the detector, from which leak analysis can run
+  // without holding the lock that protects the detector.
+  struct AnalysisSnapshot {
+    struct StackTable {
+      // Index of the size, as in |changed_sizes|.
+      int size_index;
+      CallStackTable* table;
+      CallStackTable::Snapshot counts;
+    };
+
+    // For DumpStats().
+    uint64_t num_allocs;
+    uint64_t alloc_size;
+    uint64_t free_size;
+    uint32_t num_allocs_with_call_stack;
+    uint32_t num_stack_tables;
+    size_t num_call_stacks;
+    size_t call_stacks_size;
+    size_t num_live_allocs;
+    size_t address_map_size;
+
+    // Sampling parameters when the snapshot was taken. See
+    // SetUniformSampling() and SetByteSampling().
+    double sampling_probability;
+    uint64_t sampling_interval_bytes;
+
+    // Indices of the sizes that have had allocs or frees since the previous
+    // snapshot, in increasing order, and the net number of allocs of each.
+    // The counts of other sizes are as in the previous snapshot. All sizes are
+    // included in a snapshot taken under different sampling than the previous.
+    InternalVector<int> changed_sizes;
+    InternalVector<uint32_t> net_num_allocs;
+
+    // Counters of the sizes that have stack tables. Those of call stacks are
+    // only copied from tables that have changed since the previous snapshot,
+    // as with CallStackTable::TakeSnapshotOfChanges().
+    InternalVector<StackTable> stack_tables;
+
+    // Sizes that AnalyzeSnapshot() found to need a new stack table, as indices
+    // like those in |changed_sizes|.
+    InternalVector<int> new_stack_table_sizes;
+
+    // Sizes whose stack tables AnalyzeSnapshot() found to have suspected call
+    // stacks that may have been cut short, and that are to be captured with
+    // more frames from now on. See SetStackDepth().
+    InternalVector<int> deeper_stack_sizes;
+  };
+
   LeakDetectorImpl(uintptr_t mapping_addr,
                    size_t mapping_size,
                    int size_suspicion_threshold,
                    int call_stack_suspicion_threshold,
-                   bool verbose);
+                   bool verbose,
+                   AddressMapType address_map_type);
   ~LeakDetectorImpl();
 
-  // Indicates whether the given allocation size has an associated call stack
-  // table, and thus requires a stack unwind.
-  bool ShouldGetStackTraceForSize(size_t size) const;
+  // Returns the number of frames to unwind for an alloc of the given size, or
+  // 0 if it needs no stack unwind. The call stacks passed to RecordAlloc() for
+  // the size should have no more frames than this.
+  int GetStackDepthForSize(size_t size) const;
 
   // Record allocs and frees.
   void RecordAlloc(const void* ptr,
@@ -57,52 +163,189 @@ class LeakDetectorImpl {
                    const void* const call_stack[]);
   void RecordFree(const void* ptr);
 
+  // Same as RecordAlloc() above, but with the already computed base::Hash() of
+  // |call_stack|.
+  void RecordAlloc(const void* ptr,
+                   size_t size,
+                   int stack_depth,
+                   const void* const call_stack[],
+                   uint32_t call_stack_hash);
+
+  // Records a sequence of allocs and frees, in order. Cheaper per event than
+  // calling RecordAlloc() and RecordFree() for each one, as the table slots
+  // for upcoming events are prefetched while earlier events are recorded.
+  //
+  // A nonzero |source|, as returned by AddEventSource(), says that the events
+  // come from a buffer whose events may be out of order relative to those of
+  // other sources, e.g. when several threads buffer their own events and each
+  // buffer is flushed with one call. A free of an address that has no recorded
+  // alloc is then held back, in case its alloc is still in the buffer of
+  // another source. It cancels out with the first alloc of its address from
+  // the next call of another source, unless that source had already been
+  // called since the free, as its buffer then held no events from before the
+  // free. Only the order of events within a call is known, so should the
+  // address be freed and allocated again by other threads before the held
+  // back alloc is recorded, the allocs may be paired with the wrong frees until
+  // they are freed in turn.
+  void RecordEvents(const Event* events, size_t num_events, uint32_t source);
+
+  // Registers a buffer of events to be passed to RecordEvents(), before any
+  // event goes into the buffer. Returns its nonzero source id.
+  uint32_t AddEventSource();
+
+  // Unregisters a source once its buffer has been passed to RecordEvents() for
+  // the last time. Its id may then be reused.
+  void RemoveEventSource(uint32_t source);
+
+  // Describe how the allocs passed to RecordAlloc() were sampled, so that the
+  // counts in leak reports can be scaled up to estimates for all allocs. With
+  // uniform sampling, each alloc was recorded with probability |probability|.
+  // With byte sampling, allocs were sampled at points spaced out by an average
+  // of |mean_interval_bytes| bytes, so an alloc of size S was recorded with
+  // probability 1 - exp(-S / |mean_interval_bytes|). Defaults to uniform
+  // sampling with probability 1.
+  //
+  // The sampling may change while allocs are recorded. Counts are scaled by
+  // the sampling in effect at the time of each check, so a change should be
+  // matched by ForgetAllocs() where the sampling becomes sparser, leaving only
+  // recorded allocs that the new sampling would have recorded too.
+  void SetUniformSampling(double probability);
+  void SetByteSampling(uint64_t mean_interval_bytes);
+
+  // Sets how sizes are ranked. Defaults to kRankByCount. Call stacks are ranked
+  // by count either way, as those in one stack table have the same size class
+  // and would rank the same by bytes. Call before recording any allocs.
+  void SetLeakRanking(LeakRanking leak_ranking);
+
+  // Sets how the call stacks of recorded allocs are stored. Defaults to
+  // CallStackManager::kArrayStorage. Call before recording any allocs.
+  void SetCallStackStorage(CallStackManager::StorageType storage_type);
+
+  // Sets how many frames of call stacks to capture for sizes with stack tables,
+  // as returned by GetStackDepthForSize(). Each new stack table starts at
+  // |initial_depth| frames, which keeps stack unwinds cheap. Once a call stack
+  // of the table that has that many frames, and so may have been cut short,
+  // is suspected of leaking, the table goes to |max_depth| frames. Call stacks
+  // captured from then on are counted apart from the shorter ones, so the leak
+  // is also reported with the deeper call stack after it has been suspected
+  // again. Defaults to no limit on either, leaving the depth to the caller.
+  void SetStackDepth(int initial_depth, int max_depth);
+
+  // Removes the recorded allocs for which |should_forget| returns true, as if
+  // they had been freed.
+  void ForgetAllocs(bool (*should_forget)(const void* ptr, size_t size));
+
+  // Adds the address of each recorded alloc to |filter| with
+  // SampledAddressFilter::AddToNewGeneration().
+  void AddLiveAddressesToFilter(SampledAddressFilter* filter) const;
+
   // Run check for possible leaks based on the current profiling data.
   void TestForLeaks(bool do_logging,
                     InternalVector<InternalLeakReport>* reports);
 
- private:
-  // A record of allocations for a particular size.
-  struct AllocSizeEntry {
-    // Number of allocations and frees for this size.
-    uint32_t num_allocs;
-    uint32_t num_frees;
-
-    // A stack table, if this size is being profiled for stack as well.
-    CallStackTable* stack_table;
-  };
+  // TestForLeaks() in three steps, so that the bulk of the work can be done
+  // without holding the lock that protects the detector. Only the first and
+  // last steps access the data that RecordAlloc() and RecordFree() modify. The
+  // steps of one check must not overlap with those of another, and each
+  // snapshot taken must be analyzed before the next one is, as it only has
+  // what changed since the previous one.
+  void TakeAnalysisSnapshot(AnalysisSnapshot* snapshot);
+  void AnalyzeSnapshot(AnalysisSnapshot* snapshot,
+                       bool do_logging,
+                       InternalVector<InternalLeakReport>* reports);
+  void AddSuspectedStackTables(const AnalysisSnapshot& snapshot);
 
+ private:
   // Info for a single allocation.
   struct AllocInfo {
-    AllocInfo() : call_stack(nullptr) {}
+    AllocInfo() : call_stack_id(0) {}
 
     // Number of bytes in this allocation.
     size_t size;
 
-    // Points to a unique call stack.
-    const CallStack* call_stack;
+    // CallStackManager id of the call stack, or 0 if there is none.
+    uint32_t call_stack_id;
   };
 
-  // Allocator class for allocation entry map. Maps allocated addresses to
-  // AllocInfo objects.
-  using AllocationEntryAllocator =
-      STL_Allocator<std::pair<const void*, AllocInfo>, CustomAllocator>;
-
   // Hash class for addresses.
   struct AddressHash {
     size_t operator() (uintptr_t addr) const;
   };
 
+  // Maps allocated addresses to AllocInfo objects.
+  using AddressMap = FlatAddressMap<AllocInfo>;
+
+  // Implements both versions of RecordAlloc(). |call_stack_hash| may be null,
+  // in which case the call stack is hashed if needed.
+  void RecordAllocWithHash(const void* ptr,
+                           size_t size,
+                           int stack_depth,
+                           const void* const call_stack[],
+                           const uint32_t* call_stack_hash);
+
+  // Implements RecordFree(). Returns false if |ptr| has no recorded alloc.
+  bool RecordFreeOfRecordedAlloc(const void* ptr);
+
+  // Accounts for the free of a recorded alloc. The caller removes it from
+  // |address_map_| or |compact_address_map_|.
+  void AccountForFree(const AllocInfo& alloc_info);
+  void AccountForFree(const CompactAddressMap::Entry& entry);
+
+  // Accounts for the free of an alloc of |size| bytes, except in the stack
+  // table. Returns the stack table of the size, or null if it has none.
+  CallStackTable* AccountForFreeOfSize(size_t size);
+
+  // Marks the counts of the size with |index| as changed since the last
+  // snapshot.
+  void MarkSizeChanged(int index) {
+    size_changed_bits_[index / 64] |= static_cast<uint64_t>(1) << (index % 64);
+  }
+
+  // A buffer of events registered with AddEventSource().
+  struct EventSource {
+    bool in_use;
+
+    // Number of the last RecordEvents() call with events of this source, or
+    // of the last call before the source was added.
+    uint64_t last_call;
+  };
+
+  // A free held back by RecordEvents() until its alloc is recorded.
+  struct OrphanFree {
+    // The source of the free, and the number of the call that recorded it.
+    uint32_t source;
+    uint64_t call;
+  };
+
+  // Checks an alloc recorded by the RecordEvents() call numbered |call| of a
+  // source that was last called by call |last_call|. Returns true if a free of
+  // |ptr| from another source was held back by a call in between, in which case
+  // the two have been accounted for together.
+  bool MatchOrphanFree(const void* ptr,
+                       size_t size,
+                       uint64_t last_call,
+                       uint64_t call);
+
+  // Holds back a free from |source| in RecordEvents() call |call| until its
+  // alloc is recorded.
+  void AddOrphanFree(const void* ptr, uint32_t source, uint64_t call);
+
+  // Drops the held back frees whose allocs can no longer be recorded, as every
+  // other source has been called since.
+  void ExpireOrphanFrees();
+
   // Returns the offset of |ptr| within the current binary. If it is not in the
   // current binary, just return |ptr| as an integer.
   uintptr_t GetOffset(const void *ptr) const;
 
-  // Dump current profiling statistics to log.
-  void DumpStats() const;
+  // Dump profiling statistics from |snapshot| to log.
+  void DumpStats(const AnalysisSnapshot& snapshot) const;
 
   // Owns all unique call stack objects, which are allocated on the heap. Any
   // other class or function that references a call stack must get it from here,
-  // but may not take ownership of the call stack object.
+  // but may not take ownership of the call stack object. Each recorded alloc
+  // with a call stack holds a reference to it, which also covers the call
+  // stack's entry in the stack table of the size.
   CallStackManager call_stack_manager_;
 
   // Allocation stats.
@@ -114,18 +357,59 @@ class LeakDetectorImpl {
   uint32_t num_allocs_with_call_stack_;
   uint32_t num_stack_tables_;
 
-  // Stores all individual recorded allocations.
+  // Stores all individual recorded allocations. Only the one selected by the
+  // AddressMapType passed to the constructor is allocated.
+  AddressMap* address_map_;
+  CompactAddressMap* compact_address_map_;
+
+  // Number of RecordEvents() calls with a nonzero source so far.
+  uint64_t num_source_calls_;
+
+  // Sources registered with AddEventSource(), indexed by their id minus one.
+  InternalVector<EventSource> event_sources_;
+
+  // Frees whose allocs may not have been recorded yet, by address.
   std::unordered_map<uintptr_t,
-                     AllocInfo,
+                     OrphanFree,
                      AddressHash,
                      std::equal_to<uintptr_t>,
-                     AllocationEntryAllocator> address_map_;
+                     STL_Allocator<std::pair<const uintptr_t, OrphanFree>,
+                                   CustomAllocator>> orphan_frees_;
 
-  // Used to analyze potential leak patterns in the allocation sizes.
+  // Used to analyze potential leak patterns in the allocation sizes, ranked by
+  // count and by bytes. Only those that |leak_ranking_| calls for are used.
   LeakAnalyzer size_leak_analyzer_;
-
-  // Allocation stats for each size.
-  InternalVector<AllocSizeEntry> size_entries_;
+  LeakAnalyzer size_bytes_leak_analyzer_;
+  LeakRanking leak_ranking_;
+
+  // Allocation stats for each size class, indexed by SizeToIndex() in the
+  // .cc file: the number of allocs and frees, and a stack table if the size
+  // is being profiled for stack as well. The counts are kept in arrays of
+  // their own, so that analysis can scan them a vector at a time.
+  InternalVector<uint32_t> size_num_allocs_;
+  InternalVector<uint32_t> size_num_frees_;
+  InternalVector<CallStackTable*> size_stack_tables_;
+
+  // Number of frames to capture for each size, as returned by
+  // GetStackDepthForSize(). 0 for the sizes without stack tables.
+  InternalVector<int> size_stack_depths_;
+
+  // Bit i of word i / 64 is set if the counts of the size with index i have
+  // changed since the last snapshot.
+  InternalVector<uint64_t> size_changed_bits_;
+
+  // Indices of the sizes that have stack tables, in increasing order.
+  InternalVector<int> stack_table_sizes_;
+
+  // Sampling parameters of the last snapshot taken.
+  double snapshot_sampling_probability_;
+  uint64_t snapshot_sampling_interval_bytes_;
+
+  // Net number of allocs of each size, scaled as in the last snapshot
+  // analyzed, and the number of KB they take, for ranking the sizes. Updated
+  // with just the counts that changed.
+  RankedCountTree size_count_tree_;
+  RankedCountTree size_kilobytes_tree_;
 
   // Address mapping info of the current binary.
   uintptr_t mapping_addr_;
@@ -139,9 +423,18 @@ class LeakDetectorImpl {
   // considered a leak suspect.
   int call_stack_suspicion_threshold_;
 
+  // See SetStackDepth().
+  int initial_stack_depth_;
+  int max_stack_depth_;
+
   // Enable verbose dumping of much more leak analysis data.
   bool verbose_;
 
+  // See SetUniformSampling() and SetByteSampling(). |sampling_interval_bytes_|
+  // is 0 for uniform sampling.
+  double sampling_probability_;
+  uint64_t sampling_interval_bytes_;
+
   DISALLOW_COPY_AND_ASSIGN(LeakDetectorImpl);
 };
 
@@ -7,11 +7,13 @@
 #include <math.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <complex>
 #include <new>
 #include <set>
 #include <vector>
 
+#include "base/hash.h"
 #include "base/macros.h"
 #include "base/memory/scoped_ptr.h"
 #include "testing/gtest/include/gtest/gtest.h"
@@ -90,6 +92,29 @@ const TestCallStack kStack4 =
 const TestCallStack kStack5 =
     { arraysize(kRawStack5), reinterpret_cast<const void* const*>(kRawStack5) };
 
+// Returns an event for LeakDetectorImpl::RecordEvents() of an alloc from
+// |stack|, with the hash of the call stack filled in as the malloc hooks do.
+LeakDetectorImpl::Event MakeAllocEvent(const void* ptr,
+                                       size_t size,
+                                       const TestCallStack& stack) {
+  LeakDetectorImpl::Event event = {};
+  event.type = LeakDetectorImpl::Event::kAlloc;
+  event.ptr = ptr;
+  event.size = size;
+  event.stack_depth = stack.depth;
+  event.call_stack = stack.stack;
+  event.call_stack_hash =
+      base::Hash(stack.stack, sizeof(*stack.stack) * stack.depth);
+  return event;
+}
+
+LeakDetectorImpl::Event MakeFreeEvent(const void* ptr) {
+  LeakDetectorImpl::Event event = {};
+  event.type = LeakDetectorImpl::Event::kFree;
+  event.ptr = ptr;
+  return event;
+}
+
 }  // namespace
 
 class LeakDetectorImplTest : public ::testing::Test {
@@ -102,15 +127,7 @@ class LeakDetectorImplTest : public ::testing::Test {
 
   void SetUp() override {
     CustomAllocator::InitializeForUnitTest();
-
-    const int kSizeSuspicionThreshold = 4;
-    const int kCallStackSuspicionThreshold = 4;
-    detector_.reset(
-        new LeakDetectorImpl(kMappingAddr,
-                             kMappingSize,
-                             kSizeSuspicionThreshold,
-                             kCallStackSuspicionThreshold,
-                             true /* verbose */));
+    CreateDetector(LeakDetectorImpl::kFlatAddressMap);
   }
 
   void TearDown() override {
@@ -129,10 +146,13 @@ class LeakDetectorImplTest : public ::testing::Test {
 
  protected:
   // Alloc and free functions that automatically pass allocation info to
-  // |detector_|.
+  // |detector_|. Allocs get as much of |stack| as the detector asks for, as
+  // the malloc hooks would unwind.
   void* Alloc(size_t size, const TestCallStack& stack) {
     void* ptr = new char[size];
-    detector_->RecordAlloc(ptr, size, stack.depth, stack.stack);
+    int depth = std::min<int>(stack.depth,
+                              detector_->GetStackDepthForSize(size));
+    detector_->RecordAlloc(ptr, size, depth, stack.stack);
 
     EXPECT_TRUE(alloced_ptrs_.find(ptr) == alloced_ptrs_.end());
     alloced_ptrs_.insert(ptr);
@@ -165,6 +185,24 @@ class LeakDetectorImplTest : public ::testing::Test {
     delete [] reinterpret_cast<char*>(ptr);
   }
 
+  // Replaces |detector_| with one that tracks allocs in the given type of
+  // address map.
+  void CreateDetector(LeakDetectorImpl::AddressMapType address_map_type) {
+    const int kSizeSuspicionThreshold = 4;
+    const int kCallStackSuspicionThreshold = 4;
+    detector_.reset(
+        new LeakDetectorImpl(kMappingAddr,
+                             kMappingSize,
+                             kSizeSuspicionThreshold,
+                             kCallStackSuspicionThreshold,
+                             true /* verbose */,
+                             address_map_type));
+  }
+
+  // TEST CASE: Leaks many small allocs from |kStack1| and a few large ones from
+  // |kStack3|. Returns the sizes of the reported leaks.
+  std::set<size_t> LeakSmallAndLargeAllocs();
+
   // TEST CASE: Julia set fractal computation. Pass in has_leak=true to trigger
   // the memory leak.
   void JuliaSet(bool has_leak);
@@ -368,6 +406,46 @@ void LeakDetectorImplTest::JuliaSet(bool has_leak) {
   }
 }
 
+std::set<size_t> LeakDetectorImplTest::LeakSmallAndLargeAllocs() {
+  const size_t kSmallSize = 16;
+  const size_t kLargeSize = 1 << 20;
+  const int kNumRounds = 20;
+  const int kNumSmallLeaksPerRound = 200;
+
+  uintptr_t next_addr = 0x1000000;
+  for (int round = 0; round < kNumRounds; ++round) {
+    for (int i = 0; i < kNumSmallLeaksPerRound; ++i) {
+      detector_->RecordAlloc(reinterpret_cast<const void*>(next_addr++),
+                             kSmallSize, kStack1.depth, kStack1.stack);
+    }
+    detector_->RecordAlloc(reinterpret_cast<const void*>(next_addr++),
+                           kLargeSize, kStack3.depth, kStack3.stack);
+
+    // Keep one alloc of each size alive from another call stack, so that the
+    // leaking call stacks stand out.
+    for (size_t size : {kSmallSize, kLargeSize}) {
+      uintptr_t live_addr = 0x2000 + size * 4;
+      detector_->RecordAlloc(
+          reinterpret_cast<const void*>(live_addr + round % 2), size,
+          kStack2.depth, kStack2.stack);
+      if (round > 0) {
+        detector_->RecordFree(
+            reinterpret_cast<const void*>(live_addr + (round - 1) % 2));
+      }
+    }
+
+    InternalVector<InternalLeakReport> reports;
+    detector_->TestForLeaks(false /* do_logging */, &reports);
+    for (const InternalLeakReport& report : reports)
+      stored_reports_.insert(report);
+  }
+
+  std::set<size_t> sizes;
+  for (const InternalLeakReport& report : stored_reports_)
+    sizes.insert(report.alloc_size_bytes);
+  return sizes;
+}
+
 TEST_F(LeakDetectorImplTest, CheckTestFramework) {
   EXPECT_EQ(0U, total_num_allocs_);
   EXPECT_EQ(0U, total_num_frees_);
@@ -458,4 +536,432 @@ TEST_F(LeakDetectorImplTest, JuliaSetWithLeak) {
   }
 }
 
+TEST_F(LeakDetectorImplTest, JuliaSetNoLeakCompactAddressMap) {
+  CreateDetector(LeakDetectorImpl::kCompactAddressMap);
+  JuliaSet(false);
+
+  EXPECT_EQ(total_num_allocs_, total_num_frees_);
+  ASSERT_EQ(0U, stored_reports_.size());
+}
+
+TEST_F(LeakDetectorImplTest, JuliaSetWithLeakCompactAddressMap) {
+  CreateDetector(LeakDetectorImpl::kCompactAddressMap);
+  JuliaSet(true);
+
+  // Same leaks as with the default address map.
+  ASSERT_EQ(2U, stored_reports_.size());
+  const InternalLeakReport& report1 = *stored_reports_.begin();
+  EXPECT_EQ(sizeof(Complex) + 40, report1.alloc_size_bytes);
+  EXPECT_EQ(kStack3.depth, report1.call_stack.size());
+  const InternalLeakReport& report2 = *(++stored_reports_.begin());
+  EXPECT_EQ(sizeof(Complex) + 52, report2.alloc_size_bytes);
+  EXPECT_EQ(kStack4.depth, report2.call_stack.size());
+}
+
+TEST_F(LeakDetectorImplTest, JuliaSetWithLeakCallStackTrie) {
+  detector_->SetCallStackStorage(CallStackManager::kTrieStorage);
+  JuliaSet(true);
+
+  // Same leaks as with call stacks stored as arrays, with the same addrs.
+  ASSERT_EQ(2U, stored_reports_.size());
+  const InternalLeakReport& report1 = *stored_reports_.begin();
+  EXPECT_EQ(sizeof(Complex) + 40, report1.alloc_size_bytes);
+  ASSERT_EQ(kStack3.depth, report1.call_stack.size());
+  for (size_t i = 0; i < kStack3.depth; ++i) {
+    if (kRawStack3[i] >= kMappingAddr &&
+        kRawStack3[i] <= kMappingAddr + kMappingSize) {
+      EXPECT_EQ(kRawStack3[i] - kMappingAddr, report1.call_stack[i]);
+    } else {
+      EXPECT_EQ(kRawStack3[i], report1.call_stack[i]);
+    }
+  }
+  const InternalLeakReport& report2 = *(++stored_reports_.begin());
+  EXPECT_EQ(sizeof(Complex) + 52, report2.alloc_size_bytes);
+  EXPECT_EQ(kStack4.depth, report2.call_stack.size());
+}
+
+TEST_F(LeakDetectorImplTest, JuliaSetWithLeakAdaptiveStackDepth) {
+  detector_->SetStackDepth(2, 8);
+  JuliaSet(true);
+
+  // The leaks are suspected with the first two frames of their call stacks,
+  // which are then captured in full.
+  EXPECT_EQ(8, detector_->GetStackDepthForSize(sizeof(Complex) + 40));
+  EXPECT_EQ(8, detector_->GetStackDepthForSize(sizeof(Complex) + 52));
+  EXPECT_EQ(0, detector_->GetStackDepthForSize(sizeof(Complex) + 48));
+
+  // Each leak is reported with the call stack cut short, and then with all of
+  // it.
+  ASSERT_EQ(4U, stored_reports_.size());
+  auto iter = stored_reports_.begin();
+  for (const TestCallStack& stack : {kStack3, kStack4}) {
+    const InternalLeakReport& shallow_report = *iter++;
+    const InternalLeakReport& deep_report = *iter++;
+    EXPECT_EQ(shallow_report.alloc_size_bytes, deep_report.alloc_size_bytes);
+    EXPECT_EQ(2U, shallow_report.call_stack.size());
+    ASSERT_EQ(stack.depth, deep_report.call_stack.size());
+    for (size_t i = 0; i < stack.depth; ++i) {
+      uintptr_t addr = reinterpret_cast<uintptr_t>(stack.stack[i]);
+      if (addr >= kMappingAddr && addr <= kMappingAddr + kMappingSize)
+        addr -= kMappingAddr;
+      EXPECT_EQ(addr, deep_report.call_stack[i]);
+      if (i < shallow_report.call_stack.size()) {
+        EXPECT_EQ(addr, shallow_report.call_stack[i]);
+      }
+    }
+  }
+  EXPECT_EQ(sizeof(Complex) + 40, stored_reports_.begin()->alloc_size_bytes);
+  EXPECT_EQ(sizeof(Complex) + 52, stored_reports_.rbegin()->alloc_size_bytes);
+}
+
+TEST_F(LeakDetectorImplTest, JuliaSetWithLeakAndSampling) {
+  // Pretend that only a quarter of the allocs were recorded.
+  detector_->SetUniformSampling(0.25);
+  JuliaSet(true);
+
+  ASSERT_EQ(2U, stored_reports_.size());
+  for (const InternalLeakReport& report : stored_reports_) {
+    EXPECT_GT(report.estimated_num_allocs, 0U);
+    EXPECT_EQ(0U, report.estimated_num_allocs % 4);
+  }
+}
+
+TEST_F(LeakDetectorImplTest, OutOfOrderEvents) {
+  // Each round, one thread frees what another allocated, and its buffer is
+  // flushed first, so that those allocs are recorded only after their frees.
+  // They must not look like leaks. The allocs of |kLeakSize| really are leaked.
+  const size_t kSize = 32;
+  const size_t kLeakSize = 48;
+  const int kNumRounds = 40;
+  const int kNumPairsPerRound = 20;
+  const int kNumLeaksPerRound = 5;
+
+  uint32_t free_source = detector_->AddEventSource();
+  uint32_t alloc_source = detector_->AddEventSource();
+  uintptr_t next_addr = 0x1000000;
+  uintptr_t next_leak_addr = 0x10000000;
+  for (int round = 0; round < kNumRounds; ++round) {
+    std::vector<LeakDetectorImpl::Event> frees;
+    std::vector<LeakDetectorImpl::Event> allocs;
+    for (int i = 0; i < kNumPairsPerRound; ++i) {
+      const void* ptr = reinterpret_cast<const void*>(next_addr);
+      next_addr += kSize;
+      allocs.push_back(MakeAllocEvent(ptr, kSize, kStack0));
+      frees.push_back(MakeFreeEvent(ptr));
+    }
+    for (int i = 0; i < kNumLeaksPerRound; ++i) {
+      allocs.push_back(MakeAllocEvent(
+          reinterpret_cast<const void*>(next_leak_addr), kLeakSize, kStack1));
+      next_leak_addr += kLeakSize;
+    }
+
+    // Also keep one alloc of |kLeakSize| alive from another call stack, so
+    // that the leaking call stack stands out. Its address is freed and
+    // allocated again within the same flush, and must not be taken for one of
+    // the allocs that the frees above are waiting for.
+    const void* live_ptr = reinterpret_cast<const void*>(0x2000 + round % 2);
+    if (round > 0) {
+      allocs.push_back(MakeFreeEvent(
+          reinterpret_cast<const void*>(0x2000 + (round - 1) % 2)));
+    }
+    allocs.push_back(MakeAllocEvent(live_ptr, kLeakSize, kStack2));
+
+    detector_->RecordEvents(frees.data(), frees.size(), free_source);
+    detector_->RecordEvents(allocs.data(), allocs.size(), alloc_source);
+
+    InternalVector<InternalLeakReport> reports;
+    detector_->TestForLeaks(false /* do_logging */, &reports);
+    for (const InternalLeakReport& report : reports)
+      stored_reports_.insert(report);
+  }
+
+  ASSERT_EQ(1U, stored_reports_.size());
+  const InternalLeakReport& report = *stored_reports_.begin();
+  EXPECT_EQ(kLeakSize, report.alloc_size_bytes);
+  EXPECT_EQ(kStack1.depth, report.call_stack.size());
+}
+
+TEST_F(LeakDetectorImplTest, OrphanFreeNotMatchedWithinSameFlush) {
+  // A free recorded before any alloc of its address, followed by an alloc of
+  // the address in the same flush: the alloc happened after the free, so it is
+  // live.
+  const size_t kSize = 48;
+  const void* ptr = reinterpret_cast<const void*>(0x3000);
+  uint32_t source0 = detector_->AddEventSource();
+  uint32_t source1 = detector_->AddEventSource();
+  LeakDetectorImpl::Event events[] = {MakeFreeEvent(ptr),
+                                      MakeAllocEvent(ptr, kSize, kStack0)};
+  detector_->RecordEvents(events, arraysize(events), source0);
+  LeakDetectorImpl::AnalysisSnapshot snapshot;
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(1U, snapshot.num_live_allocs);
+  EXPECT_EQ(0U, snapshot.free_size);
+
+  // The alloc that the free was waiting for arrives in the next flush of
+  // another source, and the two cancel out.
+  LeakDetectorImpl::Event alloc = MakeAllocEvent(ptr, kSize, kStack1);
+  detector_->RecordEvents(&alloc, 1, source1);
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(1U, snapshot.num_live_allocs);
+  EXPECT_EQ(2U, snapshot.num_allocs);
+  EXPECT_EQ(kSize, snapshot.free_size);
+}
+
+TEST_F(LeakDetectorImplTest, OrphanFreeNotMatchedWithSameSource) {
+  // Each round, one thread frees an address whose alloc was never recorded,
+  // e.g. because it was made before the leak detector started, and then leaks
+  // a new alloc at that address. The frees must not cancel out the leaks.
+  const size_t kSize = 32;
+  const size_t kLeakSize = 48;
+  const int kNumRounds = 40;
+  const int kNumLeaksPerRound = 5;
+
+  uint32_t leak_source = detector_->AddEventSource();
+  uint32_t other_source = detector_->AddEventSource();
+  uintptr_t next_addr = 0x1000000;
+  uintptr_t next_leak_addr = 0x10000000;
+  for (int round = 0; round < kNumRounds; ++round) {
+    std::vector<LeakDetectorImpl::Event> frees;
+    std::vector<LeakDetectorImpl::Event> allocs;
+    for (int i = 0; i < kNumLeaksPerRound; ++i) {
+      const void* ptr = reinterpret_cast<const void*>(next_leak_addr);
+      next_leak_addr += kLeakSize;
+      frees.push_back(MakeFreeEvent(ptr));
+      allocs.push_back(MakeAllocEvent(ptr, kLeakSize, kStack1));
+    }
+    detector_->RecordEvents(frees.data(), frees.size(), leak_source);
+    detector_->RecordEvents(allocs.data(), allocs.size(), leak_source);
+
+    // Another thread allocates and frees in order in between, and keeps one
+    // alloc of |kLeakSize| alive from another call stack, so that the leaking
+    // call stack stands out.
+    std::vector<LeakDetectorImpl::Event> others;
+    for (int i = 0; i < 20; ++i) {
+      const void* ptr = reinterpret_cast<const void*>(next_addr);
+      next_addr += kSize;
+      others.push_back(MakeAllocEvent(ptr, kSize, kStack0));
+      others.push_back(MakeFreeEvent(ptr));
+    }
+    if (round > 0) {
+      others.push_back(MakeFreeEvent(
+          reinterpret_cast<const void*>(0x2000 + (round - 1) % 2)));
+    }
+    others.push_back(MakeAllocEvent(
+        reinterpret_cast<const void*>(0x2000 + round % 2), kLeakSize, kStack2));
+    detector_->RecordEvents(others.data(), others.size(), other_source);
+
+    InternalVector<InternalLeakReport> reports;
+    detector_->TestForLeaks(false /* do_logging */, &reports);
+    for (const InternalLeakReport& report : reports)
+      stored_reports_.insert(report);
+  }
+
+  LeakDetectorImpl::AnalysisSnapshot snapshot;
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(static_cast<size_t>(kNumRounds * kNumLeaksPerRound + 1),
+            snapshot.num_live_allocs);
+
+  ASSERT_EQ(1U, stored_reports_.size());
+  const InternalLeakReport& report = *stored_reports_.begin();
+  EXPECT_EQ(kLeakSize, report.alloc_size_bytes);
+  EXPECT_EQ(kStack1.depth, report.call_stack.size());
+}
+
+TEST_F(LeakDetectorImplTest, OrphanFreeExpiresOnceOtherSourcesFlushed) {
+  const size_t kSize = 48;
+  const void* ptr = reinterpret_cast<const void*>(0x3000);
+  uint32_t source0 = detector_->AddEventSource();
+  uint32_t source1 = detector_->AddEventSource();
+  LeakDetectorImpl::Event free_event = MakeFreeEvent(ptr);
+  detector_->RecordEvents(&free_event, 1, source0);
+
+  // |source1| has been flushed since the free without the alloc of |ptr|, so
+  // its later alloc of |ptr| happened after the free and is live.
+  detector_->RecordEvents(nullptr, 0, source1);
+  LeakDetectorImpl::Event alloc = MakeAllocEvent(ptr, kSize, kStack0);
+  detector_->RecordEvents(&alloc, 1, source1);
+  LeakDetectorImpl::AnalysisSnapshot snapshot;
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(1U, snapshot.num_live_allocs);
+  EXPECT_EQ(0U, snapshot.free_size);
+
+  // Neither does a source added after the free match it.
+  const void* ptr2 = reinterpret_cast<const void*>(0x4000);
+  free_event = MakeFreeEvent(ptr2);
+  detector_->RecordEvents(&free_event, 1, source0);
+  detector_->RemoveEventSource(source1);
+  uint32_t source2 = detector_->AddEventSource();
+  alloc = MakeAllocEvent(ptr2, kSize, kStack0);
+  detector_->RecordEvents(&alloc, 1, source2);
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(2U, snapshot.num_live_allocs);
+  EXPECT_EQ(0U, snapshot.free_size);
+}
+
+TEST_F(LeakDetectorImplTest, LargeSizeLeak) {
+  // Allocs of various sizes from 8 KB up to beyond 4 GB, which share size
+  // classes. Those from |kStack1| of around 100 KB are leaked; the others are
+  // freed again, except one of the leaked size class from |kStack2|.
+  const size_t kSizes[] = {8192, 20000, 1 << 20, 3000000000ULL, 5ULL << 30};
+  const size_t kLeakSize = 100000;
+  const int kNumRounds = 40;
+  const int kNumLeaksPerRound = 5;
+
+  uintptr_t next_addr = 0x1000000;
+  for (int round = 0; round < kNumRounds; ++round) {
+    for (size_t size : kSizes) {
+      const void* ptr = reinterpret_cast<const void*>(next_addr++);
+      detector_->RecordAlloc(ptr, size + round, kStack0.depth, kStack0.stack);
+      detector_->RecordFree(ptr);
+    }
+    for (int i = 0; i < kNumLeaksPerRound; ++i) {
+      detector_->RecordAlloc(reinterpret_cast<const void*>(next_addr++),
+                             kLeakSize + round * 10 + i, kStack1.depth,
+                             kStack1.stack);
+    }
+    const void* live_ptr = reinterpret_cast<const void*>(0x2000 + round % 2);
+    detector_->RecordAlloc(live_ptr, kLeakSize - round, kStack2.depth,
+                           kStack2.stack);
+    if (round > 0)
+      detector_->RecordFree(reinterpret_cast<const void*>(0x2000 +
+                                                          (round - 1) % 2));
+
+    InternalVector<InternalLeakReport> reports;
+    detector_->TestForLeaks(false /* do_logging */, &reports);
+    for (const InternalLeakReport& report : reports)
+      stored_reports_.insert(report);
+  }
+
+  // 100000 is between 2^16 and 2^17, in the fifth of eight classes.
+  ASSERT_EQ(1U, stored_reports_.size());
+  const InternalLeakReport& report = *stored_reports_.begin();
+  EXPECT_EQ((1U << 16) + 4 * (1U << 13), report.alloc_size_bytes);
+  EXPECT_EQ((1U << 16) + 5 * (1U << 13) - 1, report.max_alloc_size_bytes);
+  EXPECT_EQ(kStack1.depth, report.call_stack.size());
+}
+
+TEST_F(LeakDetectorImplTest, LeaksAroundFourGigabytes) {
+  // Leaks of sizes just below 4 GB, in the last class of the sizes below 4 GB,
+  // and of sizes beyond 4 GB, which have a class of their own. Each class also
+  // has one alloc alive from |kStack0|.
+  const size_t k4GB = 1ULL << 32;
+  const int kNumRounds = 40;
+  const int kNumLeaksPerRound = 5;
+
+  uintptr_t next_addr = 0x1000000;
+  for (int round = 0; round < kNumRounds; ++round) {
+    for (int i = 0; i < kNumLeaksPerRound; ++i) {
+      detector_->RecordAlloc(reinterpret_cast<const void*>(next_addr++),
+                             k4GB - 1 - round * 10 - i, kStack1.depth,
+                             kStack1.stack);
+      detector_->RecordAlloc(reinterpret_cast<const void*>(next_addr++),
+                             k4GB + round * 10 + i, kStack2.depth,
+                             kStack2.stack);
+    }
+    for (uintptr_t live_addr : {0x2000, 0x3000}) {
+      size_t size = live_addr == 0x2000 ? k4GB - 1 : k4GB;
+      detector_->RecordAlloc(
+          reinterpret_cast<const void*>(live_addr + round % 2), size,
+          kStack0.depth, kStack0.stack);
+      if (round > 0) {
+        detector_->RecordFree(
+            reinterpret_cast<const void*>(live_addr + (round - 1) % 2));
+      }
+    }
+
+    InternalVector<InternalLeakReport> reports;
+    detector_->TestForLeaks(false /* do_logging */, &reports);
+    for (const InternalLeakReport& report : reports)
+      stored_reports_.insert(report);
+  }
+
+  ASSERT_EQ(2U, stored_reports_.size());
+  auto iter = stored_reports_.begin();
+  EXPECT_EQ(k4GB - (1U << 28), iter->alloc_size_bytes);
+  EXPECT_EQ(k4GB - 1, iter->max_alloc_size_bytes);
+  EXPECT_EQ(kStack1.depth, iter->call_stack.size());
+  ++iter;
+  EXPECT_EQ(k4GB, iter->alloc_size_bytes);
+  EXPECT_EQ(SIZE_MAX, iter->max_alloc_size_bytes);
+  EXPECT_EQ(kStack2.depth, iter->call_stack.size());
+}
+
+TEST_F(LeakDetectorImplTest, RankByCount) {
+  EXPECT_EQ(std::set<size_t>({16}), LeakSmallAndLargeAllocs());
+}
+
+TEST_F(LeakDetectorImplTest, RankByBytes) {
+  detector_->SetLeakRanking(LeakDetectorImpl::kRankByBytes);
+  EXPECT_EQ(std::set<size_t>({1 << 20}), LeakSmallAndLargeAllocs());
+}
+
+TEST_F(LeakDetectorImplTest, RankByCountAndBytes) {
+  detector_->SetLeakRanking(LeakDetectorImpl::kRankByCountAndBytes);
+  EXPECT_EQ(std::set<size_t>({16, 1 << 20}), LeakSmallAndLargeAllocs());
+}
+
+TEST_F(LeakDetectorImplTest, SamplingRateChange) {
+  // Record every alloc, then halve the sampling rate by forgetting the allocs
+  // at odd addresses, which the new rate would not have sampled.
+  const size_t kSize = 32;
+  const int kNumAllocs = 100;
+  const uintptr_t kBaseAddr = 0x1000000;
+  for (int i = 0; i < kNumAllocs; ++i) {
+    detector_->RecordAlloc(reinterpret_cast<const void*>(kBaseAddr + i), kSize,
+                           0, nullptr);
+  }
+  detector_->ForgetAllocs([](const void* ptr, size_t /* size */) {
+    return (reinterpret_cast<uintptr_t>(ptr) & 1) != 0;
+  });
+  detector_->SetUniformSampling(0.5);
+
+  // The remaining allocs are scaled back up to the same estimate.
+  LeakDetectorImpl::AnalysisSnapshot snapshot;
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(kNumAllocs / 2U, snapshot.net_num_allocs[kSize / 4]);
+  InternalVector<InternalLeakReport> reports;
+  detector_->AnalyzeSnapshot(&snapshot, false /* do_logging */, &reports);
+  EXPECT_EQ(static_cast<uint32_t>(kNumAllocs),
+            snapshot.net_num_allocs[kSize / 4]);
+
+  // Frees of the forgotten allocs are ignored. The sampling has not changed
+  // since the last snapshot, so only the size that changed is in this one.
+  for (int i = 0; i < kNumAllocs; ++i)
+    detector_->RecordFree(reinterpret_cast<const void*>(kBaseAddr + i));
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  ASSERT_EQ(1U, snapshot.changed_sizes.size());
+  EXPECT_EQ(static_cast<int>(kSize / 4), snapshot.changed_sizes[0]);
+  EXPECT_EQ(0U, snapshot.net_num_allocs[0]);
+}
+
+TEST_F(LeakDetectorImplTest, SnapshotOfChangedSizes) {
+  const uintptr_t kBaseAddr = 0x1000000;
+  detector_->RecordAlloc(reinterpret_cast<const void*>(kBaseAddr), 32, 0,
+                         nullptr);
+  detector_->RecordAlloc(reinterpret_cast<const void*>(kBaseAddr + 0x100), 16,
+                         0, nullptr);
+
+  LeakDetectorImpl::AnalysisSnapshot snapshot;
+  InternalVector<InternalLeakReport> reports;
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(InternalVector<int>({16 / 4, 32 / 4}), snapshot.changed_sizes);
+  EXPECT_EQ(InternalVector<uint32_t>({1, 1}), snapshot.net_num_allocs);
+  detector_->AnalyzeSnapshot(&snapshot, false /* do_logging */, &reports);
+
+  // An alloc and a free of the same size leave its net count as it was, but
+  // it is still taken again.
+  detector_->RecordAlloc(reinterpret_cast<const void*>(kBaseAddr + 0x200), 16,
+                         0, nullptr);
+  detector_->RecordFree(reinterpret_cast<const void*>(kBaseAddr + 0x200));
+  detector_->RecordFree(reinterpret_cast<const void*>(kBaseAddr));
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_EQ(InternalVector<int>({16 / 4, 32 / 4}), snapshot.changed_sizes);
+  EXPECT_EQ(InternalVector<uint32_t>({1, 0}), snapshot.net_num_allocs);
+  detector_->AnalyzeSnapshot(&snapshot, false /* do_logging */, &reports);
+
+  detector_->TakeAnalysisSnapshot(&snapshot);
+  EXPECT_TRUE(snapshot.changed_sizes.empty());
+  EXPECT_TRUE(snapshot.net_num_allocs.empty());
+}
+
 }  // namespace leak_detector
@@ -23,10 +23,10 @@ const char* LeakDetectorValueType::ToString(size_t buffer_size,
                                             char* buffer) const {
   switch (type_) {
   case kSize:
-    snprintf(buffer, buffer_size, "%u", size_);
+    snprintf(buffer, buffer_size, "%zu", size_);
     break;
   case kCallStack:
-    snprintf(buffer, buffer_size, "%p", call_stack_);
+    snprintf(buffer, buffer_size, "#%u", call_stack_id_);
     break;
   default:
     snprintf(buffer, buffer_size, "(none)");
@@ -45,7 +45,7 @@ bool LeakDetectorValueType::operator== (
   case kSize:
     return size_ == other.size_;
   case kCallStack:
-    return call_stack_ == other.call_stack_;
+    return call_stack_id_ == other.call_stack_id_;
   default:
     return false;
   }
@@ -60,7 +60,7 @@ bool LeakDetectorValueType::operator< (
   case kSize:
     return size_ < other.size_;
   case kCallStack:
-    return call_stack_ < other.call_stack_;
+    return call_stack_id_ < other.call_stack_id_;
   default:
     return false;
   }
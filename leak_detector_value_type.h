@@ -11,8 +11,6 @@
 namespace leak_detector {
 
 // Used for tracking unique call stacks.
-class CallStack;
-
 class LeakDetectorValueType {
  public:
   // Supported types.
@@ -25,25 +23,29 @@ class LeakDetectorValueType {
   LeakDetectorValueType()
       : type_(kNone),
         size_(0),
-        call_stack_(nullptr) {}
-  explicit LeakDetectorValueType(uint32_t size)
+        call_stack_id_(0) {}
+  explicit LeakDetectorValueType(size_t size)
       : type_(kSize),
         size_(size),
-        call_stack_(nullptr) {}
-  explicit LeakDetectorValueType(const CallStack* call_stack)
-      : type_(kCallStack),
-        size_(0),
-        call_stack_(call_stack) {}
+        call_stack_id_(0) {}
+
+  // Call stacks are identified by the ids given to them by CallStackManager.
+  static LeakDetectorValueType FromCallStackId(uint32_t call_stack_id) {
+    LeakDetectorValueType value;
+    value.type_ = kCallStack;
+    value.call_stack_id_ = call_stack_id;
+    return value;
+  }
 
   // Accessors.
   Type type() const {
     return type_;
   }
-  uint32_t size() const {
+  size_t size() const {
     return size_;
   }
-  const CallStack* call_stack() const {
-    return call_stack_;
+  uint32_t call_stack_id() const {
+    return call_stack_id_;
   }
 
   // Returns a string containing the word that describes the value type of the
@@ -61,8 +63,8 @@ class LeakDetectorValueType {
  private:
   Type type_;
 
-  uint32_t size_;
-  const CallStack* call_stack_;
+  size_t size_;
+  uint32_t call_stack_id_;
 };
 
 }  // namespace leak_detector
@@ -1,28 +1,18 @@
+#include <gperftools/spin_lock_wrapper.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <memory>
+#include <thread>
 
 #include "base/logging.h"
 #include "hooks.h"
 #include "leak_detector.h"
-
-const uint32_t kAllocCode = 0xdeadbeef;
-const uint32_t kFreeCode = 0xcafebabe;
-
-struct AllocEntry {
-  uint32_t code;
-  const void* ptr;
-  uint32_t size;
-  uint32_t depth;
-  const void* const* stack;
-};
-
-struct FreeEntry {
-  uint32_t code;
-  const void* ptr;
-};
+#include "spsc_ring.h"
+#include "trace_reader.h"
 
 static bool DEBUG = getenv("DEBUG");
 
@@ -36,14 +26,34 @@ extern uint64_t default_chrome_size;
 using leak_detector::default_chrome_addr;
 using leak_detector::default_chrome_size;
 
-int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    printf("Need to provide an input file:\n");
-    printf("  %s [FILE].\n", argv[0]);
-    return 0;
-  }
+namespace {
 
-  FILE* fp = fopen(argv[1], "rb");
+// Throughput counters for a single replay.
+struct ReplayStats {
+  uint64_t num_records;
+  uint64_t num_bytes;
+  double seconds;
+};
+
+double NowInSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void PrintReplayStats(const char* reader_name, const ReplayStats& stats) {
+  printf("Finished with %lu bytes read\n", stats.num_bytes);
+  if (stats.seconds <= 0)
+    return;
+  printf("%s: %lu records in %.3f s, %.0f records/s, %.1f MB/s\n",
+         reader_name, stats.num_records, stats.seconds,
+         stats.num_records / stats.seconds,
+         stats.num_bytes / stats.seconds / (1024 * 1024));
+}
+
+// Replays a legacy trace with one fread() per record field.
+void ReplayWithFread(const char* path, ReplayStats* stats) {
+  FILE* fp = fopen(path, "rb");
   CHECK(fp);
   CHECK(!feof(fp));
   CHECK_EQ(1, fread(&default_chrome_addr, sizeof(default_chrome_addr), 1, fp));
@@ -51,6 +61,7 @@ int main(int argc, char* argv[]) {
 
   leak_detector::Initialize();
 
+  double start_time = NowInSeconds();
   while (!feof(fp)) {
     union {
       uint32_t code;
@@ -58,7 +69,8 @@ int main(int argc, char* argv[]) {
       FreeEntry free;
     };
     int entry_offset = ftell(fp);
-    fread(&code, sizeof(code), 1, fp);
+    if (fread(&code, sizeof(code), 1, fp) != 1)
+      break;
     if (code == kAllocCode) {
       fread(&code + 1, sizeof(alloc) - sizeof(code) - sizeof(alloc.stack), 1, fp);
       if (DEBUG) {
@@ -83,10 +95,226 @@ int main(int argc, char* argv[]) {
              ftell(fp) - sizeof(code), code);
       break;
     }
+    ++stats->num_records;
   }
-
-  printf("Finished with %lu bytes read\n", ftell(fp));
+  stats->seconds = NowInSeconds() - start_time;
+  stats->num_bytes = ftell(fp);
   fclose(fp);
+}
+
+// Number of events decoded at a time.
+const size_t kEventBatchSize = 1024;
+
+// Number of batches that the decoder thread can run ahead of the replay.
+const size_t kNumRingBatches = 16;
+
+// A batch of events handed from the decoder thread to the replaying thread.
+struct EventBatch {
+  size_t num_events;
+  // Set on the last batch of the trace, which may be empty.
+  bool is_last;
+  TraceEvent events[kEventBatchSize];
+};
+
+using EventRing = SpscRing<EventBatch, kNumRingBatches>;
+
+// Decodes all remaining blocks of |reader| into |ring|. Runs on the decoder
+// thread. If decoding stops at a bad record, its offset is returned in
+// |*bad_record_offset|.
+void DecodeIntoRing(TraceReader* reader, EventRing* ring,
+                    size_t* bad_record_offset) {
+  TraceBlock block;
+  bool ok = true;
+  while (ok && reader->NextBlock(&block)) {
+    RecordDecoder decoder(block, reader->stacks());
+    while (true) {
+      EventBatch* batch = ring->BeginPush();
+      batch->num_events = decoder.Decode(batch->events, kEventBatchSize);
+      batch->is_last = false;
+      if (batch->num_events == 0)
+        break;
+      ring->EndPush();
+    }
+    if (decoder.error()) {
+      *bad_record_offset = decoder.offset();
+      ok = false;
+    }
+  }
+
+  EventBatch* batch = ring->BeginPush();
+  batch->num_events = 0;
+  batch->is_last = true;
+  ring->EndPush();
+}
+
+// Passes a batch of decoded events to the hooks.
+void ReplayEvents(const TraceEvent* events, size_t num_events) {
+  for (size_t i = 0; i < num_events; ++i) {
+    const TraceEvent& event = events[i];
+    if (event.type == TraceEvent::kAlloc) {
+      if (DEBUG)
+        printf("ALLOC %p\t%zu\t%u\n", event.ptr, event.size, event.depth);
+      void* const* stack = const_cast<void* const*>(event.stack);
+      if (event.has_stack_hash)
+        MallocHook::SetCallerStackTrace(event.depth, stack, event.stack_hash);
+      else
+        MallocHook::SetCallerStackTrace(event.depth, stack);
+      if (event.ptr && event.size)
+        MallocHook::InvokeNewHook(event.ptr, event.size);
+    } else {
+      if (DEBUG)
+        printf("FREE %p\n", event.ptr);
+      MallocHook::InvokeDeleteHook(event.ptr);
+    }
+  }
+}
+
+// Same as ReplayEvents(), but passes the whole batch to the leak detector at
+// once instead of going through the hooks one event at a time.
+void ReplayEventsBatched(const TraceEvent* events, size_t num_events) {
+  leak_detector::HeapEvent heap_events[kEventBatchSize];
+  size_t num_heap_events = 0;
+  for (size_t i = 0; i < num_events; ++i) {
+    const TraceEvent& event = events[i];
+    bool is_alloc = event.type == TraceEvent::kAlloc;
+    if (is_alloc && !(event.ptr && event.size))
+      continue;
+
+    leak_detector::HeapEvent* heap_event = &heap_events[num_heap_events++];
+    heap_event->is_alloc = is_alloc;
+    heap_event->ptr = event.ptr;
+    if (is_alloc) {
+      heap_event->size = event.size;
+      heap_event->stack_depth = event.depth;
+      heap_event->stack = event.stack;
+      heap_event->stack_hash =
+          event.has_stack_hash ? &event.stack_hash : nullptr;
+    }
+  }
+  leak_detector::RecordEvents(heap_events, num_heap_events);
+}
+
+// Replays the trace by walking the records in place in a memory mapping of the
+// file. Call stacks are passed to the hooks directly from the mapping. Reads
+// both legacy and framed traces. If |pipelined| is set, records are decoded on
+// a separate thread, overlapping with the detector's work on this thread. If
+// |batched| is set, each batch is passed to the detector in one call.
+void ReplayMapped(const char* path, bool verify, bool pipelined, bool batched,
+                  ReplayStats* stats) {
+  MappedTraceFile file;
+  CHECK(file.Open(path));
+
+  TraceReader reader;
+  reader.set_verify_checksums(verify);
+  if (!reader.Init(file)) {
+    printf("Could not read trace: %s\n", reader.error());
+    return;
+  }
+  if (!reader.modules().empty()) {
+    default_chrome_addr = reader.modules()[0].addr;
+    default_chrome_size = reader.modules()[0].size;
+  }
+  if (DEBUG) {
+    for (const TraceModule& module : reader.modules()) {
+      printf("Module %.*s at %lx, size %lx\n", module.name_size, module.name,
+             module.addr, module.size);
+    }
+  }
+
+  leak_detector::Initialize();
+
+  auto replay_events = batched ? ReplayEventsBatched : ReplayEvents;
+
+  double start_time = NowInSeconds();
+  if (pipelined) {
+    // Too large for the stack, and over-aligned for operator new in C++11.
+    static EventRing ring;
+    size_t bad_record_offset = 0;
+    std::thread decoder_thread(DecodeIntoRing, &reader, &ring,
+                               &bad_record_offset);
+    while (true) {
+      const EventBatch* batch = ring.BeginPop();
+      if (batch->is_last)
+        break;
+      replay_events(batch->events, batch->num_events);
+      stats->num_records += batch->num_events;
+      ring.EndPop();
+    }
+    decoder_thread.join();
+    if (bad_record_offset)
+      printf("Bad record at offset %lx, quitting\n", bad_record_offset);
+    if (reader.error())
+      printf("Bad trace at offset %lx: %s\n", reader.offset(), reader.error());
+    stats->seconds = NowInSeconds() - start_time;
+    stats->num_bytes = reader.offset();
+    return;
+  }
+
+  TraceEvent events[kEventBatchSize];
+  TraceBlock block;
+  while (reader.NextBlock(&block)) {
+    RecordDecoder decoder(block, reader.stacks());
+    while (size_t num_events = decoder.Decode(events, kEventBatchSize)) {
+      replay_events(events, num_events);
+      stats->num_records += num_events;
+    }
+    if (decoder.error()) {
+      printf("Bad record at offset %lx, quitting\n", decoder.offset());
+      break;
+    }
+  }
+  if (reader.error())
+    printf("Bad trace at offset %lx: %s\n", reader.offset(), reader.error());
+  stats->seconds = NowInSeconds() - start_time;
+  stats->num_bytes = reader.offset();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool use_fread = false;
+  bool verify = false;
+  bool pipelined = false;
+  bool batched = false;
+  int arg = 1;
+  for (; arg < argc - 1; ++arg) {
+    if (strcmp(argv[arg], "--fread") == 0)
+      use_fread = true;
+    else if (strcmp(argv[arg], "--verify") == 0)
+      verify = true;
+    else if (strcmp(argv[arg], "--pipelined") == 0)
+      pipelined = true;
+    else if (strcmp(argv[arg], "--batched") == 0)
+      batched = true;
+    else
+      break;
+  }
+  if (arg != argc - 1) {
+    printf("Need to provide an input file:\n");
+    printf("  %s [--fread] [--verify] [--pipelined] [--batched] [FILE].\n",
+           argv[0]);
+    printf("--fread only reads legacy traces. --verify checks block "
+           "checksums.\n--pipelined decodes records on a separate thread. "
+           "--batched passes records\nto the detector in batches rather than "
+           "through the malloc hooks.\n");
+    return 0;
+  }
+  const char* path = argv[arg];
+
+  ReplayStats stats = {};
+  if (use_fread)
+    ReplayWithFread(path, &stats);
+  else
+    ReplayMapped(path, verify, pipelined, batched, &stats);
+  PrintReplayStats(use_fread ? "fread" : pipelined ? "pipelined" : "mmap",
+                   stats);
+
+  SpinLockStats lock_stats;
+  if (leak_detector::GetHeapLockStats(&lock_stats)) {
+    printf("Heap lock: %lu acquisitions, %lu contended, %.3f ms waiting\n",
+           lock_stats.num_acquisitions, lock_stats.num_contended_acquisitions,
+           lock_stats.total_wait_ns * 1e-6);
+  }
 
   leak_detector::Shutdown();
 
@@ -0,0 +1,65 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/ranked_count_tree.h"
+
+#include <algorithm>
+
+namespace leak_detector {
+
+RankedCountTree::RankedCountTree(size_t size)
+    : counts_(size, 0), num_leaves_(1) {
+  while (num_leaves_ < size)
+    num_leaves_ *= 2;
+  winners_.resize(2 * num_leaves_, -1);
+  for (size_t i = 0; i < size; ++i)
+    winners_[num_leaves_ + i] = i;
+  for (size_t node = num_leaves_ - 1; node > 0; --node)
+    winners_[node] = HigherRanked(winners_[2 * node], winners_[2 * node + 1]);
+}
+
+RankedCountTree::~RankedCountTree() {}
+
+void RankedCountTree::SetCount(size_t index, int32_t count) {
+  counts_[index] = count;
+  for (size_t node = (num_leaves_ + index) / 2; node > 0; node /= 2)
+    winners_[node] = HigherRanked(winners_[2 * node], winners_[2 * node + 1]);
+}
+
+size_t RankedCountTree::GetTopCounts(size_t max_count, int* indices) const {
+  // Subtrees whose winners are candidates for the next highest ranked count,
+  // in a heap ordered by rank. Each count found adds the subtrees along the
+  // path to its leaf, which hold all other counts under its node.
+  std::vector<size_t, Allocator<size_t>> candidates;
+  auto ranks_lower = [this](size_t node_a, size_t node_b) {
+    return HigherRanked(winners_[node_a], winners_[node_b]) !=
+           winners_[node_a];
+  };
+  if (winners_[1] >= 0)
+    candidates.push_back(1);
+
+  size_t num_found = 0;
+  while (num_found < max_count && !candidates.empty()) {
+    std::pop_heap(candidates.begin(), candidates.end(), ranks_lower);
+    size_t node = candidates.back();
+    candidates.pop_back();
+    int winner = winners_[node];
+    indices[num_found++] = winner;
+
+    while (node < num_leaves_) {
+      size_t child = 2 * node;
+      if (winners_[child] != winner)
+        ++child;
+      size_t sibling = child ^ 1;
+      if (winners_[sibling] >= 0) {
+        candidates.push_back(sibling);
+        std::push_heap(candidates.begin(), candidates.end(), ranks_lower);
+      }
+      node = child;
+    }
+  }
+  return num_found;
+}
+
+}  // namespace leak_detector
@@ -0,0 +1,73 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMPONENTS_METRICS_LEAK_DETECTOR_RANKED_COUNT_TREE_H_
+#define COMPONENTS_METRICS_LEAK_DETECTOR_RANKED_COUNT_TREE_H_
+
+#include <gperftools/custom_allocator.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "components/metrics/leak_detector/stl_allocator.h"
+
+namespace leak_detector {
+
+// Array of counts, kept in a tournament tree so that the largest counts can be
+// found without looking at all of them. Changing a count costs O(log size),
+// and finding the largest N counts O(N log size).
+//
+// Counts rank from largest to smallest, and equal counts from lowest to
+// highest index, which is the order in which a RankedList would hold them had
+// they been added to it in index order.
+class RankedCountTree {
+ public:
+  // All |size| counts start out as 0.
+  explicit RankedCountTree(size_t size);
+  ~RankedCountTree();
+
+  size_t size() const { return counts_.size(); }
+
+  int32_t count(size_t index) const { return counts_[index]; }
+  void SetCount(size_t index, int32_t count);
+
+  // Writes to |indices| the indices of the |max_count| highest ranked counts,
+  // in rank order, and returns how many were written. Adding just these counts
+  // to a RankedList of size |max_count|, in the order of |indices|, has the
+  // same result as adding all counts in index order.
+  size_t GetTopCounts(size_t max_count, int* indices) const;
+
+ private:
+  template <typename T>
+  using Allocator = STL_Allocator<T, CustomAllocator>;
+
+  // Returns whichever of the counts with indices |a| and |b| ranks higher. An
+  // index of -1 stands for no count, and ranks lowest.
+  int HigherRanked(int a, int b) const {
+    if (a < 0 || b < 0)
+      return a < 0 ? b : a;
+    if (counts_[a] != counts_[b])
+      return counts_[a] > counts_[b] ? a : b;
+    return a < b ? a : b;
+  }
+
+  std::vector<int32_t, Allocator<int32_t>> counts_;
+
+  // Number of leaves in the tree, a power of two of at least |size()|.
+  size_t num_leaves_;
+
+  // Index of the highest ranked count under each node of the tree, or -1 if
+  // there is none. The root is node 1, the children of node N are 2N and
+  // 2N + 1, and the leaves start at |num_leaves_|, each holding the index of
+  // its count.
+  std::vector<int, Allocator<int>> winners_;
+
+  DISALLOW_COPY_AND_ASSIGN(RankedCountTree);
+};
+
+}  // namespace leak_detector
+
+#endif  // COMPONENTS_METRICS_LEAK_DETECTOR_RANKED_COUNT_TREE_H_
@@ -0,0 +1,122 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/ranked_count_tree.h"
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "base/macros.h"
+#include "components/metrics/leak_detector/leak_detector_value_type.h"
+#include "components/metrics/leak_detector/ranked_list.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Returns the (value, count) pairs of |list|, with values being indices.
+std::vector<std::pair<uint32_t, int>> ListEntries(const RankedList& list) {
+  std::vector<std::pair<uint32_t, int>> entries;
+  for (const RankedList::Entry& entry : list)
+    entries.push_back(std::make_pair(entry.value.size(), entry.count));
+  return entries;
+}
+
+// Checks the top counts of |tree| against those of a RankedList that all
+// counts are added to.
+void CheckTopCounts(const RankedCountTree& tree, size_t max_count) {
+  RankedList all_list(max_count);
+  for (size_t i = 0; i < tree.size(); ++i)
+    all_list.Add(LeakDetectorValueType(i), tree.count(i));
+
+  std::vector<int> indices(max_count);
+  size_t num_top = tree.GetTopCounts(max_count, indices.data());
+  EXPECT_EQ(std::min(max_count, tree.size()), num_top);
+  RankedList top_list(max_count);
+  for (size_t i = 0; i < num_top; ++i)
+    top_list.Add(LeakDetectorValueType(indices[i]), tree.count(indices[i]));
+  EXPECT_EQ(ListEntries(all_list), ListEntries(top_list));
+}
+
+}  // namespace
+
+class RankedCountTreeTest : public ::testing::Test {
+ public:
+  RankedCountTreeTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(RankedCountTreeTest);
+};
+
+TEST_F(RankedCountTreeTest, Empty) {
+  RankedCountTree tree(0);
+  int index;
+  EXPECT_EQ(0U, tree.GetTopCounts(1, &index));
+}
+
+TEST_F(RankedCountTreeTest, AllZero) {
+  // Equal counts rank by index.
+  RankedCountTree tree(100);
+  int indices[3];
+  ASSERT_EQ(3U, tree.GetTopCounts(3, indices));
+  EXPECT_EQ(0, indices[0]);
+  EXPECT_EQ(1, indices[1]);
+  EXPECT_EQ(2, indices[2]);
+}
+
+TEST_F(RankedCountTreeTest, SetCount) {
+  RankedCountTree tree(5);
+  tree.SetCount(3, 10);
+  tree.SetCount(1, 20);
+  tree.SetCount(4, 10);
+  tree.SetCount(0, -1);
+  EXPECT_EQ(10, tree.count(3));
+
+  int indices[5];
+  ASSERT_EQ(5U, tree.GetTopCounts(5, indices));
+  EXPECT_EQ(1, indices[0]);
+  EXPECT_EQ(3, indices[1]);
+  EXPECT_EQ(4, indices[2]);
+  EXPECT_EQ(2, indices[3]);
+  EXPECT_EQ(0, indices[4]);
+
+  // Lowering the largest count moves it down.
+  tree.SetCount(1, 0);
+  ASSERT_EQ(2U, tree.GetTopCounts(2, indices));
+  EXPECT_EQ(3, indices[0]);
+  EXPECT_EQ(4, indices[1]);
+}
+
+TEST_F(RankedCountTreeTest, Random) {
+  std::mt19937 random(1);
+  // Sizes that do and do not fill up the tree's leaves.
+  for (size_t size : {1, 2, 7, 64, 2200}) {
+    RankedCountTree tree(size);
+    for (int round = 0; round < 20; ++round) {
+      // Narrow ranges make for many ties.
+      int32_t range = round % 2 ? 5 : 1000000;
+      for (size_t n = 0; n < size / 4 + 1; ++n) {
+        tree.SetCount(random() % size,
+                      static_cast<int32_t>(random() % (2 * range)) - range / 2);
+      }
+      CheckTopCounts(tree, 16);
+      CheckTopCounts(tree, 1);
+      CheckTopCounts(tree, 100);
+    }
+  }
+}
+
+}  // namespace leak_detector
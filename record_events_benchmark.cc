@@ -0,0 +1,194 @@
+// Measures how fast allocs and frees are recorded from several threads at once,
+// each passing the same kind of event stream to the leak detector in one of two
+// ways, as the replay tool does:
+//   - per event: one at a time to the malloc hooks, as by default;
+//   - batched: in batches to leak_detector::RecordEvents(), as with --batched.
+// For each, prints the number of events recorded per second, and how often the
+// threads had to wait for the heap lock. Part of the allocs are of one size
+// from one call stack that are never freed, so that the size gets a stack table
+// and its call stacks are hashed.
+//
+// Configured by the same LEAK_DETECTOR_* environment variables as the leak
+// detector, e.g. LEAK_DETECTOR_SAMPLING_FACTOR=256 to sample every event, or
+// LEAK_DETECTOR_THREAD_BUFFERS=1 for the hooks to buffer events per thread.
+
+#include <gperftools/spin_lock_wrapper.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <initializer_list>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "base/macros.h"
+#include "hooks.h"
+#include "leak_detector.h"
+
+namespace {
+
+const int kNumThreads[] = {1, 2, 4, 8};
+
+// How each thread passes its events to the leak detector.
+enum Mode {
+  kPerEvent,
+  kBatched,
+};
+
+const char* const kModeNames[] = {"per-event", "batched"};
+
+// Events recorded by each thread, in batches of this many.
+const size_t kEventsPerThread = 1000000;
+const size_t kBatchSize = 1024;
+
+// Call stacks that allocs come from.
+const int kDepth = 16;
+const size_t kNumStacks = 1000;
+
+// Each thread keeps about this many allocs live, plus the leaked ones.
+const size_t kNumLiveAllocs = 4096;
+
+// One alloc in this many is leaked.
+const size_t kLeakInterval = 64;
+const size_t kLeakSize = 48;
+
+const size_t kSizes[] = {16, 24, 32, 48, 64, 96, 128, 256, 512, 1024, 4096};
+
+// |kNumStacks| call stacks, followed by that of the leak.
+std::vector<const void*> g_stacks;
+
+const void* const* GetStack(size_t index) {
+  return &g_stacks[index * kDepth];
+}
+
+// Passes |num_events| events to the malloc hooks one at a time.
+void InvokeHooks(const leak_detector::HeapEvent* events, size_t num_events) {
+  for (size_t i = 0; i < num_events; ++i) {
+    const leak_detector::HeapEvent& event = events[i];
+    if (event.is_alloc) {
+      MallocHook::SetCallerStackTrace(
+          event.stack_depth, const_cast<void* const*>(event.stack));
+      MallocHook::InvokeNewHook(event.ptr, event.size);
+    } else {
+      MallocHook::InvokeDeleteHook(event.ptr);
+    }
+  }
+}
+
+// Records events of the thread with |thread_index| in run |run_index|, and
+// returns the allocs that it leaves live in |live|. Each thread of each run
+// allocates at addresses of its own.
+void ThreadMain(Mode mode,
+                int run_index,
+                int thread_index,
+                std::vector<const void*>* live_allocs) {
+  std::mt19937 rng(thread_index);
+  uintptr_t next_addr =
+      (static_cast<uintptr_t>(run_index) * 16 + thread_index + 1) << 36;
+  std::vector<const void*>& live = *live_allocs;
+  std::vector<const void*> leaked;
+  leak_detector::HeapEvent events[kBatchSize];
+  for (size_t n = 0; n < kEventsPerThread; n += kBatchSize) {
+    for (size_t i = 0; i < kBatchSize; ++i) {
+      leak_detector::HeapEvent* event = &events[i];
+      event->is_alloc =
+          live.size() < kNumLiveAllocs / 2 ||
+          (live.size() < kNumLiveAllocs && rng() % 2);
+      if (!event->is_alloc) {
+        size_t index = rng() % live.size();
+        event->ptr = live[index];
+        live[index] = live.back();
+        live.pop_back();
+        continue;
+      }
+      event->ptr = reinterpret_cast<const void*>(next_addr += 64);
+      event->stack_depth = kDepth;
+      event->stack_hash = nullptr;
+      if ((n + i) % kLeakInterval == 0) {
+        event->size = kLeakSize;
+        event->stack = GetStack(kNumStacks);
+        leaked.push_back(event->ptr);
+      } else {
+        event->size = kSizes[rng() % (sizeof(kSizes) / sizeof(kSizes[0]))];
+        event->stack = GetStack(rng() % kNumStacks);
+        live.push_back(event->ptr);
+      }
+    }
+    if (mode == kBatched)
+      leak_detector::RecordEvents(events, kBatchSize);
+    else
+      InvokeHooks(events, kBatchSize);
+  }
+  live.insert(live.end(), leaked.begin(), leaked.end());
+}
+
+// Frees |allocs|, so that the next run starts with the detector in the same
+// state rather than slowed down by the leaks of earlier runs.
+void FreeAllocs(const std::vector<const void*>& allocs) {
+  leak_detector::HeapEvent events[kBatchSize];
+  for (size_t n = 0; n < allocs.size(); n += kBatchSize) {
+    size_t num_events = std::min(kBatchSize, allocs.size() - n);
+    for (size_t i = 0; i < num_events; ++i) {
+      events[i].is_alloc = false;
+      events[i].ptr = allocs[n + i];
+    }
+    leak_detector::RecordEvents(events, num_events);
+  }
+}
+
+double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+}  // namespace
+
+int main(int /* argc */, char* /* argv */[]) {
+  for (uintptr_t i = 0; i < (kNumStacks + 1) * kDepth; ++i)
+    g_stacks.push_back(reinterpret_cast<const void*>(0x400000 + i * 16));
+
+  leak_detector::Initialize();
+  SpinLockStats stats;
+  if (!leak_detector::GetHeapLockStats(&stats)) {
+    printf("The leak detector is not enabled.\n");
+    return 1;
+  }
+
+  printf("%u CPUs.\n%9s %7s %12s %12s %12s %12s\n",
+         std::thread::hardware_concurrency(), "mode", "threads", "M events/s",
+         "lock takes", "contended", "wait ms");
+  int run_index = 0;
+  for (Mode mode : {kPerEvent, kBatched}) {
+    for (int num_threads : kNumThreads) {
+      SpinLockStats start_stats;
+      leak_detector::GetHeapLockStats(&start_stats);
+      double start_time = NowSeconds();
+      std::vector<std::thread> threads;
+      std::vector<std::vector<const void*>> live_allocs(num_threads);
+      for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back(ThreadMain, mode, run_index, t,
+                             &live_allocs[t]);
+      }
+      for (std::thread& thread : threads)
+        thread.join();
+      double seconds = NowSeconds() - start_time;
+      ++run_index;
+
+      leak_detector::GetHeapLockStats(&stats);
+      for (const std::vector<const void*>& allocs : live_allocs)
+        FreeAllocs(allocs);
+      printf("%9s %7d %12.2f %12lu %12lu %12.3f\n", kModeNames[mode],
+             num_threads, num_threads * kEventsPerThread / seconds * 1e-6,
+             stats.num_acquisitions - start_stats.num_acquisitions,
+             stats.num_contended_acquisitions -
+                 start_stats.num_contended_acquisitions,
+             (stats.total_wait_ns - start_stats.total_wait_ns) * 1e-6);
+    }
+  }
+
+  leak_detector::Shutdown();
+  return 0;
+}
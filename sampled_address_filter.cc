@@ -0,0 +1,36 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "components/metrics/leak_detector/sampled_address_filter.h"
+
+namespace leak_detector {
+
+SampledAddressFilter::SampledAddressFilter() : current_(0) {
+  for (auto& bitmap : bitmaps_) {
+    for (std::atomic<uint64_t>& word : bitmap)
+      word.store(0, std::memory_order_relaxed);
+  }
+}
+
+SampledAddressFilter::~SampledAddressFilter() {}
+
+void SampledAddressFilter::StartNewGeneration() {
+  int next = 1 - current_.load(std::memory_order_relaxed);
+  for (std::atomic<uint64_t>& word : bitmaps_[next])
+    word.store(0, std::memory_order_relaxed);
+}
+
+void SampledAddressFilter::AddToNewGeneration(const void* ptr) {
+  size_t bit = Hash(ptr);
+  int next = 1 - current_.load(std::memory_order_relaxed);
+  bitmaps_[next][bit / 64].fetch_or(1ULL << (bit % 64),
+                                    std::memory_order_relaxed);
+}
+
+void SampledAddressFilter::FinishNewGeneration() {
+  current_.store(1 - current_.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+}
+
+}  // namespace leak_detector
@@ -0,0 +1,77 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef COMPONENTS_METRICS_LEAK_DETECTOR_SAMPLED_ADDRESS_FILTER_H_
+#define COMPONENTS_METRICS_LEAK_DETECTOR_SAMPLED_ADDRESS_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "base/macros.h"
+
+namespace leak_detector {
+
+// Remembers which addresses were sampled when allocated, so that only their
+// frees need to be recorded. Needed when whether an alloc is sampled does not
+// depend on its address alone. Lookups may give false positives, which only
+// cost an unnecessary RecordFree(), but never false negatives.
+//
+// Consists of two bitmaps indexed by a hash of the address. Add() sets bits in
+// the current one, and MayContain() checks both. StartNewGeneration() clears
+// the other one, and makes it current after the caller has added every address
+// that is still live. Without this, the bitmaps would fill up over time. An
+// address that is added but not yet known to the caller at the time of a new
+// generation is still found until the next one.
+//
+// Add() and MayContain() may be called concurrently with each other and with
+// the generation functions. The generation functions must not be called
+// concurrently with each other.
+class SampledAddressFilter {
+ public:
+  SampledAddressFilter();
+  ~SampledAddressFilter();
+
+  void Add(const void* ptr) {
+    size_t bit = Hash(ptr);
+    bitmaps_[current_.load(std::memory_order_relaxed)][bit / 64].fetch_or(
+        1ULL << (bit % 64), std::memory_order_relaxed);
+  }
+
+  bool MayContain(const void* ptr) const {
+    size_t bit = Hash(ptr);
+    uint64_t mask = 1ULL << (bit % 64);
+    return ((bitmaps_[0][bit / 64].load(std::memory_order_relaxed) |
+             bitmaps_[1][bit / 64].load(std::memory_order_relaxed)) &
+            mask) != 0;
+  }
+
+  // Clears the non-current bitmap. Live addresses must then be added with
+  // AddToNewGeneration(), before calling FinishNewGeneration().
+  void StartNewGeneration();
+  void AddToNewGeneration(const void* ptr);
+  void FinishNewGeneration();
+
+ private:
+  static const int kNumBitsLog2 = 20;
+  static const size_t kNumWords = (1 << kNumBitsLog2) / 64;
+
+  static size_t Hash(const void* ptr) {
+    // Same multiplier as the pointer sampling in leak_detector.cc.
+    return (reinterpret_cast<uint64_t>(ptr) * 0x9ddfea08eb382d69ULL) >>
+           (64 - kNumBitsLog2);
+  }
+
+  std::atomic<uint64_t> bitmaps_[2][kNumWords];
+
+  // Index of the bitmap that Add() sets bits in.
+  std::atomic<int> current_;
+
+  DISALLOW_COPY_AND_ASSIGN(SampledAddressFilter);
+};
+
+}  // namespace leak_detector
+
+#endif  // COMPONENTS_METRICS_LEAK_DETECTOR_SAMPLED_ADDRESS_FILTER_H_
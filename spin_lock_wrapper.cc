@@ -4,14 +4,116 @@
 
 #include <gperftools/spin_lock_wrapper.h>
 
-SpinLockWrapper::SpinLockWrapper() {
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace {
+
+// Upper bound on the number of times to spin before sleeping.
+const int kMaxSpins = 1000;
+
+static_assert(sizeof(std::atomic<int>) == sizeof(int),
+              "The futex syscall operates on a plain int.");
+
+void FutexWait(std::atomic<int>* word, int expected_value) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE,
+          expected_value, nullptr, nullptr, 0);
+}
+
+void FutexWakeOne(std::atomic<int>* word) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, 1,
+          nullptr, nullptr, 0);
+}
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+uint64_t NowInNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Adds |value| to |counter|. Only one thread at a time may do so.
+inline void IncrementBy(std::atomic<uint64_t>* counter, uint64_t value) {
+  counter->store(counter->load(std::memory_order_relaxed) + value,
+                 std::memory_order_relaxed);
+}
+
+}  // namespace
+
+SpinLockWrapper::SpinLockWrapper()
+    : state_(0),
+      average_spins_(0),
+      num_acquisitions_(0),
+      num_contended_acquisitions_(0),
+      total_wait_ns_(0) {
 }
 
 SpinLockWrapper::~SpinLockWrapper() {
 }
 
 void SpinLockWrapper::Lock() {
+  int unlocked = 0;
+  if (!state_.compare_exchange_strong(unlocked, 1, std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+    LockSlow();
+  }
+  IncrementBy(&num_acquisitions_, 1);
 }
 
 void SpinLockWrapper::Unlock() {
+  if (state_.exchange(0, std::memory_order_release) == 2)
+    FutexWakeOne(&state_);
+}
+
+void SpinLockWrapper::GetStats(SpinLockStats* stats) const {
+  stats->num_acquisitions = num_acquisitions_.load(std::memory_order_relaxed);
+  stats->num_contended_acquisitions =
+      num_contended_acquisitions_.load(std::memory_order_relaxed);
+  stats->total_wait_ns = total_wait_ns_.load(std::memory_order_relaxed);
+}
+
+void SpinLockWrapper::LockSlow() {
+  uint64_t start_ns = NowInNanoseconds();
+
+  // Spin for up to twice as long as it has recently taken to get the lock.
+  int average_spins = average_spins_.load(std::memory_order_relaxed);
+  int max_spins = std::min(kMaxSpins, average_spins * 2 + 10);
+  bool acquired = false;
+  int spins = 0;
+  while (spins < max_spins) {
+    ++spins;
+    CpuRelax();
+    int unlocked = 0;
+    if (state_.load(std::memory_order_relaxed) == 0 &&
+        state_.compare_exchange_weak(unlocked, 1, std::memory_order_acquire,
+                                     std::memory_order_relaxed)) {
+      acquired = true;
+      break;
+    }
+  }
+
+  average_spins_.store(average_spins + (spins - average_spins) / 8,
+                       std::memory_order_relaxed);
+
+  if (!acquired) {
+    // Mark the lock as having sleepers before going to sleep, so that the
+    // holder wakes one of them up. As it isn't known whether other threads are
+    // still asleep, the lock stays marked once acquired here.
+    while (state_.exchange(2, std::memory_order_acquire) != 0)
+      FutexWait(&state_, 2);
+  }
+
+  IncrementBy(&num_contended_acquisitions_, 1);
+  IncrementBy(&total_wait_ns_, NowInNanoseconds() - start_ns);
 }
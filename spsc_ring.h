@@ -0,0 +1,74 @@
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <sched.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#include "base/macros.h"
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Slots are filled and drained in place, so large elements such as
+// batches of records are never copied.
+//
+// Producer:                        Consumer:
+//   T* slot = ring.BeginPush();      const T* slot = ring.BeginPop();
+//   ... fill *slot ...               ... use *slot ...
+//   ring.EndPush();                  ring.EndPop();
+template <typename T, size_t kCapacity>
+class SpscRing {
+ public:
+  SpscRing() : head_(0), tail_(0) {}
+
+  // Returns the next free slot, waiting for the consumer if the ring is full.
+  T* BeginPush() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    for (int spins = 0; tail - head_.load(std::memory_order_acquire) ==
+                        kCapacity; ++spins) {
+      Pause(spins);
+    }
+    return &slots_[tail % kCapacity];
+  }
+
+  // Publishes the slot returned by BeginPush() to the consumer.
+  void EndPush() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  // Returns the oldest published slot, waiting for the producer if the ring
+  // is empty.
+  T* BeginPop() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    for (int spins = 0; tail_.load(std::memory_order_acquire) == head;
+         ++spins) {
+      Pause(spins);
+    }
+    return &slots_[head % kCapacity];
+  }
+
+  // Hands the slot returned by BeginPop() back to the producer.
+  void EndPop() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+ private:
+  // Spin briefly, then start giving up the CPU so that a stalled peer on the
+  // same core can make progress.
+  static void Pause(int spins) {
+    if (spins > 64)
+      sched_yield();
+  }
+
+  // The indices only ever increase. They live on separate cache lines so that
+  // the two threads don't contend on them.
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  alignas(64) T slots_[kCapacity];
+
+  DISALLOW_COPY_AND_ASSIGN(SpscRing);
+};
+
+#endif  // SPSC_RING_H_
@@ -0,0 +1,95 @@
+#include "stack_unwinder.h"
+
+#include <pthread.h>
+
+#include "base/hash.h"
+
+namespace {
+
+// Top of the calling thread's stack, looked up once per thread.
+struct ThreadStackBounds {
+  enum State {
+    kUnknown,
+    kLookingUp,
+    kKnown,
+    kUnavailable,
+  };
+
+  State state;
+
+  // One past the highest address of the stack, if |state| is kKnown.
+  uintptr_t high;
+};
+
+__thread ThreadStackBounds t_stack_bounds;
+
+// Returns one past the highest address of the calling thread's stack, or 0 if
+// it is not known.
+uintptr_t GetStackHigh() {
+  ThreadStackBounds* bounds = &t_stack_bounds;
+  if (bounds->state == ThreadStackBounds::kKnown)
+    return bounds->high;
+  if (bounds->state != ThreadStackBounds::kUnknown)
+    return 0;
+
+  // pthread_getattr_np() may allocate, e.g. to read /proc/self/maps for the
+  // main thread. Unwinds from within it find the lookup in progress, and return
+  // no frames.
+  bounds->state = ThreadStackBounds::kLookingUp;
+  bounds->high = 0;
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+      bounds->high = reinterpret_cast<uintptr_t>(addr) + size;
+    pthread_attr_destroy(&attr);
+  }
+  bounds->state = bounds->high ? ThreadStackBounds::kKnown
+                               : ThreadStackBounds::kUnavailable;
+  return bounds->high;
+}
+
+}  // namespace
+
+// Not inlined, so that it has its own frame to start the walk from.
+__attribute__((noinline))
+int UnwindFramePointers(void* stack[], int max_depth, int skip, uint32_t* hash) {
+  uint32_t hash_state = 0;
+  int depth = 0;
+
+  // Live frame records lie between this frame and the top of the stack. Each
+  // holds the caller's frame pointer, followed by the return address.
+  void** frame = static_cast<void**>(__builtin_frame_address(0));
+  uintptr_t low = reinterpret_cast<uintptr_t>(frame);
+  uintptr_t high = GetStackHigh();
+  while (depth < max_depth) {
+    uintptr_t frame_addr = reinterpret_cast<uintptr_t>(frame);
+    if (frame_addr < low || frame_addr + 2 * sizeof(void*) > high ||
+        frame_addr % sizeof(void*) != 0) {
+      break;
+    }
+    void* return_addr = frame[1];
+    if (!return_addr)
+      break;
+    if (skip > 0) {
+      --skip;
+    } else {
+      stack[depth++] = return_addr;
+      hash_state =
+          base::HashStep(hash_state, &return_addr, sizeof(return_addr));
+    }
+
+    // Callers' frames are further up the stack. Anything else is not a frame
+    // pointer.
+    void** next_frame = static_cast<void**>(frame[0]);
+    if (next_frame <= frame)
+      break;
+    frame = next_frame;
+  }
+
+  // The frames are hashed in whole words, so this equals base::Hash() of
+  // |stack|.
+  *hash = base::HashFinish(hash_state);
+  return depth;
+}
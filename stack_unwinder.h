@@ -0,0 +1,17 @@
+#ifndef STACK_UNWINDER_H_
+#define STACK_UNWINDER_H_
+
+#include <stdint.h>
+
+// Fills |stack| with the return addresses of up to |max_depth| frames of the
+// calling thread, found by following frame pointers, and returns how many were
+// found. With |skip| = 0, the first frame is that of the function calling
+// UnwindFramePointers(); each |skip| drops one more frame off the top.
+//
+// Every frame record is checked to lie within the thread's stack before it is
+// read, so a frame of code built without frame pointers ends the walk early
+// rather than faulting. Also returns base::Hash() of the returned frames in
+// |hash|, computed as the frames are found.
+int UnwindFramePointers(void* stack[], int max_depth, int skip, uint32_t* hash);
+
+#endif  // STACK_UNWINDER_H_
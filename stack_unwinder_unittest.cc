@@ -0,0 +1,182 @@
+#include "stack_unwinder.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <thread>
+
+#include "base/hash.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+const int kMaxDepth = 64;
+
+// Filled in by UnwindFromNestedCalls() and UnwindWithFramePointer().
+struct Unwind {
+  void* stack[kMaxDepth];
+  int depth;
+  uint32_t hash;
+
+  // Return address of the function that called UnwindFramePointers(), i.e. the
+  // second frame found with |skip| = 0.
+  void* caller_return_addr;
+};
+
+// Keeps the calls below from being inlined into or tail-called by their
+// callers, which would merge their frames.
+#define KEEP_FRAME() asm volatile("" ::: "memory")
+
+__attribute__((noinline))
+void UnwindHere(int max_depth, int skip, Unwind* unwind) {
+  unwind->depth =
+      UnwindFramePointers(unwind->stack, max_depth, skip, &unwind->hash);
+  unwind->caller_return_addr = __builtin_return_address(0);
+  KEEP_FRAME();
+}
+
+__attribute__((noinline))
+void UnwindFromNestedCalls2(int max_depth, int skip, Unwind* unwind) {
+  UnwindHere(max_depth, skip, unwind);
+  KEEP_FRAME();
+}
+
+__attribute__((noinline))
+void UnwindFromNestedCalls(int max_depth, int skip, Unwind* unwind) {
+  UnwindFromNestedCalls2(max_depth, skip, unwind);
+  KEEP_FRAME();
+}
+
+// Unwinds with the saved frame pointer of this function's frame temporarily
+// replaced by |frame_pointer|, so that the walk reaches it after two frames.
+__attribute__((noinline))
+void UnwindWithFramePointer(void* frame_pointer, Unwind* unwind) {
+  void* volatile* frame =
+      static_cast<void* volatile*>(__builtin_frame_address(0));
+  void* saved_frame_pointer = frame[0];
+  frame[0] = frame_pointer;
+  unwind->depth =
+      UnwindFramePointers(unwind->stack, kMaxDepth, 0, &unwind->hash);
+  frame[0] = saved_frame_pointer;
+  KEEP_FRAME();
+}
+
+// Returns one past the highest address of the calling thread's stack.
+uintptr_t GetStackHigh() {
+  pthread_attr_t attr;
+  EXPECT_EQ(0, pthread_getattr_np(pthread_self(), &attr));
+  void* addr;
+  size_t size;
+  EXPECT_EQ(0, pthread_attr_getstack(&attr, &addr, &size));
+  pthread_attr_destroy(&attr);
+  return reinterpret_cast<uintptr_t>(addr) + size;
+}
+
+uint32_t HashFrames(const Unwind& unwind) {
+  return base::Hash(unwind.stack, sizeof(*unwind.stack) * unwind.depth);
+}
+
+}  // namespace
+
+// Each test below unwinds from a single call site, so that the frames in the
+// test itself are the same for every unwind.
+
+TEST(StackUnwinderTest, Skip) {
+  const int kNumSkips = 4;
+  Unwind unwinds[kNumSkips];
+  for (int skip = 0; skip < kNumSkips; ++skip)
+    UnwindFromNestedCalls(kMaxDepth, skip, &unwinds[skip]);
+
+  const Unwind& full = unwinds[0];
+  ASSERT_GE(full.depth, kNumSkips);
+  ASSERT_LT(full.depth, kMaxDepth);
+  // The first frame is in UnwindHere(), and the second in its caller.
+  EXPECT_EQ(full.caller_return_addr, full.stack[1]);
+
+  for (int skip = 1; skip < kNumSkips; ++skip) {
+    const Unwind& skipped = unwinds[skip];
+    ASSERT_EQ(full.depth - skip, skipped.depth);
+    for (int i = 0; i < skipped.depth; ++i)
+      EXPECT_EQ(full.stack[i + skip], skipped.stack[i]);
+  }
+
+  // Skipping more frames than there are returns none.
+  Unwind none;
+  UnwindFromNestedCalls(kMaxDepth, kMaxDepth, &none);
+  EXPECT_EQ(0, none.depth);
+}
+
+TEST(StackUnwinderTest, HashOfReturnedFrames) {
+  for (int skip = 0; skip <= 2; ++skip) {
+    Unwind unwind;
+    UnwindFromNestedCalls(kMaxDepth, skip, &unwind);
+    EXPECT_EQ(HashFrames(unwind), unwind.hash);
+  }
+
+  for (int max_depth = 0; max_depth <= 3; ++max_depth) {
+    Unwind unwind;
+    UnwindFromNestedCalls(max_depth, 1, &unwind);
+    EXPECT_EQ(max_depth, unwind.depth);
+    EXPECT_EQ(HashFrames(unwind), unwind.hash);
+  }
+}
+
+TEST(StackUnwinderTest, MaxDepth) {
+  const int kMaxDepths[] = {kMaxDepth, 0, 1, 2, 3};
+  const int kNumUnwinds = sizeof(kMaxDepths) / sizeof(kMaxDepths[0]);
+  Unwind unwinds[kNumUnwinds];
+  for (int i = 0; i < kNumUnwinds; ++i) {
+    for (void*& frame : unwinds[i].stack)
+      frame = nullptr;
+    UnwindFromNestedCalls(kMaxDepths[i], 0, &unwinds[i]);
+  }
+
+  const Unwind& full = unwinds[0];
+  ASSERT_GT(full.depth, 3);
+  for (int i = 1; i < kNumUnwinds; ++i) {
+    const Unwind& unwind = unwinds[i];
+    ASSERT_EQ(kMaxDepths[i], unwind.depth);
+    for (int j = 0; j < unwind.depth; ++j)
+      EXPECT_EQ(full.stack[j], unwind.stack[j]);
+    // Nothing is written past |max_depth| frames.
+    EXPECT_EQ(nullptr, unwind.stack[unwind.depth]);
+  }
+}
+
+TEST(StackUnwinderTest, StopsAtFramePointerOutsideStack) {
+  // The first frame pointer is the real one. The others are at and just below
+  // the top of the stack, where a frame record would not fit, and into static
+  // data, which is not on the stack. None of those is read; the walk ends after
+  // the frame that points there.
+  static void* static_frame[2];
+  void* frame_pointers[] = {
+      __builtin_frame_address(0),
+      reinterpret_cast<void*>(GetStackHigh()),
+      reinterpret_cast<void*>(GetStackHigh() - sizeof(void*)),
+      static_frame,
+  };
+  const int kNumUnwinds = sizeof(frame_pointers) / sizeof(frame_pointers[0]);
+  Unwind unwinds[kNumUnwinds];
+  for (int i = 0; i < kNumUnwinds; ++i)
+    UnwindWithFramePointer(frame_pointers[i], &unwinds[i]);
+
+  const Unwind& full = unwinds[0];
+  ASSERT_GT(full.depth, 2);
+  for (int i = 1; i < kNumUnwinds; ++i) {
+    const Unwind& unwind = unwinds[i];
+    ASSERT_EQ(2, unwind.depth);
+    EXPECT_EQ(full.stack[0], unwind.stack[0]);
+    EXPECT_EQ(full.stack[1], unwind.stack[1]);
+    EXPECT_EQ(HashFrames(unwind), unwind.hash);
+  }
+}
+
+TEST(StackUnwinderTest, StopsAtTopOfThreadStack) {
+  Unwind unwind;
+  std::thread thread(&UnwindFromNestedCalls, kMaxDepth, 0, &unwind);
+  thread.join();
+  EXPECT_GE(unwind.depth, 3);
+  EXPECT_LT(unwind.depth, kMaxDepth);
+  EXPECT_EQ(HashFrames(unwind), unwind.hash);
+}
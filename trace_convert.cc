@@ -0,0 +1,104 @@
+// Converts a trace, including a legacy trace without a header, to the current
+// trace format.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "base/logging.h"
+#include "trace_reader.h"
+#include "trace_writer.h"
+
+namespace {
+
+// Number of events decoded at a time.
+const size_t kEventBatchSize = 1024;
+
+void PrintUsage(const char* program) {
+  printf("Converts a trace file to the current trace format:\n");
+  printf("  %s [--raw|--stack-ids] [INPUT] [OUTPUT].\n", program);
+  printf("By default, records are written in the compact encoding. --raw "
+         "stores call\nstacks inline. --stack-ids writes fixed-size records "
+         "that refer to a stack\ndictionary.\n");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  TraceEncoding encoding = kTraceEncodingCompact;
+  int arg = 1;
+  if (argc == 4) {
+    if (strcmp(argv[arg], "--raw") == 0) {
+      encoding = kTraceEncodingRawRecords;
+    } else if (strcmp(argv[arg], "--stack-ids") == 0) {
+      encoding = kTraceEncodingStackIds;
+    } else {
+      PrintUsage(argv[0]);
+      return 0;
+    }
+    ++arg;
+  }
+  if (argc - arg != 2) {
+    PrintUsage(argv[0]);
+    return 0;
+  }
+  const char* input_path = argv[arg];
+  const char* output_path = argv[arg + 1];
+
+  MappedTraceFile file;
+  if (!file.Open(input_path)) {
+    printf("Could not open %s\n", input_path);
+    return 1;
+  }
+  TraceReader reader;
+  reader.set_verify_checksums(true);
+  if (!reader.Init(file)) {
+    printf("Could not read %s: %s\n", input_path, reader.error());
+    return 1;
+  }
+
+  FILE* fp = fopen(output_path, "wb");
+  if (!fp) {
+    printf("Could not open %s for writing\n", output_path);
+    return 1;
+  }
+
+  TraceWriter writer(fp, encoding);
+  for (const TraceModule& module : reader.modules()) {
+    std::string name(module.name ? module.name : "", module.name_size);
+    writer.AddModule(module.addr, module.size, name.c_str());
+  }
+  writer.WriteHeader();
+
+  TraceEvent events[kEventBatchSize];
+  TraceBlock block;
+  bool ok = true;
+  while (ok && reader.NextBlock(&block)) {
+    RecordDecoder decoder(block, reader.stacks());
+    while (size_t num_events = decoder.Decode(events, kEventBatchSize)) {
+      for (size_t i = 0; i < num_events; ++i) {
+        const TraceEvent& event = events[i];
+        if (event.type == TraceEvent::kAlloc)
+          writer.AddAlloc(event.ptr, event.size, event.depth, event.stack);
+        else
+          writer.AddFree(event.ptr);
+      }
+    }
+    if (decoder.error()) {
+      printf("Bad record at offset %lx, stopping\n", decoder.offset());
+      ok = false;
+    }
+  }
+  if (reader.error()) {
+    printf("Bad trace at offset %lx: %s\n", reader.offset(), reader.error());
+    ok = false;
+  }
+
+  if (!writer.Finish() || fclose(fp) != 0) {
+    printf("Could not write %s\n", output_path);
+    return 1;
+  }
+  printf("Wrote %lu records to %s\n", writer.num_records(), output_path);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+#ifndef TRACE_FORMAT_H_
+#define TRACE_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary layout of the alloc/free traces replayed by the leak tool.
+//
+// A trace starts with a TraceFileHeader, followed by |num_modules|
+// TraceModuleEntry records, followed by a sequence of blocks. Each block is a
+// TraceBlockHeader followed by |payload_size| bytes of payload, padded to
+// kTraceAlignment. All integers are in the byte order and pointer width of the
+// host that wrote the trace, which are recorded in the file header so that a
+// reader can reject traces it cannot decode.
+//
+// Legacy traces have no header. They start with the address and size of the
+// main binary as two uint64_t values, followed by raw records.
+
+const uint32_t kAllocCode = 0xdeadbeef;
+const uint32_t kFreeCode = 0xcafebabe;
+
+// Layout of the raw records. The records are written out straight from memory,
+// so they follow the host's struct layout. An alloc record is immediately
+// followed by |depth| stack frames, which start where |stack| would be in
+// memory.
+struct AllocEntry {
+  uint32_t code;
+  const void* ptr;
+  uint32_t size;
+  uint32_t depth;
+  const void* const* stack;
+};
+
+struct FreeEntry {
+  uint32_t code;
+  const void* ptr;
+};
+
+// Size of a raw alloc record, not including its stack frames.
+const size_t kAllocEntryHeaderSize = offsetof(AllocEntry, stack);
+
+// An alloc record that refers to its call stack by id, as defined in a stack
+// dictionary block earlier in the trace.
+struct AllocByStackIdEntry {
+  uint32_t code;
+  uint32_t stack_id;
+  const void* ptr;
+  uint64_t size;
+};
+
+const char kTraceMagic[8] = { 'L', 'E', 'A', 'K', 'T', 'R', 'C', 'E' };
+// Version 2 added stack dictionary blocks. Version 3 added compact record
+// blocks.
+const uint32_t kTraceVersion = 3;
+
+// Written as a native integer. Reads back byte-swapped on a foreign host.
+const uint32_t kTraceByteOrderMark = 0x01020304;
+
+// Headers, module names and block payloads all start on this boundary.
+const size_t kTraceAlignment = 8;
+
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t pointer_size;
+  uint32_t num_modules;
+  // Offset of the first block from the start of the file.
+  uint64_t header_size;
+};
+
+// Describes a mapped binary. The first module is the main executable. The
+// module name follows the entry, padded to kTraceAlignment.
+struct TraceModuleEntry {
+  uint64_t addr;
+  uint64_t size;
+  uint32_t name_size;
+  uint32_t reserved;
+};
+
+const uint32_t kTraceBlockMagic = 0x4b4c4221;  // "!BLK"
+
+enum TraceBlockType {
+  // Raw AllocEntry/FreeEntry records.
+  kTraceBlockRawRecords = 1,
+  // Call stack definitions. The payload is a TraceStackDictionaryHeader
+  // followed by |num_records| TraceStackEntry records, each followed by its
+  // frames.
+  kTraceBlockStackDictionary = 2,
+  // AllocByStackIdEntry/FreeEntry records.
+  kTraceBlockStackIdRecords = 3,
+  // Variable-length records, see below.
+  kTraceBlockCompactRecords = 4,
+};
+
+struct TraceBlockHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t payload_size;
+  uint32_t num_records;
+  // base::Hash() of the payload.
+  uint32_t checksum;
+};
+
+// Stack ids are assigned sequentially, starting at 0, in the order the stacks
+// are defined in the trace. Each dictionary block continues where the previous
+// one left off.
+struct TraceStackDictionaryHeader {
+  uint32_t first_stack_id;
+  uint32_t reserved;
+};
+
+struct TraceStackEntry {
+  uint32_t depth;
+  // base::Hash() of the frames, so the stack need not be rehashed on replay.
+  uint32_t hash;
+};
+
+// Compact records start with a one-byte opcode, followed by LEB128 varints:
+//   alloc: kCompactAllocOp, address delta, size, stack id
+//   free:  kCompactFreeOp, address delta
+// The address delta is the zigzag-encoded difference from the address of the
+// previous record in the same block, or from 0 for the first record, so each
+// block can be decoded on its own.
+const uint8_t kCompactAllocOp = 1;
+const uint8_t kCompactFreeOp = 2;
+
+inline uint64_t ZigZagEncode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t ZigZagDecode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline size_t AlignTraceSize(size_t size) {
+  return (size + kTraceAlignment - 1) & ~(kTraceAlignment - 1);
+}
+
+#endif  // TRACE_FORMAT_H_
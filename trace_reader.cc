@@ -0,0 +1,438 @@
+#include "trace_reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/hash.h"
+
+namespace {
+
+// Reads a LEB128 varint at |*data| into |*value| and advances |*data| past
+// it. Returns false if it runs past |end| or is too long.
+inline bool ReadVarint(const uint8_t** data, const uint8_t* end,
+                       uint64_t* value) {
+  const uint8_t* p = *data;
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t byte = *p++;
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *data = p;
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+MappedTraceFile::MappedTraceFile() : data_(nullptr), size_(0) {}
+
+MappedTraceFile::~MappedTraceFile() {
+  if (data_)
+    munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+bool MappedTraceFile::Open(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file.
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+
+  // Records are consumed front to back exactly once.
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+  data_ = static_cast<const uint8_t*>(addr);
+  size_ = st.st_size;
+  return true;
+}
+
+TraceReader::TraceReader()
+    : data_(nullptr),
+      size_(0),
+      offset_(0),
+      is_legacy_(false),
+      version_(0),
+      verify_checksums_(false),
+      error_(nullptr) {}
+
+TraceReader::~TraceReader() {}
+
+bool TraceReader::Init(const MappedTraceFile& file) {
+  data_ = file.data();
+  size_ = file.size();
+  offset_ = 0;
+
+  if (size_ < sizeof(TraceFileHeader) ||
+      memcmp(data_, kTraceMagic, sizeof(kTraceMagic)) != 0) {
+    return InitLegacy();
+  }
+
+  const TraceFileHeader* header =
+      reinterpret_cast<const TraceFileHeader*>(data_);
+  if (header->byte_order != kTraceByteOrderMark) {
+    error_ = "trace was written with a different byte order";
+    return false;
+  }
+  if (header->version == 0 || header->version > kTraceVersion) {
+    error_ = "unsupported trace version";
+    return false;
+  }
+  if (header->pointer_size != sizeof(void*)) {
+    error_ = "trace was written with a different pointer size";
+    return false;
+  }
+  if (header->header_size < sizeof(TraceFileHeader)) {
+    error_ = "invalid trace header size";
+    return false;
+  }
+  if (header->header_size > size_ ||
+      header->header_size % kTraceAlignment != 0) {
+    error_ = "truncated trace header";
+    return false;
+  }
+  version_ = header->version;
+
+  // Read the module table. Each entry and its name must end within the
+  // header, and |offset| never passes |header_size|, so the differences below
+  // cannot wrap around.
+  size_t offset = sizeof(TraceFileHeader);
+  for (uint32_t i = 0; i < header->num_modules; ++i) {
+    if (header->header_size - offset < sizeof(TraceModuleEntry)) {
+      error_ = "truncated module table";
+      return false;
+    }
+    const TraceModuleEntry* entry =
+        reinterpret_cast<const TraceModuleEntry*>(data_ + offset);
+    offset += sizeof(TraceModuleEntry);
+    if (header->header_size - offset < AlignTraceSize(entry->name_size)) {
+      error_ = "truncated module table";
+      return false;
+    }
+    TraceModule module;
+    module.addr = entry->addr;
+    module.size = entry->size;
+    module.name = reinterpret_cast<const char*>(data_ + offset);
+    module.name_size = entry->name_size;
+    modules_.push_back(module);
+    offset += AlignTraceSize(entry->name_size);
+  }
+
+  offset_ = header->header_size;
+  return true;
+}
+
+bool TraceReader::InitLegacy() {
+  if (size_ < 2 * sizeof(uint64_t)) {
+    error_ = "truncated trace header";
+    return false;
+  }
+  is_legacy_ = true;
+
+  TraceModule module = {};
+  memcpy(&module.addr, data_, sizeof(module.addr));
+  memcpy(&module.size, data_ + sizeof(module.addr), sizeof(module.size));
+  modules_.push_back(module);
+
+  offset_ = 2 * sizeof(uint64_t);
+  return true;
+}
+
+bool TraceReader::NextBlock(TraceBlock* block) {
+  if (error_ || offset_ >= size_)
+    return false;
+
+  if (is_legacy_) {
+    // The rest of the file is one unframed run of raw records.
+    block->type = kTraceBlockRawRecords;
+    block->num_records = 0;
+    block->payload = data_ + offset_;
+    block->payload_size = size_ - offset_;
+    block->offset = offset_;
+    offset_ = size_;
+    return true;
+  }
+
+  while (ReadBlock(block)) {
+    if (block->type != kTraceBlockStackDictionary)
+      return true;
+    if (!LoadStackDictionary(*block))
+      return false;
+  }
+  return false;
+}
+
+bool TraceReader::ReadBlock(TraceBlock* block) {
+  if (offset_ >= size_)
+    return false;
+  if (size_ - offset_ < sizeof(TraceBlockHeader)) {
+    error_ = "truncated block header";
+    return false;
+  }
+  const TraceBlockHeader* header =
+      reinterpret_cast<const TraceBlockHeader*>(data_ + offset_);
+  if (header->magic != kTraceBlockMagic) {
+    error_ = "bad block magic";
+    return false;
+  }
+  size_t payload_offset = offset_ + sizeof(TraceBlockHeader);
+  if (header->payload_size > size_ - payload_offset) {
+    error_ = "truncated block payload";
+    return false;
+  }
+
+  block->type = header->type;
+  block->num_records = header->num_records;
+  block->payload = data_ + payload_offset;
+  block->payload_size = header->payload_size;
+  block->offset = payload_offset;
+
+  if (verify_checksums_ &&
+      base::Hash(block->payload, block->payload_size) != header->checksum) {
+    error_ = "block checksum mismatch";
+    return false;
+  }
+
+  offset_ = payload_offset + header->payload_size;
+  // The padding of the last block may be cut off.
+  offset_ = AlignTraceSize(offset_) < size_ ? AlignTraceSize(offset_) : size_;
+  return true;
+}
+
+bool TraceReader::LoadStackDictionary(const TraceBlock& block) {
+  const uint8_t* data = block.payload;
+  const uint8_t* end = block.payload + block.payload_size;
+  if (end - data < static_cast<ptrdiff_t>(sizeof(TraceStackDictionaryHeader))) {
+    error_ = "truncated stack dictionary";
+    return false;
+  }
+  const TraceStackDictionaryHeader* header =
+      reinterpret_cast<const TraceStackDictionaryHeader*>(data);
+  if (header->first_stack_id != stacks_.size()) {
+    error_ = "stack dictionary out of sequence";
+    return false;
+  }
+  data += sizeof(*header);
+
+  // Each stack takes at least an entry, so a count that the payload cannot
+  // hold is corrupt, and must not size the reservation.
+  if (block.num_records >
+      static_cast<size_t>(end - data) / sizeof(TraceStackEntry)) {
+    error_ = "truncated stack dictionary";
+    return false;
+  }
+  stacks_.reserve(stacks_.size() + block.num_records);
+  for (uint32_t i = 0; i < block.num_records; ++i) {
+    if (end - data < static_cast<ptrdiff_t>(sizeof(TraceStackEntry))) {
+      error_ = "truncated stack dictionary";
+      return false;
+    }
+    const TraceStackEntry* entry =
+        reinterpret_cast<const TraceStackEntry*>(data);
+    data += sizeof(*entry);
+    size_t frames_size = sizeof(void*) * entry->depth;
+    if (static_cast<size_t>(end - data) < frames_size) {
+      error_ = "truncated stack dictionary";
+      return false;
+    }
+
+    TraceStack stack;
+    stack.depth = entry->depth;
+    stack.hash = entry->hash;
+    stack.frames = reinterpret_cast<const void* const*>(data);
+    if (verify_checksums_ && base::Hash(data, frames_size) != stack.hash) {
+      error_ = "stack hash mismatch";
+      return false;
+    }
+    stacks_.push_back(stack);
+    data += frames_size;
+  }
+  return true;
+}
+
+RecordDecoder::RecordDecoder(const TraceBlock& block,
+                             const std::vector<TraceStack>& stacks)
+    : block_(block),
+      stacks_(stacks),
+      next_(block.payload),
+      end_(block.payload + block.payload_size),
+      num_decoded_(0),
+      prev_addr_(0),
+      error_(false) {}
+
+RecordDecoder::~RecordDecoder() {}
+
+size_t RecordDecoder::Decode(TraceEvent* events, size_t max_events) {
+  if (error_)
+    return 0;
+
+  switch (block_.type) {
+  case kTraceBlockRawRecords:
+    return DecodeRawRecords(events, max_events);
+  case kTraceBlockStackIdRecords:
+    return DecodeStackIdRecords(events, max_events);
+  case kTraceBlockCompactRecords:
+    return DecodeCompactRecords(events, max_events);
+  default:
+    // Unknown block types are skipped.
+    return 0;
+  }
+}
+
+size_t RecordDecoder::DecodeRawRecords(TraceEvent* events, size_t max_events) {
+  const uint8_t* record = next_;
+  size_t num_events = 0;
+  while (num_events < max_events &&
+         end_ - record >= static_cast<ptrdiff_t>(sizeof(FreeEntry))) {
+    TraceEvent* event = &events[num_events];
+    uint32_t code = *reinterpret_cast<const uint32_t*>(record);
+    if (code == kAllocCode) {
+      if (end_ - record < static_cast<ptrdiff_t>(kAllocEntryHeaderSize)) {
+        error_ = true;
+        break;
+      }
+      const AllocEntry* alloc = reinterpret_cast<const AllocEntry*>(record);
+      const uint8_t* frames = record + kAllocEntryHeaderSize;
+      size_t frames_size = sizeof(void*) * alloc->depth;
+      if (static_cast<size_t>(end_ - frames) < frames_size) {
+        error_ = true;
+        break;
+      }
+      event->type = TraceEvent::kAlloc;
+      event->ptr = alloc->ptr;
+      event->size = alloc->size;
+      event->depth = alloc->depth;
+      event->stack = reinterpret_cast<const void* const*>(frames);
+      event->has_stack_hash = false;
+      record = frames + frames_size;
+    } else if (code == kFreeCode) {
+      const FreeEntry* free = reinterpret_cast<const FreeEntry*>(record);
+      event->type = TraceEvent::kFree;
+      event->ptr = free->ptr;
+      record += sizeof(FreeEntry);
+    } else {
+      error_ = true;
+      break;
+    }
+    ++num_events;
+  }
+  next_ = record;
+  CheckEndOfBlock(num_events, max_events);
+  return num_events;
+}
+
+size_t RecordDecoder::DecodeStackIdRecords(TraceEvent* events,
+                                           size_t max_events) {
+  const uint8_t* record = next_;
+  size_t num_events = 0;
+  while (num_events < max_events &&
+         end_ - record >= static_cast<ptrdiff_t>(sizeof(FreeEntry))) {
+    TraceEvent* event = &events[num_events];
+    uint32_t code = *reinterpret_cast<const uint32_t*>(record);
+    if (code == kAllocCode) {
+      if (end_ - record < static_cast<ptrdiff_t>(sizeof(AllocByStackIdEntry))) {
+        error_ = true;
+        break;
+      }
+      const AllocByStackIdEntry* alloc =
+          reinterpret_cast<const AllocByStackIdEntry*>(record);
+      if (alloc->stack_id >= stacks_.size()) {
+        error_ = true;
+        break;
+      }
+      const TraceStack& stack = stacks_[alloc->stack_id];
+      event->type = TraceEvent::kAlloc;
+      event->ptr = alloc->ptr;
+      event->size = alloc->size;
+      event->depth = stack.depth;
+      event->stack = stack.frames;
+      event->stack_hash = stack.hash;
+      event->has_stack_hash = true;
+      record += sizeof(AllocByStackIdEntry);
+    } else if (code == kFreeCode) {
+      const FreeEntry* free = reinterpret_cast<const FreeEntry*>(record);
+      event->type = TraceEvent::kFree;
+      event->ptr = free->ptr;
+      record += sizeof(FreeEntry);
+    } else {
+      error_ = true;
+      break;
+    }
+    ++num_events;
+  }
+  next_ = record;
+  CheckEndOfBlock(num_events, max_events);
+  return num_events;
+}
+
+size_t RecordDecoder::DecodeCompactRecords(TraceEvent* events,
+                                           size_t max_events) {
+  const uint8_t* record = next_;
+  uintptr_t addr = prev_addr_;
+  size_t num_events = 0;
+  while (num_events < max_events && record < end_) {
+    TraceEvent* event = &events[num_events];
+    const uint8_t* p = record + 1;
+    uint64_t delta;
+    if (!ReadVarint(&p, end_, &delta)) {
+      error_ = true;
+      break;
+    }
+    addr += ZigZagDecode(delta);
+    event->ptr = reinterpret_cast<const void*>(addr);
+
+    if (*record == kCompactAllocOp) {
+      uint64_t size;
+      uint64_t stack_id;
+      if (!ReadVarint(&p, end_, &size) || !ReadVarint(&p, end_, &stack_id) ||
+          stack_id >= stacks_.size()) {
+        error_ = true;
+        break;
+      }
+      const TraceStack& stack = stacks_[stack_id];
+      event->type = TraceEvent::kAlloc;
+      event->size = size;
+      event->depth = stack.depth;
+      event->stack = stack.frames;
+      event->stack_hash = stack.hash;
+      event->has_stack_hash = true;
+    } else if (*record == kCompactFreeOp) {
+      event->type = TraceEvent::kFree;
+    } else {
+      error_ = true;
+      break;
+    }
+    record = p;
+    ++num_events;
+  }
+  next_ = record;
+  prev_addr_ = addr;
+  CheckEndOfBlock(num_events, max_events);
+  return num_events;
+}
+
+void RecordDecoder::CheckEndOfBlock(size_t num_events, size_t max_events) {
+  num_decoded_ += num_events;
+
+  // Once the payload is used up, it should have held exactly the records
+  // promised by the block header.
+  if (num_events < max_events && !error_) {
+    error_ = next_ != end_ ||
+             (block_.num_records && block_.num_records != num_decoded_);
+  }
+}
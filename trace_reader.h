@@ -0,0 +1,199 @@
+#ifndef TRACE_READER_H_
+#define TRACE_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "trace_format.h"
+
+// Read-only memory mapping of an entire trace file. Records can be walked in
+// place without copying them out of the page cache.
+class MappedTraceFile {
+ public:
+  MappedTraceFile();
+  ~MappedTraceFile();
+
+  // Maps the file at |path|. Returns false if it could not be opened or mapped.
+  bool Open(const char* path);
+
+  const uint8_t* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedTraceFile);
+};
+
+// A single decoded alloc or free. |stack| points into the trace mapping.
+struct TraceEvent {
+  enum Type {
+    kAlloc,
+    kFree,
+  };
+
+  Type type;
+  uint32_t depth;
+  const void* ptr;
+  size_t size;
+  const void* const* stack;
+
+  // base::Hash() of |stack|, if |has_stack_hash| is set.
+  uint32_t stack_hash;
+  bool has_stack_hash;
+};
+
+// A call stack defined in a stack dictionary. |frames| points into the trace
+// mapping.
+struct TraceStack {
+  uint32_t depth;
+  uint32_t hash;
+  const void* const* frames;
+};
+
+// A mapped binary described by the trace.
+struct TraceModule {
+  uint64_t addr;
+  uint64_t size;
+  const char* name;
+  uint32_t name_size;
+};
+
+// A framed block of records within the trace mapping.
+struct TraceBlock {
+  uint32_t type;
+  uint32_t num_records;
+  const uint8_t* payload;
+  size_t payload_size;
+  // Offset of |payload| from the start of the file, for error reporting.
+  size_t offset;
+};
+
+// Parses the file header and walks the blocks of a mapped trace. Legacy traces
+// without a header are presented as a single raw record block.
+class TraceReader {
+ public:
+  TraceReader();
+  ~TraceReader();
+
+  // Parses and validates the trace header. |file| must outlive this object.
+  // Returns false and sets error() if the trace can't be read on this host.
+  bool Init(const MappedTraceFile& file);
+
+  // Returns the next block of records in |block|. Stack dictionary blocks are
+  // loaded into stacks() on the way. Returns false at the end of the trace, or
+  // if the next block is malformed, in which case error() is set.
+  bool NextBlock(TraceBlock* block);
+
+  // If set, NextBlock() verifies the checksum of each block payload.
+  void set_verify_checksums(bool verify) {
+    verify_checksums_ = verify;
+  }
+
+  bool is_legacy() const {
+    return is_legacy_;
+  }
+  uint32_t version() const {
+    return version_;
+  }
+  const std::vector<TraceModule>& modules() const {
+    return modules_;
+  }
+
+  // All call stacks defined so far, indexed by stack id.
+  const std::vector<TraceStack>& stacks() const {
+    return stacks_;
+  }
+
+  // Number of bytes consumed so far, from the start of the file.
+  size_t offset() const {
+    return offset_;
+  }
+
+  // Describes why Init() or NextBlock() failed, or null if nothing failed.
+  const char* error() const {
+    return error_;
+  }
+
+ private:
+  bool InitLegacy();
+
+  // Reads the next block header and payload at |offset_| into |block|.
+  bool ReadBlock(TraceBlock* block);
+
+  // Appends the stacks defined in |block| to |stacks_|.
+  bool LoadStackDictionary(const TraceBlock& block);
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t offset_;
+
+  bool is_legacy_;
+  uint32_t version_;
+  bool verify_checksums_;
+
+  std::vector<TraceModule> modules_;
+  std::vector<TraceStack> stacks_;
+
+  const char* error_;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceReader);
+};
+
+// Decodes the records of one block into TraceEvents, a batch at a time.
+class RecordDecoder {
+ public:
+  // |stacks| resolves stack ids, and must not change while decoding |block|.
+  RecordDecoder(const TraceBlock& block, const std::vector<TraceStack>& stacks);
+  ~RecordDecoder();
+
+  // Decodes up to |max_events| events into |events|. Returns the number of
+  // events decoded, which is 0 once the block has been used up or a bad record
+  // has been encountered.
+  size_t Decode(TraceEvent* events, size_t max_events);
+
+  // Set if decoding stopped at a bad record.
+  bool error() const {
+    return error_;
+  }
+
+  // Offset of the next record to decode, from the start of the file.
+  size_t offset() const {
+    return block_.offset + (next_ - block_.payload);
+  }
+
+ private:
+  size_t DecodeRawRecords(TraceEvent* events, size_t max_events);
+  size_t DecodeStackIdRecords(TraceEvent* events, size_t max_events);
+  size_t DecodeCompactRecords(TraceEvent* events, size_t max_events);
+
+  // Checks that the whole block was decoded once decoding stops short of
+  // |max_events|.
+  void CheckEndOfBlock(size_t num_events, size_t max_events);
+
+  const TraceBlock block_;
+  const std::vector<TraceStack>& stacks_;
+  const uint8_t* next_;
+  const uint8_t* end_;
+
+  // Number of records decoded so far from this block.
+  uint32_t num_decoded_;
+
+  // Address of the last compact record decoded, which the next one is
+  // delta-encoded against.
+  uintptr_t prev_addr_;
+
+  bool error_;
+
+  DISALLOW_COPY_AND_ASSIGN(RecordDecoder);
+};
+
+#endif  // TRACE_READER_H_
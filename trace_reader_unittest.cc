@@ -0,0 +1,585 @@
+#include "trace_reader.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "base/hash.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "trace_format.h"
+#include "trace_writer.h"
+
+namespace {
+
+// Returned by ReadTrace() for a record that could not be decoded.
+const char kBadRecord[] = "bad record";
+
+// Decode a few events at a time, so that blocks are decoded in several
+// batches.
+const size_t kBatchSize = 4;
+
+const void* const kStack1[] = {
+    reinterpret_cast<const void*>(0x401000),
+    reinterpret_cast<const void*>(0x402000),
+    reinterpret_cast<const void*>(0x403000),
+};
+const void* const kStack2[] = {
+    reinterpret_cast<const void*>(0x401000),
+    reinterpret_cast<const void*>(0x7f0000001000),
+};
+
+// An alloc or free to write to a test trace.
+struct Record {
+  TraceEvent::Type type;
+  uintptr_t addr;
+  uint32_t size;
+  uint32_t depth;
+  const void* const* stack;
+};
+
+// Addresses go up and down, so that compact records have address deltas of
+// both signs and several lengths. The last alloc has an empty stack.
+const Record kRecords[] = {
+    {TraceEvent::kAlloc, 0x10000, 16, 3, kStack1},
+    {TraceEvent::kAlloc, 0x8000, 1 << 20, 2, kStack2},
+    {TraceEvent::kFree, 0x10000, 0, 0, nullptr},
+    {TraceEvent::kAlloc, 0x7fffffff0000, 24, 3, kStack1},
+    {TraceEvent::kAlloc, 0x20, 0, 0, kStack1},
+    {TraceEvent::kFree, 0x8000, 0, 0, nullptr},
+    {TraceEvent::kFree, 0x7fffffff0000, 0, 0, nullptr},
+};
+const size_t kNumRecords = sizeof(kRecords) / sizeof(kRecords[0]);
+
+// Number of distinct stacks in |kRecords|.
+const size_t kNumStacks = 3;
+
+const TraceEncoding kEncodings[] = {
+    kTraceEncodingRawRecords,
+    kTraceEncodingStackIds,
+    kTraceEncodingCompact,
+};
+
+// Writes |records| out as a trace with two modules, and returns its contents.
+std::vector<uint8_t> WriteTrace(TraceEncoding encoding,
+                                const Record* records,
+                                size_t num_records) {
+  FILE* fp = tmpfile();
+  EXPECT_TRUE(fp);
+  if (!fp)
+    return std::vector<uint8_t>();
+
+  TraceWriter writer(fp, encoding);
+  writer.AddModule(0x400000, 0x10000, "main");
+  writer.AddModule(0x7f0000000000, 0x200000, "libc.so.6");
+  writer.WriteHeader();
+  for (size_t i = 0; i < num_records; ++i) {
+    const Record& record = records[i];
+    const void* ptr = reinterpret_cast<const void*>(record.addr);
+    if (record.type == TraceEvent::kAlloc)
+      writer.AddAlloc(ptr, record.size, record.depth, record.stack);
+    else
+      writer.AddFree(ptr);
+  }
+  EXPECT_TRUE(writer.Finish());
+  EXPECT_EQ(num_records, writer.num_records());
+
+  std::vector<uint8_t> trace(ftell(fp));
+  rewind(fp);
+  EXPECT_EQ(1u, fread(trace.data(), trace.size(), 1, fp));
+  fclose(fp);
+  return trace;
+}
+
+std::vector<uint8_t> WriteTrace(TraceEncoding encoding) {
+  return WriteTrace(encoding, kRecords, kNumRecords);
+}
+
+// Maps |trace| into |file| by way of a temporary file.
+bool MapTrace(const std::vector<uint8_t>& trace, MappedTraceFile* file) {
+  char path[] = "/tmp/trace_reader_unittest.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return false;
+  bool written = write(fd, trace.data(), trace.size()) ==
+                 static_cast<ssize_t>(trace.size());
+  close(fd);
+  // The mapping outlives the file.
+  bool mapped = written && file->Open(path);
+  unlink(path);
+  return mapped;
+}
+
+// Decodes every block left in |reader| into |events|. Returns false if a
+// block or a record was malformed.
+bool DecodeAll(TraceReader* reader, std::vector<TraceEvent>* events) {
+  TraceBlock block;
+  while (reader->NextBlock(&block)) {
+    RecordDecoder decoder(block, reader->stacks());
+    TraceEvent batch[kBatchSize];
+    while (size_t num_events = decoder.Decode(batch, kBatchSize))
+      events->insert(events->end(), batch, batch + num_events);
+    if (decoder.error())
+      return false;
+  }
+  return !reader->error();
+}
+
+// Reads |trace| through. Returns the reader's error, kBadRecord if a record
+// could not be decoded, or null if the whole trace was read.
+const char* ReadTrace(const std::vector<uint8_t>& trace,
+                      bool verify_checksums) {
+  MappedTraceFile file;
+  if (!MapTrace(trace, &file))
+    return "could not map trace";
+  TraceReader reader;
+  reader.set_verify_checksums(verify_checksums);
+  if (!reader.Init(file))
+    return reader.error();
+  std::vector<TraceEvent> events;
+  if (!DecodeAll(&reader, &events))
+    return reader.error() ? reader.error() : kBadRecord;
+  return nullptr;
+}
+
+const char* ReadTrace(const std::vector<uint8_t>& trace) {
+  return ReadTrace(trace, false);
+}
+
+TraceFileHeader* GetFileHeader(std::vector<uint8_t>* trace) {
+  return reinterpret_cast<TraceFileHeader*>(trace->data());
+}
+
+// Returns the headers of the blocks in |trace|, in order.
+std::vector<TraceBlockHeader*> GetBlocks(std::vector<uint8_t>* trace) {
+  std::vector<TraceBlockHeader*> blocks;
+  size_t offset = GetFileHeader(trace)->header_size;
+  while (offset + sizeof(TraceBlockHeader) <= trace->size()) {
+    TraceBlockHeader* header =
+        reinterpret_cast<TraceBlockHeader*>(trace->data() + offset);
+    blocks.push_back(header);
+    offset += sizeof(*header) + AlignTraceSize(header->payload_size);
+  }
+  return blocks;
+}
+
+// Returns the header of the last block in |trace|, which holds the records of
+// a short trace.
+TraceBlockHeader* GetRecordBlock(std::vector<uint8_t>* trace) {
+  return GetBlocks(trace).back();
+}
+
+uint8_t* GetPayload(TraceBlockHeader* header) {
+  return reinterpret_cast<uint8_t*>(header + 1);
+}
+
+size_t GetOffset(const std::vector<uint8_t>& trace,
+                 const TraceBlockHeader* header) {
+  return reinterpret_cast<const uint8_t*>(header) - trace.data();
+}
+
+// Recomputes the checksum of the block at |header| after its payload changed.
+void UpdateChecksum(TraceBlockHeader* header) {
+  header->checksum = base::Hash(GetPayload(header), header->payload_size);
+}
+
+// Appends a block with |payload| to |trace|.
+void AppendBlock(uint32_t type,
+                 const std::vector<uint8_t>& payload,
+                 uint32_t num_records,
+                 std::vector<uint8_t>* trace) {
+  TraceBlockHeader header;
+  header.magic = kTraceBlockMagic;
+  header.type = type;
+  header.payload_size = payload.size();
+  header.num_records = num_records;
+  header.checksum = base::Hash(payload.data(), payload.size());
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&header);
+  trace->insert(trace->end(), bytes, bytes + sizeof(header));
+  trace->insert(trace->end(), payload.begin(), payload.end());
+  trace->resize(AlignTraceSize(trace->size()));
+}
+
+void ExpectEvents(const Record* records,
+                  size_t num_records,
+                  const std::vector<TraceEvent>& events,
+                  bool has_stack_hash) {
+  ASSERT_EQ(num_records, events.size());
+  for (size_t i = 0; i < num_records; ++i) {
+    const Record& record = records[i];
+    const TraceEvent& event = events[i];
+    ASSERT_EQ(record.type, event.type) << "event " << i;
+    EXPECT_EQ(reinterpret_cast<const void*>(record.addr), event.ptr);
+    if (record.type != TraceEvent::kAlloc)
+      continue;
+
+    EXPECT_EQ(record.size, event.size);
+    ASSERT_EQ(record.depth, event.depth);
+    for (uint32_t j = 0; j < record.depth; ++j)
+      EXPECT_EQ(record.stack[j], event.stack[j]);
+    EXPECT_EQ(has_stack_hash, event.has_stack_hash);
+    if (has_stack_hash) {
+      EXPECT_EQ(base::Hash(record.stack, sizeof(void*) * record.depth),
+                event.stack_hash);
+    }
+  }
+}
+
+}  // namespace
+
+TEST(TraceReaderTest, RoundTrip) {
+  for (TraceEncoding encoding : kEncodings) {
+    std::vector<uint8_t> trace = WriteTrace(encoding);
+    MappedTraceFile file;
+    ASSERT_TRUE(MapTrace(trace, &file));
+    TraceReader reader;
+    reader.set_verify_checksums(true);
+    ASSERT_TRUE(reader.Init(file));
+    EXPECT_FALSE(reader.is_legacy());
+    EXPECT_EQ(kTraceVersion, reader.version());
+
+    ASSERT_EQ(2u, reader.modules().size());
+    const TraceModule& main = reader.modules()[0];
+    EXPECT_EQ(0x400000u, main.addr);
+    EXPECT_EQ(0x10000u, main.size);
+    EXPECT_EQ("main", std::string(main.name, main.name_size));
+    const TraceModule& libc = reader.modules()[1];
+    EXPECT_EQ(0x7f0000000000u, libc.addr);
+    EXPECT_EQ(0x200000u, libc.size);
+    EXPECT_EQ("libc.so.6", std::string(libc.name, libc.name_size));
+
+    std::vector<TraceEvent> events;
+    EXPECT_TRUE(DecodeAll(&reader, &events));
+    EXPECT_EQ(nullptr, reader.error());
+    EXPECT_EQ(trace.size(), reader.offset());
+
+    bool has_stack_ids = encoding != kTraceEncodingRawRecords;
+    ExpectEvents(kRecords, kNumRecords, events, has_stack_ids);
+    EXPECT_EQ(has_stack_ids ? kNumStacks : 0u, reader.stacks().size());
+  }
+}
+
+// Stacks first seen after the first block are defined in later dictionary
+// blocks, which continue the stack ids of the earlier ones. Compact address
+// deltas start over in each block.
+TEST(TraceReaderTest, RoundTripManyBlocks) {
+  const size_t kNumAllocs = 300000;
+  const size_t kAllocsPerStack = 1000;
+  std::vector<const void*> frames(kNumAllocs / kAllocsPerStack);
+  for (size_t i = 0; i < frames.size(); ++i)
+    frames[i] = reinterpret_cast<const void*>(0x401000 + 16 * i);
+  std::vector<Record> records(kNumAllocs);
+  for (size_t i = 0; i < kNumAllocs; ++i) {
+    records[i] = {TraceEvent::kAlloc, 0x10000 + 32 * i, 32, 1,
+                  &frames[i / kAllocsPerStack]};
+  }
+
+  for (TraceEncoding encoding : kEncodings) {
+    std::vector<uint8_t> trace =
+        WriteTrace(encoding, records.data(), records.size());
+    size_t num_record_blocks = 0;
+    for (TraceBlockHeader* header : GetBlocks(&trace)) {
+      if (header->type != kTraceBlockStackDictionary)
+        ++num_record_blocks;
+    }
+    EXPECT_GT(num_record_blocks, 1u);
+
+    MappedTraceFile file;
+    ASSERT_TRUE(MapTrace(trace, &file));
+    TraceReader reader;
+    ASSERT_TRUE(reader.Init(file));
+    std::vector<TraceEvent> events;
+    EXPECT_TRUE(DecodeAll(&reader, &events));
+
+    bool has_stack_ids = encoding != kTraceEncodingRawRecords;
+    ExpectEvents(records.data(), records.size(), events, has_stack_ids);
+    EXPECT_EQ(has_stack_ids ? frames.size() : 0u, reader.stacks().size());
+  }
+}
+
+// A trace without a header is read as one unframed run of raw records.
+TEST(TraceReaderTest, LegacyTrace) {
+  std::vector<uint8_t> framed = WriteTrace(kTraceEncodingRawRecords);
+  TraceBlockHeader* header = GetRecordBlock(&framed);
+  const uint8_t* payload = GetPayload(header);
+
+  const uint64_t kMain[] = {0x400000, 0x10000};
+  const uint8_t* main = reinterpret_cast<const uint8_t*>(kMain);
+  std::vector<uint8_t> trace(main, main + sizeof(kMain));
+  trace.insert(trace.end(), payload, payload + header->payload_size);
+
+  MappedTraceFile file;
+  ASSERT_TRUE(MapTrace(trace, &file));
+  TraceReader reader;
+  ASSERT_TRUE(reader.Init(file));
+  EXPECT_TRUE(reader.is_legacy());
+  ASSERT_EQ(1u, reader.modules().size());
+  EXPECT_EQ(0x400000u, reader.modules()[0].addr);
+  EXPECT_EQ(0x10000u, reader.modules()[0].size);
+
+  std::vector<TraceEvent> events;
+  EXPECT_TRUE(DecodeAll(&reader, &events));
+  ExpectEvents(kRecords, kNumRecords, events, false);
+}
+
+TEST(TraceReaderTest, BadFileHeader) {
+  const std::vector<uint8_t> good = WriteTrace(kTraceEncodingCompact);
+  ASSERT_EQ(nullptr, ReadTrace(good));
+
+  std::vector<uint8_t> trace = good;
+  GetFileHeader(&trace)->byte_order = 0x04030201;
+  EXPECT_STREQ("trace was written with a different byte order",
+               ReadTrace(trace));
+
+  trace = good;
+  GetFileHeader(&trace)->version = 0;
+  EXPECT_STREQ("unsupported trace version", ReadTrace(trace));
+  GetFileHeader(&trace)->version = kTraceVersion + 1;
+  EXPECT_STREQ("unsupported trace version", ReadTrace(trace));
+
+  trace = good;
+  GetFileHeader(&trace)->pointer_size = sizeof(void*) / 2;
+  EXPECT_STREQ("trace was written with a different pointer size",
+               ReadTrace(trace));
+
+  trace = good;
+  GetFileHeader(&trace)->header_size = sizeof(TraceFileHeader) - kTraceAlignment;
+  EXPECT_STREQ("invalid trace header size", ReadTrace(trace));
+
+  trace = good;
+  GetFileHeader(&trace)->header_size = AlignTraceSize(trace.size() + 1);
+  EXPECT_STREQ("truncated trace header", ReadTrace(trace));
+  GetFileHeader(&trace)->header_size = sizeof(TraceFileHeader) + 1;
+  EXPECT_STREQ("truncated trace header", ReadTrace(trace));
+
+  // Too short for a header of either kind.
+  trace = good;
+  trace.resize(2 * sizeof(uint64_t) - 1);
+  EXPECT_STREQ("truncated trace header", ReadTrace(trace));
+}
+
+TEST(TraceReaderTest, BadModuleTable) {
+  const std::vector<uint8_t> good = WriteTrace(kTraceEncodingCompact);
+
+  // One module more than the header holds.
+  std::vector<uint8_t> trace = good;
+  GetFileHeader(&trace)->num_modules++;
+  EXPECT_STREQ("truncated module table", ReadTrace(trace));
+
+  // The name of the last module runs past the end of the header.
+  trace = good;
+  TraceModuleEntry* libc = reinterpret_cast<TraceModuleEntry*>(
+      trace.data() + sizeof(TraceFileHeader) + sizeof(TraceModuleEntry) +
+      AlignTraceSize(strlen("main")));
+  ASSERT_EQ(strlen("libc.so.6"), libc->name_size);
+  libc->name_size = AlignTraceSize(libc->name_size) + 1;
+  EXPECT_STREQ("truncated module table", ReadTrace(trace));
+
+  // The header ends within the last module entry.
+  trace = good;
+  GetFileHeader(&trace)->header_size =
+      sizeof(TraceFileHeader) + sizeof(TraceModuleEntry) +
+      AlignTraceSize(strlen("main")) + kTraceAlignment;
+  EXPECT_STREQ("truncated module table", ReadTrace(trace));
+}
+
+TEST(TraceReaderTest, BadBlockFraming) {
+  for (TraceEncoding encoding : kEncodings) {
+    std::vector<uint8_t> good = WriteTrace(encoding);
+    size_t offset = GetOffset(good, GetRecordBlock(&good));
+    size_t payload_size = GetRecordBlock(&good)->payload_size;
+    size_t payload_end = offset + sizeof(TraceBlockHeader) + payload_size;
+
+    std::vector<uint8_t> trace = good;
+    trace.resize(offset + sizeof(TraceBlockHeader) - 1);
+    EXPECT_STREQ("truncated block header", ReadTrace(trace));
+
+    trace = good;
+    GetRecordBlock(&trace)->magic ^= 1;
+    EXPECT_STREQ("bad block magic", ReadTrace(trace));
+
+    trace = good;
+    trace.resize(payload_end - 1);
+    EXPECT_STREQ("truncated block payload", ReadTrace(trace));
+
+    // The padding of the last block may be missing.
+    trace = good;
+    trace.resize(payload_end);
+    EXPECT_EQ(nullptr, ReadTrace(trace));
+
+    // Checksums are only checked on request.
+    trace = good;
+    GetRecordBlock(&trace)->checksum ^= 1;
+    EXPECT_EQ(nullptr, ReadTrace(trace));
+    EXPECT_STREQ("block checksum mismatch", ReadTrace(trace, true));
+  }
+}
+
+TEST(TraceReaderTest, UnknownBlockTypeIsSkipped) {
+  std::vector<uint8_t> trace = WriteTrace(kTraceEncodingCompact);
+  AppendBlock(kTraceBlockCompactRecords + 100, std::vector<uint8_t>(5, 0xff), 1,
+              &trace);
+
+  MappedTraceFile file;
+  ASSERT_TRUE(MapTrace(trace, &file));
+  TraceReader reader;
+  ASSERT_TRUE(reader.Init(file));
+  std::vector<TraceEvent> events;
+  EXPECT_TRUE(DecodeAll(&reader, &events));
+  ExpectEvents(kRecords, kNumRecords, events, true);
+}
+
+TEST(TraceReaderTest, BadStackDictionary) {
+  for (TraceEncoding encoding :
+       {kTraceEncodingStackIds, kTraceEncodingCompact}) {
+    std::vector<uint8_t> good = WriteTrace(encoding);
+    ASSERT_EQ(kTraceBlockStackDictionary, GetBlocks(&good)[0]->type);
+
+    // The first dictionary must start at stack id 0.
+    std::vector<uint8_t> trace = good;
+    TraceBlockHeader* dictionary = GetBlocks(&trace)[0];
+    reinterpret_cast<TraceStackDictionaryHeader*>(GetPayload(dictionary))
+        ->first_stack_id = 1;
+    UpdateChecksum(dictionary);
+    EXPECT_STREQ("stack dictionary out of sequence", ReadTrace(trace));
+
+    // A dictionary that continues where the previous one left off is fine,
+    // but one that repeats it is not.
+    trace = good;
+    std::vector<uint8_t> payload(sizeof(TraceStackDictionaryHeader) +
+                                 sizeof(TraceStackEntry));
+    reinterpret_cast<TraceStackDictionaryHeader*>(payload.data())
+        ->first_stack_id = kNumStacks;
+    AppendBlock(kTraceBlockStackDictionary, payload, 1, &trace);
+    EXPECT_EQ(nullptr, ReadTrace(trace));
+    AppendBlock(kTraceBlockStackDictionary, payload, 1, &trace);
+    EXPECT_STREQ("stack dictionary out of sequence", ReadTrace(trace));
+
+    // More stacks than the payload can hold.
+    trace = good;
+    GetBlocks(&trace)[0]->num_records = kNumStacks + 1;
+    EXPECT_STREQ("truncated stack dictionary", ReadTrace(trace));
+    GetBlocks(&trace)[0]->num_records = 0xffffffff;
+    EXPECT_STREQ("truncated stack dictionary", ReadTrace(trace));
+
+    // A stack deeper than the payload.
+    trace = good;
+    dictionary = GetBlocks(&trace)[0];
+    TraceStackEntry* entry = reinterpret_cast<TraceStackEntry*>(
+        GetPayload(dictionary) + sizeof(TraceStackDictionaryHeader));
+    ASSERT_EQ(3u, entry->depth);
+    entry->depth = 1 << 20;
+    UpdateChecksum(dictionary);
+    EXPECT_STREQ("truncated stack dictionary", ReadTrace(trace));
+
+    // A dictionary too short for its own header.
+    trace = good;
+    AppendBlock(kTraceBlockStackDictionary,
+                std::vector<uint8_t>(sizeof(TraceStackDictionaryHeader) - 1),
+                0, &trace);
+    EXPECT_STREQ("truncated stack dictionary", ReadTrace(trace));
+
+    // Stack hashes are only checked on request.
+    trace = good;
+    dictionary = GetBlocks(&trace)[0];
+    entry = reinterpret_cast<TraceStackEntry*>(
+        GetPayload(dictionary) + sizeof(TraceStackDictionaryHeader));
+    entry->hash ^= 1;
+    UpdateChecksum(dictionary);
+    EXPECT_EQ(nullptr, ReadTrace(trace));
+    EXPECT_STREQ("stack hash mismatch", ReadTrace(trace, true));
+  }
+}
+
+TEST(TraceReaderTest, WrongNumRecords) {
+  for (TraceEncoding encoding : kEncodings) {
+    std::vector<uint8_t> trace = WriteTrace(encoding);
+    TraceBlockHeader* header = GetRecordBlock(&trace);
+    ASSERT_EQ(kNumRecords, header->num_records);
+
+    header->num_records = kNumRecords + 1;
+    EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+    header->num_records = kNumRecords - 1;
+    EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+  }
+}
+
+TEST(TraceReaderTest, BadRecordCode) {
+  for (TraceEncoding encoding : kEncodings) {
+    std::vector<uint8_t> trace = WriteTrace(encoding);
+    uint8_t* payload = GetPayload(GetRecordBlock(&trace));
+    if (encoding == kTraceEncodingCompact) {
+      ASSERT_EQ(kCompactAllocOp, payload[0]);
+      payload[0] = kCompactFreeOp + 1;
+    } else {
+      uint32_t* code = reinterpret_cast<uint32_t*>(payload);
+      ASSERT_EQ(kAllocCode, *code);
+      *code = kAllocCode ^ 1;
+    }
+    EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+  }
+}
+
+TEST(TraceReaderTest, RawStackPastEndOfBlock) {
+  std::vector<uint8_t> trace = WriteTrace(kTraceEncodingRawRecords);
+  AllocEntry* alloc =
+      reinterpret_cast<AllocEntry*>(GetPayload(GetRecordBlock(&trace)));
+  ASSERT_EQ(3u, alloc->depth);
+  alloc->depth = 1 << 20;
+  EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+}
+
+TEST(TraceReaderTest, StackIdOutOfRange) {
+  std::vector<uint8_t> trace = WriteTrace(kTraceEncodingStackIds);
+  AllocByStackIdEntry* alloc = reinterpret_cast<AllocByStackIdEntry*>(
+      GetPayload(GetRecordBlock(&trace)));
+  ASSERT_EQ(0u, alloc->stack_id);
+  alloc->stack_id = kNumStacks - 1;
+  EXPECT_EQ(nullptr, ReadTrace(trace));
+  alloc->stack_id = kNumStacks;
+  EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+
+  // A single alloc, whose stack id is the last byte of the payload.
+  const Record kAlloc = {TraceEvent::kAlloc, 0x10000, 16, 3, kStack1};
+  trace = WriteTrace(kTraceEncodingCompact, &kAlloc, 1);
+  TraceBlockHeader* header = GetRecordBlock(&trace);
+  uint8_t* stack_id = GetPayload(header) + header->payload_size - 1;
+  ASSERT_EQ(0u, *stack_id);
+  *stack_id = 1;
+  EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+  // Still out of range as a two-byte varint, which takes one more byte than
+  // the payload has.
+  *stack_id = 0x80;
+  EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+}
+
+TEST(TraceReaderTest, TruncatedVarint) {
+  // The address delta, size and stack id of this alloc take 7, 3 and 1 bytes.
+  const Record kAlloc = {TraceEvent::kAlloc, 0x7fffffff0000, 1 << 20, 3,
+                         kStack1};
+  const std::vector<uint8_t> good =
+      WriteTrace(kTraceEncodingCompact, &kAlloc, 1);
+  std::vector<uint8_t> trace = good;
+  ASSERT_EQ(1u + 7 + 3 + 1, GetRecordBlock(&trace)->payload_size);
+  ASSERT_EQ(nullptr, ReadTrace(trace));
+
+  // Cut the record short at every byte.
+  for (size_t size = 1; size < 1 + 7 + 3 + 1; ++size) {
+    trace = good;
+    GetRecordBlock(&trace)->payload_size = size;
+    EXPECT_STREQ(kBadRecord, ReadTrace(trace)) << "payload size " << size;
+  }
+
+  // A varint longer than 64 bits.
+  trace = WriteTrace(kTraceEncodingCompact, nullptr, 0);
+  std::vector<uint8_t> payload(1, kCompactFreeOp);
+  payload.insert(payload.end(), 10, 0x80);
+  payload.push_back(0x01);
+  AppendBlock(kTraceBlockCompactRecords, payload, 1, &trace);
+  EXPECT_STREQ(kBadRecord, ReadTrace(trace));
+}
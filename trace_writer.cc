@@ -0,0 +1,219 @@
+#include "trace_writer.h"
+
+#include <string.h>
+
+#include <utility>
+
+#include "base/hash.h"
+
+namespace {
+
+// Start a new block once the current one reaches this many payload bytes.
+// Blocks are the unit of validation and of parallel decoding, so they should
+// be large enough to amortize their headers but small enough to spread a trace
+// over several decoders.
+const size_t kTargetBlockSize = 1 << 20;
+
+const uint8_t kPadding[kTraceAlignment] = {};
+
+// Appends |value| to |out| as a LEB128 varint.
+void AppendVarint(uint64_t value, std::vector<uint8_t>* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(static_cast<uint8_t>(value));
+}
+
+}  // namespace
+
+TraceWriter::TraceWriter(FILE* fp, TraceEncoding encoding)
+    : fp_(fp),
+      encoding_(encoding),
+      num_block_records_(0),
+      prev_addr_(0),
+      num_dictionary_stacks_(0),
+      num_records_(0),
+      write_failed_(false) {
+  block_.reserve(kTargetBlockSize);
+}
+
+TraceWriter::~TraceWriter() {}
+
+void TraceWriter::AddModule(uint64_t addr, uint64_t size, const char* name) {
+  modules_.push_back({addr, size, name});
+}
+
+void TraceWriter::WriteHeader() {
+  TraceFileHeader header;
+  memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+  header.version = kTraceVersion;
+  header.byte_order = kTraceByteOrderMark;
+  header.pointer_size = sizeof(void*);
+  header.num_modules = modules_.size();
+  header.header_size = sizeof(header);
+  for (const Module& module : modules_) {
+    header.header_size +=
+        sizeof(TraceModuleEntry) + AlignTraceSize(module.name.size());
+  }
+  Write(&header, sizeof(header));
+
+  for (const Module& module : modules_) {
+    TraceModuleEntry entry = {};
+    entry.addr = module.addr;
+    entry.size = module.size;
+    entry.name_size = module.name.size();
+    Write(&entry, sizeof(entry));
+    Write(module.name.data(), entry.name_size);
+    Write(kPadding, AlignTraceSize(entry.name_size) - entry.name_size);
+  }
+}
+
+void TraceWriter::AddAlloc(const void* ptr,
+                           uint32_t size,
+                           uint32_t depth,
+                           const void* const stack[]) {
+  size_t offset = block_.size();
+  if (encoding_ == kTraceEncodingCompact) {
+    uint32_t stack_id = GetStackId(depth, stack);
+    block_.push_back(kCompactAllocOp);
+    AppendCompactAddress(ptr);
+    AppendVarint(size, &block_);
+    AppendVarint(stack_id, &block_);
+  } else if (encoding_ == kTraceEncodingStackIds) {
+    AllocByStackIdEntry entry = {};
+    entry.code = kAllocCode;
+    entry.stack_id = GetStackId(depth, stack);
+    entry.ptr = ptr;
+    entry.size = size;
+
+    block_.resize(offset + sizeof(entry));
+    memcpy(&block_[offset], &entry, sizeof(entry));
+  } else {
+    AllocEntry entry = {};
+    entry.code = kAllocCode;
+    entry.ptr = ptr;
+    entry.size = size;
+    entry.depth = depth;
+
+    block_.resize(offset + kAllocEntryHeaderSize + sizeof(*stack) * depth);
+    memcpy(&block_[offset], &entry, kAllocEntryHeaderSize);
+    if (depth) {
+      memcpy(&block_[offset + kAllocEntryHeaderSize], stack,
+             sizeof(*stack) * depth);
+    }
+  }
+
+  ++num_block_records_;
+  if (block_.size() >= kTargetBlockSize)
+    FlushBlock();
+}
+
+void TraceWriter::AddFree(const void* ptr) {
+  if (encoding_ == kTraceEncodingCompact) {
+    block_.push_back(kCompactFreeOp);
+    AppendCompactAddress(ptr);
+
+    ++num_block_records_;
+    if (block_.size() >= kTargetBlockSize)
+      FlushBlock();
+    return;
+  }
+
+  FreeEntry entry = {};
+  entry.code = kFreeCode;
+  entry.ptr = ptr;
+
+  size_t offset = block_.size();
+  block_.resize(offset + sizeof(entry));
+  memcpy(&block_[offset], &entry, sizeof(entry));
+
+  ++num_block_records_;
+  if (block_.size() >= kTargetBlockSize)
+    FlushBlock();
+}
+
+bool TraceWriter::Finish() {
+  FlushBlock();
+  if (fflush(fp_) != 0)
+    write_failed_ = true;
+  return !write_failed_;
+}
+
+uint32_t TraceWriter::GetStackId(uint32_t depth, const void* const stack[]) {
+  size_t frames_size = sizeof(*stack) * depth;
+  std::string key(reinterpret_cast<const char*>(stack), frames_size);
+  auto iter = stack_ids_.find(key);
+  if (iter != stack_ids_.end())
+    return iter->second;
+
+  uint32_t id = stack_ids_.size();
+  stack_ids_.emplace(std::move(key), id);
+
+  if (num_dictionary_stacks_ == 0) {
+    TraceStackDictionaryHeader header = {};
+    header.first_stack_id = id;
+    dictionary_block_.resize(sizeof(header));
+    memcpy(&dictionary_block_[0], &header, sizeof(header));
+  }
+  TraceStackEntry entry;
+  entry.depth = depth;
+  entry.hash = base::Hash(stack, frames_size);
+  size_t offset = dictionary_block_.size();
+  dictionary_block_.resize(offset + sizeof(entry) + frames_size);
+  memcpy(&dictionary_block_[offset], &entry, sizeof(entry));
+  if (depth)
+    memcpy(&dictionary_block_[offset + sizeof(entry)], stack, frames_size);
+  ++num_dictionary_stacks_;
+
+  return id;
+}
+
+void TraceWriter::FlushBlock() {
+  if (num_dictionary_stacks_ > 0) {
+    WriteBlock(kTraceBlockStackDictionary, dictionary_block_,
+               num_dictionary_stacks_);
+    num_dictionary_stacks_ = 0;
+    dictionary_block_.clear();
+  }
+
+  if (num_block_records_ == 0)
+    return;
+
+  TraceBlockType type = kTraceBlockRawRecords;
+  if (encoding_ == kTraceEncodingStackIds)
+    type = kTraceBlockStackIdRecords;
+  else if (encoding_ == kTraceEncodingCompact)
+    type = kTraceBlockCompactRecords;
+  WriteBlock(type, block_, num_block_records_);
+  num_records_ += num_block_records_;
+  num_block_records_ = 0;
+  block_.clear();
+  // Each block is decoded on its own.
+  prev_addr_ = 0;
+}
+
+void TraceWriter::WriteBlock(TraceBlockType type,
+                             const std::vector<uint8_t>& payload,
+                             uint32_t num_records) {
+  TraceBlockHeader header;
+  header.magic = kTraceBlockMagic;
+  header.type = type;
+  header.payload_size = payload.size();
+  header.num_records = num_records;
+  header.checksum = base::Hash(payload.data(), payload.size());
+  Write(&header, sizeof(header));
+  Write(payload.data(), payload.size());
+  Write(kPadding, AlignTraceSize(payload.size()) - payload.size());
+}
+
+void TraceWriter::AppendCompactAddress(const void* ptr) {
+  uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+  AppendVarint(ZigZagEncode(static_cast<int64_t>(addr - prev_addr_)), &block_);
+  prev_addr_ = addr;
+}
+
+void TraceWriter::Write(const void* data, size_t size) {
+  if (size && fwrite(data, size, 1, fp_) != 1)
+    write_failed_ = true;
+}
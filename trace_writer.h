@@ -0,0 +1,104 @@
+#ifndef TRACE_WRITER_H_
+#define TRACE_WRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base/macros.h"
+#include "trace_format.h"
+
+// How alloc records refer to their call stacks.
+enum TraceEncoding {
+  // Each alloc record carries its stack frames inline.
+  kTraceEncodingRawRecords,
+  // Each distinct stack is written once to a stack dictionary, and alloc
+  // records refer to it by id.
+  kTraceEncodingStackIds,
+  // Like kTraceEncodingStackIds, but records are variable-length with
+  // delta-encoded addresses.
+  kTraceEncodingCompact,
+};
+
+// Writes a trace in the framed format described in trace_format.h. Records are
+// buffered and written out one block at a time.
+class TraceWriter {
+ public:
+  // Writes to |fp|, which remains owned by the caller.
+  TraceWriter(FILE* fp, TraceEncoding encoding);
+  ~TraceWriter();
+
+  // Adds a module to the header. The first module added is the main binary.
+  // |name| is copied. Must be called before WriteHeader().
+  void AddModule(uint64_t addr, uint64_t size, const char* name);
+
+  // Writes the file header and module table. Must be called before any record
+  // is added.
+  void WriteHeader();
+
+  void AddAlloc(const void* ptr,
+                uint32_t size,
+                uint32_t depth,
+                const void* const stack[]);
+  void AddFree(const void* ptr);
+
+  // Writes out any buffered records. Returns false if any write failed.
+  bool Finish();
+
+  uint64_t num_records() const {
+    return num_records_;
+  }
+
+ private:
+  // Returns the id of |stack|, adding it to the pending stack dictionary if it
+  // has not been seen before.
+  uint32_t GetStackId(uint32_t depth, const void* const stack[]);
+
+  // Writes the buffered records as a single block, preceded by any stacks they
+  // refer to that have not been written yet.
+  void FlushBlock();
+
+  void WriteBlock(TraceBlockType type,
+                  const std::vector<uint8_t>& payload,
+                  uint32_t num_records);
+
+  void Write(const void* data, size_t size);
+
+  // Appends a compact record address to |block_|.
+  void AppendCompactAddress(const void* ptr);
+
+  FILE* fp_;
+  const TraceEncoding encoding_;
+
+  struct Module {
+    uint64_t addr;
+    uint64_t size;
+    std::string name;
+  };
+  std::vector<Module> modules_;
+
+  // Payload of the block being built.
+  std::vector<uint8_t> block_;
+  uint32_t num_block_records_;
+
+  // Address of the last compact record added to |block_|.
+  uintptr_t prev_addr_;
+
+  // Ids of all stacks seen so far, keyed by the raw bytes of their frames.
+  std::unordered_map<std::string, uint32_t> stack_ids_;
+
+  // Payload of the stack dictionary block for stacks that have been assigned
+  // ids but not yet written.
+  std::vector<uint8_t> dictionary_block_;
+  uint32_t num_dictionary_stacks_;
+
+  uint64_t num_records_;
+  bool write_failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceWriter);
+};
+
+#endif  // TRACE_WRITER_H_
@@ -0,0 +1,134 @@
+// Compares the cost of unwinding the stack with UnwindFramePointers() and with
+// libgcc's _Unwind_Backtrace(), at several stack depths. Both are timed from
+// the bottom of a chain of calls somewhat deeper than the depth unwound, as a
+// malloc hook would be.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unwind.h>
+
+#include "base/hash.h"
+#include "stack_unwinder.h"
+
+namespace {
+
+const int kDepths[] = {4, 8, 16, 32};
+const int kMaxDepth = 32;
+
+// Extra frames between main() and the unwinds, beyond the depth unwound.
+const int kExtraFrames = 8;
+
+const int kNumIterations = 200000;
+
+enum Unwinder {
+  kFramePointers,
+  kUnwindBacktrace,
+};
+
+struct BacktraceState {
+  void** stack;
+  int depth;
+  int max_depth;
+};
+
+_Unwind_Reason_Code BacktraceCallback(struct _Unwind_Context* context,
+                                      void* arg) {
+  BacktraceState* state = static_cast<BacktraceState*>(arg);
+  // Frames are counted from -1 - skip, as the first one is that of
+  // UnwindWithLibgcc() itself.
+  if (state->depth >= 0) {
+    state->stack[state->depth] =
+        reinterpret_cast<void*>(_Unwind_GetIP(context));
+  }
+  return ++state->depth == state->max_depth ? _URC_END_OF_STACK
+                                            : _URC_NO_REASON;
+}
+
+// Unwinds like UnwindFramePointers(), including the hash of the frames, so
+// that the two do the same work.
+__attribute__((noinline))
+int UnwindWithLibgcc(void* stack[], int max_depth, int skip, uint32_t* hash) {
+  BacktraceState state = {stack, -1 - skip, max_depth};
+  _Unwind_Backtrace(&BacktraceCallback, &state);
+  int depth = state.depth < 0 ? 0 : state.depth;
+  *hash = base::Hash(stack, sizeof(*stack) * depth);
+  return depth;
+}
+
+double NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Returns the average time of an unwind of |depth| frames, in ns. Sets
+// |*num_frames| to the number of frames that were found.
+__attribute__((noinline))
+double TimeUnwinds(Unwinder unwinder, int depth, int* num_frames) {
+  void* stack[kMaxDepth];
+  uint32_t hash = 0;
+  uint32_t hash_sum = 0;
+  double start_ns = NowNs();
+  for (int i = 0; i < kNumIterations; ++i) {
+    *num_frames = unwinder == kFramePointers
+                      ? UnwindFramePointers(stack, depth, 0, &hash)
+                      : UnwindWithLibgcc(stack, depth, 0, &hash);
+    hash_sum += hash;
+  }
+  double elapsed_ns = NowNs() - start_ns;
+  // Keep the hashes live.
+  if (hash_sum == 1)
+    printf(" ");
+  return elapsed_ns / kNumIterations;
+}
+
+// Both unwinders should find the same frames. The first frame, the call site in
+// this function, differs between the two calls, so it is skipped.
+__attribute__((noinline))
+bool UnwindersAgree(int depth) {
+  void* fp_stack[kMaxDepth];
+  void* libgcc_stack[kMaxDepth];
+  uint32_t fp_hash;
+  uint32_t libgcc_hash;
+  int fp_depth = UnwindFramePointers(fp_stack, depth, 1, &fp_hash);
+  int libgcc_depth = UnwindWithLibgcc(libgcc_stack, depth, 1, &libgcc_hash);
+  if (fp_depth != libgcc_depth || fp_hash != libgcc_hash)
+    return false;
+  for (int i = 0; i < fp_depth; ++i) {
+    if (fp_stack[i] != libgcc_stack[i])
+      return false;
+  }
+  return true;
+}
+
+// Recurses |frames| more times, then runs the benchmark for |depth|.
+__attribute__((noinline))
+void RunAtDepth(int frames, int depth) {
+  if (frames > 0) {
+    RunAtDepth(frames - 1, depth);
+    // Not a tail call, so that each level keeps its frame.
+    __asm__ volatile("" ::: "memory");
+    return;
+  }
+
+  int fp_frames = 0;
+  int libgcc_frames = 0;
+  double fp_ns = TimeUnwinds(kFramePointers, depth, &fp_frames);
+  double libgcc_ns = TimeUnwinds(kUnwindBacktrace, depth, &libgcc_frames);
+  printf("%5d %8d %12.1f %8d %12.1f %7.1fx %s\n", depth, fp_frames, fp_ns,
+         libgcc_frames, libgcc_ns, libgcc_ns / fp_ns,
+         UnwindersAgree(depth) ? "yes" : "NO");
+}
+
+}  // namespace
+
+int main(int /* argc */, char* /* argv */[]) {
+  printf("Average time per unwind over %d unwinds, including the frame hash.\n",
+         kNumIterations);
+  printf("%5s %8s %12s %8s %12s %8s %s\n", "depth", "frames", "fp (ns)",
+         "frames", "libgcc (ns)", "speedup", "same frames");
+  for (int depth : kDepths)
+    RunAtDepth(depth + kExtraFrames, depth);
+  return 0;
+}